@@ -0,0 +1,59 @@
+   CALL _main
+   HALT
+_main:
+   PROC 12
+   LDLADDR 8
+   GETINT
+   LDLADDR 12
+   LDCINT 0
+   STOREW
+   LDLADDR 16
+   LDCINT 1
+   STOREW
+L0:
+   LDLADDR 16
+   LOADW
+   LDLADDR 8
+   LOADW
+   BG L1
+   LDLADDR 12
+   CALL _echo
+   LDLADDR 16
+   LDLADDR 16
+   LOADW
+   LDCINT 1
+   ADD
+   STOREW
+   BR L0
+L1:
+   LDCSTR "Sum: "
+   PUTSTR 5
+   LDLADDR 12
+   LOADW
+   PUTINT
+   PUTEOL
+   RET 0
+_echo:
+   PROC 4
+   LDLADDR 8
+   GETINT
+   LDLADDR -4
+   LOADW
+   LDLADDR -4
+   LOADW
+   LOADW
+   LDLADDR 8
+   LOADW
+   ADD
+   STOREW
+   LDLADDR 8
+   LOADW
+   PUTINT
+   LDCSTR " "
+   PUTSTR 1
+   LDLADDR -4
+   LOADW
+   LOADW
+   PUTINT
+   PUTEOL
+   RET 4
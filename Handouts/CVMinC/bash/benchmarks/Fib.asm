@@ -0,0 +1,40 @@
+   CALL _main
+   HALT
+_main:
+   LDCSTR "fib(30) = "
+   PUTSTR 10
+   ALLOC 4
+   LDCINT 30
+   CALL _fib
+   PUTINT
+   PUTEOL
+   RET 0
+_fib:
+   LDLADDR -4
+   LOADW
+   LDCINT 2
+   BGE L0
+   LDLADDR -8
+   LDLADDR -4
+   LOADW
+   STOREW
+   RET 4
+   BR L1
+L0:
+   LDLADDR -8
+   ALLOC 4
+   LDLADDR -4
+   LOADW
+   LDCINT 1
+   SUB
+   CALL _fib
+   ALLOC 4
+   LDLADDR -4
+   LOADW
+   LDCINT 2
+   SUB
+   CALL _fib
+   ADD
+   STOREW
+   RET 4
+L1:
@@ -0,0 +1,248 @@
+   CALL _main
+   HALT
+_main:
+   PROC 43220
+   LDLADDR 43212
+   LDCINT 0
+   STOREW
+L0:
+   LDLADDR 43212
+   LOADW
+   LDCINT 60
+   LDCINT 1
+   SUB
+   BG L1
+   LDLADDR 43216
+   LDCINT 0
+   STOREW
+L2:
+   LDLADDR 43216
+   LOADW
+   LDCINT 60
+   LDCINT 1
+   SUB
+   BG L3
+   LDLADDR 8
+   LDLADDR 43212
+   LOADW
+   LDCINT 240
+   MUL
+   ADD
+   LDLADDR 43216
+   LOADW
+   LDCINT 4
+   MUL
+   ADD
+   LDLADDR 43212
+   LOADW
+   LDLADDR 43216
+   LOADW
+   ADD
+   STOREW
+   LDLADDR 14408
+   LDLADDR 43212
+   LOADW
+   LDCINT 240
+   MUL
+   ADD
+   LDLADDR 43216
+   LOADW
+   LDCINT 4
+   MUL
+   ADD
+   LDLADDR 43212
+   LOADW
+   LDCINT 2
+   LDLADDR 43216
+   LOADW
+   MUL
+   SUB
+   STOREW
+   LDLADDR 43216
+   LDLADDR 43216
+   LOADW
+   LDCINT 1
+   ADD
+   STOREW
+   BR L2
+L3:
+   LDLADDR 43212
+   LDLADDR 43212
+   LOADW
+   LDCINT 1
+   ADD
+   STOREW
+   BR L0
+L1:
+   LDLADDR 43220
+   LDCINT 1
+   STOREW
+L4:
+   LDLADDR 43220
+   LOADW
+   LDCINT 8
+   BG L5
+   LDLADDR 8
+   LDLADDR 14408
+   LDLADDR 28808
+   CALL _multiply
+   LDLADDR 43220
+   LDLADDR 43220
+   LOADW
+   LDCINT 1
+   ADD
+   STOREW
+   BR L4
+L5:
+   LDLADDR 43208
+   LDCINT 0
+   STOREW
+   LDLADDR 43224
+   LDCINT 0
+   STOREW
+L6:
+   LDLADDR 43224
+   LOADW
+   LDCINT 60
+   LDCINT 1
+   SUB
+   BG L7
+   LDLADDR 43208
+   LDLADDR 43208
+   LOADW
+   LDLADDR 28808
+   LDLADDR 43224
+   LOADW
+   LDCINT 240
+   MUL
+   ADD
+   LDLADDR 43224
+   LOADW
+   LDCINT 4
+   MUL
+   ADD
+   LOADW
+   ADD
+   STOREW
+   LDLADDR 43224
+   LDLADDR 43224
+   LOADW
+   LDCINT 1
+   ADD
+   STOREW
+   BR L6
+L7:
+   LDCSTR "Trace of a*b: "
+   PUTSTR 14
+   LDLADDR 43208
+   LOADW
+   PUTINT
+   PUTEOL
+   RET 0
+_multiply:
+   PROC 16
+   LDLADDR 12
+   LDCINT 0
+   STOREW
+L8:
+   LDLADDR 12
+   LOADW
+   LDCINT 60
+   LDCINT 1
+   SUB
+   BG L9
+   LDLADDR 16
+   LDCINT 0
+   STOREW
+L10:
+   LDLADDR 16
+   LOADW
+   LDCINT 60
+   LDCINT 1
+   SUB
+   BG L11
+   LDLADDR 8
+   LDCINT 0
+   STOREW
+   LDLADDR 20
+   LDCINT 0
+   STOREW
+L12:
+   LDLADDR 20
+   LOADW
+   LDCINT 60
+   LDCINT 1
+   SUB
+   BG L13
+   LDLADDR 8
+   LDLADDR 8
+   LOADW
+   LDLADDR -12
+   LOADW
+   LDLADDR 12
+   LOADW
+   LDCINT 240
+   MUL
+   ADD
+   LDLADDR 20
+   LOADW
+   LDCINT 4
+   MUL
+   ADD
+   LOADW
+   LDLADDR -8
+   LOADW
+   LDLADDR 20
+   LOADW
+   LDCINT 240
+   MUL
+   ADD
+   LDLADDR 16
+   LOADW
+   LDCINT 4
+   MUL
+   ADD
+   LOADW
+   MUL
+   ADD
+   STOREW
+   LDLADDR 20
+   LDLADDR 20
+   LOADW
+   LDCINT 1
+   ADD
+   STOREW
+   BR L12
+L13:
+   LDLADDR -4
+   LOADW
+   LDLADDR 12
+   LOADW
+   LDCINT 240
+   MUL
+   ADD
+   LDLADDR 16
+   LOADW
+   LDCINT 4
+   MUL
+   ADD
+   LDLADDR 8
+   LOADW
+   STOREW
+   LDLADDR 16
+   LDLADDR 16
+   LOADW
+   LDCINT 1
+   ADD
+   STOREW
+   BR L10
+L11:
+   LDLADDR 12
+   LDLADDR 12
+   LOADW
+   LDCINT 1
+   ADD
+   STOREW
+   BR L8
+L9:
+   RET 12
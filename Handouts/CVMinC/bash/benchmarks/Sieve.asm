@@ -0,0 +1,176 @@
+   CALL _main
+   HALT
+_main:
+   PROC 8
+   LDLADDR 12
+   LDCINT 1
+   STOREW
+L0:
+   LDLADDR 12
+   LOADW
+   LDCINT 20
+   BG L1
+   LDLADDR 8
+   ALLOC 4
+   CALL _sieve
+   STOREW
+   LDLADDR 12
+   LDLADDR 12
+   LOADW
+   LDCINT 1
+   ADD
+   STOREW
+   BR L0
+L1:
+   LDCSTR "Primes below "
+   PUTSTR 13
+   LDCINT 30000
+   PUTINT
+   LDCSTR ": "
+   PUTSTR 2
+   LDLADDR 8
+   LOADW
+   PUTINT
+   PUTEOL
+   RET 0
+_sieve:
+   PROC 120020
+   LDLADDR 120016
+   LDCINT 0
+   STOREW
+L2:
+   LDLADDR 120016
+   LOADW
+   LDCINT 30000
+   LDCINT 1
+   SUB
+   BG L3
+   LDLADDR 8
+   LDLADDR 120016
+   LOADW
+   LDCINT 4
+   MUL
+   ADD
+   LDCINT 1
+   STOREW
+   LDLADDR 120016
+   LDLADDR 120016
+   LOADW
+   LDCINT 1
+   ADD
+   STOREW
+   BR L2
+L3:
+   LDLADDR 8
+   LDCINT 0
+   LDCINT 4
+   MUL
+   ADD
+   LDCINT 0
+   STOREW
+   LDLADDR 8
+   LDCINT 1
+   LDCINT 4
+   MUL
+   ADD
+   LDCINT 0
+   STOREW
+   LDLADDR 120020
+   LDCINT 2
+   STOREW
+L4:
+   LDLADDR 120020
+   LOADW
+   LDCINT 30000
+   LDCINT 1
+   SUB
+   BG L5
+   LDLADDR 8
+   LDLADDR 120020
+   LOADW
+   LDCINT 4
+   MUL
+   ADD
+   LOADW
+   LDCINT 1
+   BNE L6
+   LDLADDR 120012
+   LDLADDR 120020
+   LOADW
+   LDLADDR 120020
+   LOADW
+   MUL
+   STOREW
+L7:
+   LDLADDR 120012
+   LOADW
+   LDCINT 30000
+   BGE L8
+   LDLADDR 8
+   LDLADDR 120012
+   LOADW
+   LDCINT 4
+   MUL
+   ADD
+   LDCINT 0
+   STOREW
+   LDLADDR 120012
+   LDLADDR 120012
+   LOADW
+   LDLADDR 120020
+   LOADW
+   ADD
+   STOREW
+   BR L7
+L8:
+L6:
+   LDLADDR 120020
+   LDLADDR 120020
+   LOADW
+   LDCINT 1
+   ADD
+   STOREW
+   BR L4
+L5:
+   LDLADDR 120008
+   LDCINT 0
+   STOREW
+   LDLADDR 120024
+   LDCINT 0
+   STOREW
+L9:
+   LDLADDR 120024
+   LOADW
+   LDCINT 30000
+   LDCINT 1
+   SUB
+   BG L10
+   LDLADDR 8
+   LDLADDR 120024
+   LOADW
+   LDCINT 4
+   MUL
+   ADD
+   LOADW
+   LDCINT 1
+   BNE L11
+   LDLADDR 120008
+   LDLADDR 120008
+   LOADW
+   LDCINT 1
+   ADD
+   STOREW
+L11:
+   LDLADDR 120024
+   LDLADDR 120024
+   LOADW
+   LDCINT 1
+   ADD
+   STOREW
+   BR L9
+L10:
+   LDLADDR -4
+   LDLADDR 120008
+   LOADW
+   STOREW
+   RET 0
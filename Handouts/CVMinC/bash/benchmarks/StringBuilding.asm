@@ -0,0 +1,86 @@
+   CALL _main
+   HALT
+_main:
+   PROC 4
+   LDLADDR 8
+   LDCINT 1
+   STOREW
+L0:
+   LDLADDR 8
+   LOADW
+   LDCINT 200000
+   BG L1
+   LDLADDR 8
+   LOADW
+   CALL _writeLine
+   LDLADDR 8
+   LDLADDR 8
+   LOADW
+   LDCINT 1
+   ADD
+   STOREW
+   BR L0
+L1:
+   RET 0
+_writeLine:
+   PROC 376
+   LDLADDR 132
+   LDCSTR "0123456789"
+   STORE 24
+   LDLADDR 8
+   LDCSTR "Line "
+   STORE 14
+   LDLADDR 380
+   LDLADDR -4
+   LOADW
+   STOREW
+L2:
+   LDLADDR 380
+   LOADW
+   LDCINT 0
+   BLE L3
+   LDLADDR 8
+   LDCINT 4
+   ADD
+   LDLADDR 8
+   LOADW
+   LDCINT 2
+   MUL
+   ADD
+   LDLADDR 132
+   LDCINT 4
+   ADD
+   LDLADDR 380
+   LOADW
+   LDCINT 10
+   MOD
+   LDCINT 2
+   MUL
+   ADD
+   LOAD2B
+   STORE2B
+   LDLADDR 8
+   LDLADDR 8
+   LOADW
+   LDCINT 1
+   ADD
+   STOREW
+   LDLADDR 380
+   LDLADDR 380
+   LOADW
+   LDCINT 10
+   DIV
+   STOREW
+   BR L2
+L3:
+   LDLADDR 256
+   LDLADDR 8
+   LOAD 124
+   STORE 124
+   LDLADDR 256
+   LOAD 124
+   PUTSTR 60
+   LDCSTR ": the quick brown fox jumps over the lazy dog"
+   PUTSTR 45
+   PUTEOL
+   RET 4
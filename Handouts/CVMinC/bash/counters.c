@@ -0,0 +1,234 @@
+#include <time.h>
+#include "opcode.h"
+#include "vm.h"
+
+#if defined(__linux__)
+#define PERF_EVENTS 1
+#include <errno.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#else
+#define PERF_EVENTS 0
+#endif
+
+
+/**
+ * Hardware performance counters (cvm --counters).
+ *
+ * A context created with the counters option opens a perf event for each
+ * of the hardware events below when its program is loaded, and enables
+ * them only while the engine runs, so loading, translating, and the final
+ * flush of the output are not counted.  The events count this thread in
+ * user mode only, which perf_event_paranoid allows up to level 2.  Events
+ * that the kernel or the processor does not support (in many virtual
+ * machines, all of them) are reported as not counted; the wall and CPU
+ * time of the engine are measured either way.
+ *
+ * The events are opened one by one rather than as a group, so that one
+ * unsupported event does not lose the others.  If the kernel has more
+ * events than counters, it multiplexes them, and the counts are scaled by
+ * the time each event was enabled over the time it was counting.
+ */
+
+#define NUM_EVENTS 4
+
+struct Counters
+  {
+    int      fds[NUM_EVENTS];   // the perf events, or -1 if not opened
+    int      openError;         // errno of the first event that failed
+    int      numRuns;
+
+    // when the run started, and the time of all runs so far
+    struct timespec wallStart;
+    clock_t         cpuStart;
+    uint64_t        wallNanoseconds;
+    uint64_t        cpuNanoseconds;
+  };
+
+/**
+ * A hardware event: its name in the report, and its perf type and config.
+ */
+typedef struct
+  {
+    const char* name;
+    uint32_t    type;
+    uint64_t    config;
+  } Event;
+
+#if PERF_EVENTS
+const Event events[NUM_EVENTS] =
+  {
+    { "cycles",        PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES     },
+    { "instructions",  PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS   },
+    { "branch-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES  },
+    { "L1d misses",    PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D
+                                           | PERF_COUNT_HW_CACHE_OP_READ << 8
+                                           | PERF_COUNT_HW_CACHE_RESULT_MISS << 16 },
+  };
+
+/**
+ * Opens a disabled perf event for the calling thread in user mode.
+ * Returns the file descriptor, or -1 with errno set.
+ */
+int openEvent(const Event* event)
+  {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size           = sizeof(attr);
+    attr.type           = event->type;
+    attr.config         = event->config;
+    attr.disabled       = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv     = 1;
+    attr.read_format    = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+    return (int) syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+  }
+
+/**
+ * Returns the count of an open event, scaled up if it was multiplexed.
+ */
+uint64_t readEvent(int fd)
+  {
+    uint64_t values[3];   // count, time enabled, time running
+    if (read(fd, values, sizeof(values)) != (ssize_t) sizeof(values) || values[2] == 0)
+        return 0;
+
+    if (values[2] < values[1])
+        return (uint64_t) ((double) values[0]*values[1]/values[2]);
+    return values[0];
+  }
+#endif
+
+void allocateCounters()
+  {
+    CvmContext* context = currentContext;
+
+    Counters* counters = (Counters*) calloc(1, sizeof(Counters));
+    if (counters == NULL)
+        error(L"*** Out of memory ***");
+    context->counters = counters;
+
+    for (int i = 0; i < NUM_EVENTS; ++i)
+      {
+        counters->fds[i] = -1;
+#if PERF_EVENTS
+        counters->fds[i] = openEvent(events + i);
+        if (counters->fds[i] < 0 && counters->openError == 0)
+            counters->openError = errno;
+#endif
+      }
+  }
+
+void freeCounters()
+  {
+    CvmContext* context = currentContext;
+
+    if (context->counters != NULL)
+      {
+#if PERF_EVENTS
+        for (int i = 0; i < NUM_EVENTS; ++i)
+          {
+            if (context->counters->fds[i] >= 0)
+                close(context->counters->fds[i]);
+          }
+#endif
+        free(context->counters);
+        context->counters = NULL;
+      }
+  }
+
+void beginCounters()
+  {
+    Counters* counters = currentContext->counters;
+
+    timespec_get(&counters->wallStart, TIME_UTC);
+    counters->cpuStart = clock();
+
+#if PERF_EVENTS
+    for (int i = 0; i < NUM_EVENTS; ++i)
+      {
+        if (counters->fds[i] >= 0)
+            ioctl(counters->fds[i], PERF_EVENT_IOC_ENABLE, 0);
+      }
+#endif
+  }
+
+void endCounters()
+  {
+    Counters* counters = currentContext->counters;
+
+#if PERF_EVENTS
+    for (int i = 0; i < NUM_EVENTS; ++i)
+      {
+        if (counters->fds[i] >= 0)
+            ioctl(counters->fds[i], PERF_EVENT_IOC_DISABLE, 0);
+      }
+#endif
+
+    clock_t cpuEnd = clock();
+    struct timespec wallEnd;
+    timespec_get(&wallEnd, TIME_UTC);
+
+    counters->wallNanoseconds = counters->wallNanoseconds
+        + (uint64_t) ((wallEnd.tv_sec - counters->wallStart.tv_sec)*1000000000LL
+                      + (wallEnd.tv_nsec - counters->wallStart.tv_nsec));
+    counters->cpuNanoseconds = counters->cpuNanoseconds
+        + (uint64_t) ((double) (cpuEnd - counters->cpuStart)*1.0e9/CLOCKS_PER_SEC);
+    ++counters->numRuns;
+  }
+
+/**
+ * Writes a line of the report: the count, and the count per instruction
+ * if the instructions are known.
+ */
+void writeCounter(FILE* fp, const char* name, uint64_t count, uint64_t instructions)
+  {
+    fwprintf(fp, L"%-16s %16llu", name, (unsigned long long) count);
+    if (instructions > 0)
+        fwprintf(fp, L" %16.3f", (double) count/instructions);
+    fwprintf(fp, L"\n");
+  }
+
+void writeCounters(FILE* fp, uint64_t instructions)
+  {
+    Counters* counters = currentContext->counters;
+
+    fwprintf(fp, L"\nCounters: %d run%s", counters->numRuns, counters->numRuns == 1 ? "" : "s");
+    if (instructions > 0)
+        fwprintf(fp, L", %llu instructions executed", (unsigned long long) instructions);
+    fwprintf(fp, L"\n");
+
+    fwprintf(fp, L"\n%-16s %16s", "Event", "Count");
+    if (instructions > 0)
+        fwprintf(fp, L" %16s", "Per instruction");
+    fwprintf(fp, L"\n");
+    writeCounter(fp, "wall ns", counters->wallNanoseconds, instructions);
+    writeCounter(fp, "CPU ns", counters->cpuNanoseconds, instructions);
+
+#if PERF_EVENTS
+    for (int i = 0; i < NUM_EVENTS; ++i)
+      {
+        if (counters->fds[i] >= 0)
+            writeCounter(fp, events[i].name, readEvent(counters->fds[i]), instructions);
+        else
+            fwprintf(fp, L"%-16s %16s\n", events[i].name, "not counted");
+      }
+
+    // say why events were not counted
+    int numOpen = 0;
+    for (int i = 0; i < NUM_EVENTS; ++i)
+        numOpen = numOpen + (counters->fds[i] >= 0);
+
+    if (numOpen == 0)
+        fwprintf(fp, L"\nHardware counters are not available (perf_event_open: %s)\n",
+                 strerror(counters->openError));
+    else if (counters->openError != 0)
+        fwprintf(fp, L"\nSome events are not supported (perf_event_open: %s)\n",
+                 strerror(counters->openError));
+#else
+    fwprintf(fp, L"\nHardware counters are not supported on this platform\n");
+#endif
+  }
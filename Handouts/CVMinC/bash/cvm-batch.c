@@ -0,0 +1,468 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <wchar.h>
+#include <stdbool.h>
+#include <locale.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include "cvm.h"
+
+
+/**
+ * This C program runs a corpus of CPRL programs in parallel and checks
+ * their output.  Usage:
+ *
+ *     cvm-batch [--threads=N] [--predecode] [--no-fuse] [--cache-tos] [--jit]
+ *               [--no-verify] [--memory=SIZE] manifest-or-directory...
+ *
+ * A manifest is a text file that lists one ".obj" file per line (relative
+ * paths are relative to the manifest); a directory is searched
+ * recursively for ".obj" files.  For each program "name.obj", the input
+ * is read from "name.in.txt" if it exists, and the output is compared
+ * with "name.out.txt" the way testCorrect does (diff --strip-trailing-cr).
+ * A program that cannot be loaded or stops with a runtime error is an
+ * error whether or not it has expected output.
+ *
+ * Programs run in-process on a pool of worker threads (one per core by
+ * default), each with its own CvmContext and in-memory I/O.  Every worker
+ * has a queue of programs; a worker whose queue is empty steals from the
+ * other end of another worker's queue.
+ */
+
+// exit return value for failure
+const int FAILURE = -1;
+
+/**
+ * Outcome of running one program.
+ */
+typedef enum { PASSED, FAILED, NO_EXPECTED_OUTPUT, RUN_ERROR, NOT_RUN } Result;
+
+/**
+ * A program in the corpus and, once it has run, its result.
+ */
+typedef struct
+  {
+    char*    path;           // the ".obj" file
+    Result   result;
+    double   milliseconds;   // wall time to load, run, and check the program
+    wchar_t* error;          // runtime or load error, or NULL
+    char*    problem;        // why the program could not be run, or NULL
+  } Job;
+
+/**
+ * The queue of one worker thread.  The owner takes jobs from the front;
+ * thieves take them from the back.
+ */
+typedef struct
+  {
+    pthread_mutex_t lock;
+    int* jobs;
+    int  front;
+    int  back;
+  } WorkQueue;
+
+// declare prototypes
+void  addPath(const char* path);
+void  addManifest(const char* path);
+void  addDirectory(const char* path);
+void  addJob(char* path);
+void* worker(void* arg);
+void  runJob(Job* job);
+bool  endsWith(const char* s, const char* suffix);
+double now();
+
+// the programs to run
+Job* jobs       = NULL;
+int  numJobs    = 0;
+int  jobsCapacity = 0;
+
+// one queue per worker thread
+WorkQueue* queues     = NULL;
+int        numWorkers = 0;
+
+// options for every context
+CvmOptions options;
+
+/**
+ * This function collects the programs, runs them on the thread pool, and
+ * prints a report.  Exits with status 0 if every program passed.
+ */
+int main(int argc, char* argv[])
+  {
+    setlocale(LC_ALL, "");
+    cvm_default_options(&options);
+
+    numWorkers = (int) sysconf(_SC_NPROCESSORS_ONLN);
+
+    int numPaths = 0;
+    for (int i = 1; i < argc; ++i)
+      {
+        if (strncmp(argv[i], "--threads=", 10) == 0)
+            numWorkers = atoi(argv[i] + 10);
+        else if (strcmp(argv[i], "--predecode") == 0)
+            options.predecode = true;
+        else if (strcmp(argv[i], "--no-fuse") == 0)
+            options.fuse = false;
+        else if (strcmp(argv[i], "--cache-tos") == 0)
+            options.cacheTos = true;
+        else if (strcmp(argv[i], "--jit") == 0)
+            options.jit = true;
+        else if (strcmp(argv[i], "--no-verify") == 0)
+            options.verify = false;
+        else if (strncmp(argv[i], "--memory=", 9) == 0)
+          {
+            options.memorySize = cvm_parse_size(argv[i] + 9);
+            if (options.memorySize == 0)
+                numPaths = -1;
+          }
+        else if (strncmp(argv[i], "--", 2) != 0)
+          {
+            addPath(argv[i]);
+            ++numPaths;
+          }
+        else
+            numPaths = -1;
+
+        if (numPaths < 0)
+            break;
+      }
+
+    if (numPaths <= 0)
+      {
+        fprintf(stderr, "Usage: cvm-batch [--threads=N] [--predecode] [--no-fuse] [--cache-tos] [--jit]\n"
+                        "                 [--no-verify] [--memory=SIZE] manifest-or-directory...\n"
+                        "SIZE is in bytes, or in K, M, or G with that suffix, and at most %zu bytes.\n",
+                CVM_MAX_MEMORY_SIZE);
+        exit(FAILURE);
+      }
+
+    if (numWorkers < 1)
+        numWorkers = 1;
+    if (numWorkers > numJobs && numJobs > 0)
+        numWorkers = numJobs;
+
+    // deal the jobs out to the queues round-robin
+    queues = (WorkQueue*) calloc(numWorkers, sizeof(WorkQueue));
+    for (int w = 0; w < numWorkers; ++w)
+      {
+        pthread_mutex_init(&queues[w].lock, NULL);
+        queues[w].jobs = (int*) malloc(sizeof(int)*(numJobs/numWorkers + 1));
+      }
+    for (int i = 0; i < numJobs; ++i)
+      {
+        WorkQueue* queue = queues + i % numWorkers;
+        queue->jobs[queue->back++] = i;
+      }
+
+    double start = now();
+
+    pthread_t* threads = (pthread_t*) malloc(sizeof(pthread_t)*numWorkers);
+    for (int w = 0; w < numWorkers; ++w)
+        pthread_create(&threads[w], NULL, worker, (void*) (intptr_t) w);
+    for (int w = 0; w < numWorkers; ++w)
+        pthread_join(threads[w], NULL);
+
+    double elapsed = now() - start;
+
+    // report
+    int counts[NOT_RUN + 1] = { 0 };
+    const char* names[] = { "PASS", "FAIL", "NOEXP", "ERROR", "NOTRUN" };
+    for (int i = 0; i < numJobs; ++i)
+      {
+        Job* job = jobs + i;
+        ++counts[job->result];
+        printf("%-5s %10.3f ms  %s", names[job->result], job->milliseconds, job->path);
+        if (job->problem != NULL)
+            printf("  (%s)", job->problem);
+        else if (job->error != NULL)
+            printf("  (%ls)", job->error);
+        printf("\n");
+      }
+
+    printf("\n%d programs: %d passed, %d failed, %d without expected output, %d errors, %d not run\n",
+           numJobs, counts[PASSED], counts[FAILED], counts[NO_EXPECTED_OUTPUT], counts[RUN_ERROR],
+           counts[NOT_RUN]);
+    printf("%d threads, %.3f s wall time, %.1f programs/s\n",
+           numWorkers, elapsed/1000.0, elapsed > 0 ? numJobs/(elapsed/1000.0) : 0.0);
+
+    return counts[PASSED] + counts[NO_EXPECTED_OUTPUT] == numJobs ? 0 : 1;
+  }
+
+// Start: collecting the programs
+// ------------------------------
+
+bool endsWith(const char* s, const char* suffix)
+  {
+    size_t length = strlen(s);
+    size_t suffixLength = strlen(suffix);
+    return length >= suffixLength && strcmp(s + length - suffixLength, suffix) == 0;
+  }
+
+void addJob(char* path)
+  {
+    if (numJobs == jobsCapacity)
+      {
+        jobsCapacity = jobsCapacity == 0 ? 256 : 2*jobsCapacity;
+        jobs = (Job*) realloc(jobs, sizeof(Job)*jobsCapacity);
+      }
+
+    Job* job = jobs + numJobs++;
+    job->path         = path;
+    job->result       = NOT_RUN;
+    job->milliseconds = 0.0;
+    job->error        = NULL;
+    job->problem      = NULL;
+  }
+
+/**
+ * Adds a single ".obj" file, every ".obj" file under a directory, or every
+ * file listed in a manifest.
+ */
+void addPath(const char* path)
+  {
+    struct stat info;
+    if (stat(path, &info) != 0)
+      {
+        fprintf(stderr, "Error opening file %s\n", path);
+        exit(FAILURE);
+      }
+
+    if (S_ISDIR(info.st_mode))
+        addDirectory(path);
+    else if (endsWith(path, ".obj"))
+        addJob(strdup(path));
+    else
+        addManifest(path);
+  }
+
+/**
+ * Adds the ".obj" files under a directory, in sorted order.
+ */
+void addDirectory(const char* path)
+  {
+    struct dirent** entries;
+    int numEntries = scandir(path, &entries, NULL, alphasort);
+    if (numEntries < 0)
+      {
+        fprintf(stderr, "Error opening directory %s\n", path);
+        exit(FAILURE);
+      }
+
+    for (int i = 0; i < numEntries; ++i)
+      {
+        const char* name = entries[i]->d_name;
+        if (name[0] != '.')
+          {
+            char* childPath = (char*) malloc(strlen(path) + strlen(name) + 2);
+            sprintf(childPath, "%s/%s", path, name);
+
+            struct stat info;
+            if (stat(childPath, &info) == 0 && S_ISDIR(info.st_mode))
+              {
+                addDirectory(childPath);
+                free(childPath);
+              }
+            else if (endsWith(name, ".obj"))
+                addJob(childPath);
+            else
+                free(childPath);
+          }
+        free(entries[i]);
+      }
+    free(entries);
+  }
+
+/**
+ * Adds the ".obj" files listed in a manifest, one per line.
+ */
+void addManifest(const char* path)
+  {
+    FILE* fp = fopen(path, "r");
+    if (!fp)
+      {
+        fprintf(stderr, "Error opening file %s\n", path);
+        exit(FAILURE);
+      }
+
+    // relative paths are relative to the directory of the manifest
+    const char* slash = strrchr(path, '/');
+    size_t dirLength = slash == NULL ? 0 : (size_t) (slash - path) + 1;
+
+    char line[4096];
+    while (fgets(line, sizeof(line), fp) != NULL)
+      {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] == '\0' || line[0] == '#')
+            continue;
+
+        char* jobPath = (char*) malloc(dirLength + strlen(line) + 1);
+        if (line[0] == '/')
+            strcpy(jobPath, line);
+        else
+          {
+            memcpy(jobPath, path, dirLength);
+            strcpy(jobPath + dirLength, line);
+          }
+        addJob(jobPath);
+      }
+
+    fclose(fp);
+  }
+
+// End: collecting the programs
+// Start: running the programs
+// ---------------------------
+
+double now()
+  {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec*1000.0 + t.tv_nsec/1000000.0;
+  }
+
+/**
+ * Compares two outputs line by line, ignoring a carriage return at the
+ * end of each line (diff --strip-trailing-cr).
+ */
+bool sameOutput(const char* a, size_t aLength, const char* b, size_t bLength)
+  {
+    size_t i = 0;
+    size_t j = 0;
+
+    while (i < aLength || j < bLength)
+      {
+        // skip a carriage return that ends a line or the file
+        if (i < aLength && a[i] == '\r' && (i + 1 == aLength || a[i + 1] == '\n'))
+            ++i;
+        if (j < bLength && b[j] == '\r' && (j + 1 == bLength || b[j + 1] == '\n'))
+            ++j;
+
+        if (i == aLength || j == bLength)
+            return i == aLength && j == bLength;
+        if (a[i] != b[j])
+            return false;
+
+        ++i;
+        ++j;
+      }
+
+    return true;
+  }
+
+/**
+ * Strips the suffix ".obj" and appends another suffix.
+ */
+char* siblingPath(const char* path, const char* suffix)
+  {
+    size_t baseLength = strlen(path) - strlen(".obj");
+    char* result = (char*) malloc(baseLength + strlen(suffix) + 1);
+    memcpy(result, path, baseLength);
+    strcpy(result + baseLength, suffix);
+    return result;
+  }
+
+void runJob(Job* job)
+  {
+    double start = now();
+
+    size_t codeLength;
+    char* code = cvm_read_file(job->path, &codeLength);
+    if (code == NULL)
+      {
+        job->problem = "cannot read object file";
+        return;
+      }
+
+    char* inPath  = siblingPath(job->path, ".in.txt");
+    char* outPath = siblingPath(job->path, ".out.txt");
+
+    // UTF-8 input from the ".in.txt" file, and the output kept for comparison
+    size_t inputLength = 0;
+    char* input = cvm_read_file(inPath, &inputLength);
+
+    CvmMemoryIO memory;
+    CvmIO io;
+    cvm_memory_io(&io, &memory, input, inputLength, true);
+
+    CvmContext* context = cvm_create(&options, &io);
+    if (context == NULL)
+        job->problem = "out of memory";
+    else
+      {
+        if (cvm_load_from_buffer(context, code, codeLength) != CVM_OK
+              || cvm_run(context) != CVM_OK)
+            job->error = wcsdup(cvm_error_message(context));
+        cvm_destroy(context);
+
+        // like testCorrect, only the standard output is compared
+        size_t expectedLength;
+        char* expected = cvm_read_file(outPath, &expectedLength);
+        if (job->error != NULL)
+            job->result = RUN_ERROR;
+        else if (expected == NULL)
+            job->result = NO_EXPECTED_OUTPUT;
+        else if (!memory.keepOutput)
+            job->problem = "out of memory";
+        else if (sameOutput(memory.output, memory.outputLength, expected, expectedLength))
+            job->result = PASSED;
+        else
+            job->result = FAILED;
+        free(expected);
+      }
+
+    free(memory.output);
+    free(input);
+    free(inPath);
+    free(outPath);
+    free(code);
+
+    job->milliseconds = now() - start;
+  }
+
+/**
+ * Takes the next job from the worker's own queue, or steals one from the
+ * back of another queue.  Returns -1 when there is no work left.
+ */
+int nextJob(int self)
+  {
+    for (int k = 0; k < numWorkers; ++k)
+      {
+        int w = (self + k) % numWorkers;
+        WorkQueue* queue = queues + w;
+        int job = -1;
+
+        pthread_mutex_lock(&queue->lock);
+        if (queue->front < queue->back)
+          {
+            if (w == self)
+                job = queue->jobs[queue->front++];
+            else
+                job = queue->jobs[--queue->back];
+          }
+        pthread_mutex_unlock(&queue->lock);
+
+        if (job >= 0)
+            return job;
+      }
+
+    return -1;
+  }
+
+void* worker(void* arg)
+  {
+    int self = (int) (intptr_t) arg;
+
+    int job;
+    while ((job = nextJob(self)) >= 0)
+        runJob(jobs + job);
+
+    return NULL;
+  }
+
+// End: running the programs
+// -------------------------
@@ -0,0 +1,218 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <wchar.h>
+#include <stdbool.h>
+#include <locale.h>
+#include <time.h>
+#include <sys/resource.h>
+#include "cvm.h"
+
+
+/**
+ * This C program times a CPRL program on one execution engine of libcvm
+ * and prints one line: the instructions executed by each run, the median
+ * and fastest of the timed runs, the instructions per second and the
+ * nanoseconds per instruction of the median run, and the peak memory
+ * (resident set size) of the process.  Usage:
+ *
+ *     cvm-bench [--runs=N] [--memory=SIZE] [--predecode] [--no-fuse]
+ *               [--cache-tos] [--jit] program.obj [input]
+ *     cvm-bench --header
+ *
+ * The program runs once with the profile option to count its
+ * instructions, and then N times (5 by default) with the selected engine,
+ * each time in a new context with the input read from the file (if any)
+ * and the output discarded.  Only cvm_run() is timed, so loading and
+ * translating the program are not included.  The peak memory covers every
+ * run, so use a new process for each engine, as benchmarks/runBenchmarks
+ * does.
+ */
+
+// exit return value for failure
+const int FAILURE = -1;
+
+// declare prototypes
+double runOnce(const CvmOptions* options, const char* code, size_t codeLength,
+               const char* input, size_t inputLength, unsigned long long* count);
+int    compareTimes(const void* a, const void* b);
+void   printHeader();
+void   usage();
+
+int main(int argc, char* argv[])
+  {
+    setlocale(LC_ALL, "");
+
+    CvmOptions options;
+    cvm_default_options(&options);
+
+    int   runs      = 5;
+    char* filename  = NULL;
+    char* inputFile = NULL;
+
+    for (int i = 1; i < argc; ++i)
+      {
+        if (strcmp(argv[i], "--header") == 0 && argc == 2)
+          {
+            printHeader();
+            return 0;
+          }
+        else if (strncmp(argv[i], "--runs=", 7) == 0)
+          {
+            runs = atoi(argv[i] + 7);
+            if (runs < 1)
+                usage();
+          }
+        else if (strncmp(argv[i], "--memory=", 9) == 0)
+          {
+            options.memorySize = cvm_parse_size(argv[i] + 9);
+            if (options.memorySize == 0)
+                usage();
+          }
+        else if (strcmp(argv[i], "--predecode") == 0)
+            options.predecode = true;
+        else if (strcmp(argv[i], "--no-fuse") == 0)
+            options.fuse = false;
+        else if (strcmp(argv[i], "--cache-tos") == 0)
+            options.cacheTos = true;
+        else if (strcmp(argv[i], "--jit") == 0)
+            options.jit = true;
+        else if (strncmp(argv[i], "--", 2) != 0 && filename == NULL)
+            filename = argv[i];
+        else if (strncmp(argv[i], "--", 2) != 0 && inputFile == NULL)
+            inputFile = argv[i];
+        else
+            usage();
+      }
+
+    if (filename == NULL)
+        usage();
+
+    // name the engine by its options
+    char engine[64];
+    sprintf(engine, "%s%s%s%s", options.jit ? "jit " : "", options.cacheTos ? "cache-tos " : "",
+            options.predecode ? "predecode " : "", options.fuse ? "" : "no-fuse ");
+    if (engine[0] == '\0')
+        strcpy(engine, "bytecode");
+    else
+        engine[strlen(engine) - 1] = '\0';
+
+    size_t codeLength;
+    char* code = cvm_read_file(filename, &codeLength);
+    if (code == NULL)
+      {
+        fprintf(stderr, "Error opening file %s\n", filename);
+        exit(FAILURE);
+      }
+
+    size_t inputLength = 0;
+    char* input = NULL;
+    if (inputFile != NULL && (input = cvm_read_file(inputFile, &inputLength)) == NULL)
+      {
+        fprintf(stderr, "Error opening file %s\n", inputFile);
+        exit(FAILURE);
+      }
+
+    // count the instructions with a profiled run
+    CvmOptions profileOptions = options;
+    profileOptions.profile = true;
+    unsigned long long instructions = 0;
+    runOnce(&profileOptions, code, codeLength, input, inputLength, &instructions);
+
+    double* times = (double*) malloc(sizeof(double)*runs);
+    for (int i = 0; i < runs; ++i)
+        times[i] = runOnce(&options, code, codeLength, input, inputLength, NULL);
+    qsort(times, runs, sizeof(double), compareTimes);
+
+    double median = runs % 2 == 1 ? times[runs/2] : (times[runs/2 - 1] + times[runs/2])/2.0;
+    double fastest = times[0];
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+
+    // the program name without its directory
+    const char* name = strrchr(filename, '/');
+    name = name == NULL ? filename : name + 1;
+
+    printf("%-20s %-20s %12llu %10.3f %10.3f %10.1f %8.2f %10ld\n",
+           name, engine, instructions, median*1000.0, fastest*1000.0,
+           median > 0 ? instructions/median/1.0e6 : 0.0,
+           instructions > 0 ? median*1.0e9/instructions : 0.0,
+           usage.ru_maxrss);
+
+    free(times);
+    free(input);
+    free(code);
+    return 0;
+  }
+
+void printHeader()
+  {
+    printf("%-20s %-20s %12s %10s %10s %10s %8s %10s\n",
+           "Program", "Engine", "Instructions", "Median ms", "Min ms",
+           "M instr/s", "ns/instr", "Peak KB");
+  }
+
+/**
+ * Loads the program into a new context and runs it.  Returns the seconds
+ * taken by cvm_run(), and stores the instructions executed in count if it
+ * is not NULL.  Exits if the program cannot be loaded or fails.
+ */
+double runOnce(const CvmOptions* options, const char* code, size_t codeLength,
+               const char* input, size_t inputLength, unsigned long long* count)
+  {
+    // the output is only counted
+    CvmMemoryIO memory;
+    CvmIO io;
+    cvm_memory_io(&io, &memory, input, inputLength, false);
+
+    CvmContext* context = cvm_create(options, &io);
+    if (context == NULL)
+      {
+        fwprintf(stderr, L"*** Out of memory ***\n");
+        exit(FAILURE);
+      }
+
+    if (cvm_load_from_buffer(context, code, codeLength) != CVM_OK)
+      {
+        fwprintf(stderr, L"%ls\n", cvm_error_message(context));
+        exit(FAILURE);
+      }
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    CvmStatus status = cvm_run(context);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    if (status != CVM_OK)
+      {
+        fwprintf(stderr, L"%ls\n", cvm_error_message(context));
+        exit(FAILURE);
+      }
+
+    if (count != NULL)
+        *count = cvm_instruction_count(context);
+    cvm_destroy(context);
+
+    return (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec)/1.0e9;
+  }
+
+int compareTimes(const void* a, const void* b)
+  {
+    double x = *(const double*) a;
+    double y = *(const double*) b;
+    return (x > y) - (x < y);
+  }
+
+/**
+ * Print the usage message and exit with nonzero status code.
+ */
+void usage()
+  {
+    fprintf(stderr, "Usage: cvm-bench [--runs=N] [--memory=SIZE] [--predecode] [--no-fuse] "
+                    "[--cache-tos] [--jit] program.obj [input]\n"
+                    "       cvm-bench --header\n"
+                    "SIZE is in bytes, or in K, M, or G with that suffix, and at most %zu bytes.\n",
+            CVM_MAX_MEMORY_SIZE);
+    exit(FAILURE);
+  }
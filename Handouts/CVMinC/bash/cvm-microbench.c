@@ -0,0 +1,541 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <wchar.h>
+#include <stdbool.h>
+#include <locale.h>
+#include <time.h>
+#include "opcode.h"
+#include "cvm.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_TSC 1
+#else
+#define HAVE_TSC 0
+#endif
+
+
+/**
+ * This C program measures the cost of single instructions on each
+ * execution engine of libcvm.  For each benchmark it builds a program
+ * whose loop body repeats a short, stack-neutral sequence dominated by
+ * one opcode, runs it on each engine, and writes a line of CSV:
+ *
+ *     label,benchmark,engine,instructions,target_share,seconds,
+ *     ns_per_instruction,cycles_per_instruction
+ *
+ * instructions counts every instruction executed, including the loop
+ * control, and target_share is the fraction of them with the benchmark's
+ * opcode.  The time is the fastest of the runs; the cycles are time stamp
+ * counter cycles (empty where there is no such counter).  The "loop"
+ * benchmark has an empty body, for the cost of the loop control.  Usage:
+ *
+ *     cvm-microbench [--runs=N] [--label=TEXT] [--output=FILE] [benchmark...]
+ *
+ * The label (for example a commit id) goes into the first column.  An
+ * output file is appended to, with the header only when it is new, so the
+ * results of several commits can be kept in one file.  The dispatch of
+ * the bytecode engine (threaded or switch) is chosen when libcvm is
+ * compiled, so build it both ways to compare them.
+ */
+
+// exit return value for failure
+const int FAILURE = -1;
+
+// the number of times each loop body repeats its sequence
+#define UNROLL 32
+
+// the number of instructions each run executes, roughly
+#define TARGET_INSTRUCTIONS 20000000
+
+// the loop control: LDGADDR 0; LDGADDR 0; LOADW; DEC; STOREW;
+//                   LDGADDR 0; LOADW; LDCINT0; BNE loop
+#define LOOP_INSTRUCTIONS 9
+
+/**
+ * A program under construction.  Ints are stored in big-endian order, as
+ * in an object file.
+ */
+typedef struct
+  {
+    unsigned char* bytes;
+    int  length;
+    int  capacity;
+    int  numInstructions;   // instructions emitted
+    int  numTargets;        // instructions emitted with a target opcode
+    int  targets[2];        // the opcodes being measured
+    int  callTarget;        // address of the procedure for CALL, or -1
+  } Code;
+
+/**
+ * A benchmark: its name, its opcodes, and a function that emits its loop
+ * body.
+ */
+typedef struct
+  {
+    const char* name;
+    int  targets[2];
+    void (*emitBody)(Code* code);
+  } Benchmark;
+
+/**
+ * An execution engine and the options that select it.
+ */
+typedef struct
+  {
+    const char* name;
+    bool predecode;
+    bool fuse;
+    bool cacheTos;
+    bool jit;
+  } Engine;
+
+// declare prototypes
+void emit(Code* code, int opcode);
+void emitInt(Code* code, int opcode, int operand);
+void emitLoop(Code* code);
+void emitLoadW(Code* code);
+void emitStoreW(Code* code);
+void emitCallReturn(Code* code);
+void emitLoad(Code* code);
+void emitBranch(Code* code);
+void emitBranchEqual(Code* code);
+void emitAdd(Code* code);
+void emitIncrement(Code* code);
+void emitPutInt(Code* code);
+void buildProgram(Code* code, const Benchmark* benchmark, int iterations);
+double runProgram(const Code* code, const CvmOptions* options,
+                  unsigned long long* cycles, unsigned long long* count);
+void usage();
+
+Benchmark benchmarks[] =
+  {
+    { "loop",      { -1,     -1   }, emitLoop        },
+    { "LOADW",     { LOADW,  -1   }, emitLoadW       },
+    { "STOREW",    { STOREW, -1   }, emitStoreW      },
+    { "CALL/RET0", { CALL,   RET0 }, emitCallReturn  },
+    { "LOAD",      { LOAD,   -1   }, emitLoad        },
+    { "BR",        { BR,     -1   }, emitBranch      },
+    { "BE",        { BE,     -1   }, emitBranchEqual },
+    { "ADD",       { ADD,    -1   }, emitAdd         },
+    { "INC",       { INC,    -1   }, emitIncrement   },
+    { "PUTINT",    { PUTINT, -1   }, emitPutInt      },
+  };
+
+Engine engines[] =
+  {
+    { "bytecode",          false, true,  false, false },
+    { "predecode",         true,  true,  false, false },
+    { "predecode no-fuse", true,  false, false, false },
+    { "cache-tos",         false, true,  true,  false },
+    { "jit",               false, true,  false, true  },
+  };
+
+#define NUM_BENCHMARKS ((int) (sizeof(benchmarks)/sizeof(benchmarks[0])))
+#define NUM_ENGINES    ((int) (sizeof(engines)/sizeof(engines[0])))
+
+// the output of PUTINT goes to /dev/null
+FILE* devNull = NULL;
+
+int main(int argc, char* argv[])
+  {
+    setlocale(LC_ALL, "");
+
+    int   runs       = 5;
+    char* label      = "";
+    char* outputFile = NULL;
+    bool  selected[NUM_BENCHMARKS];
+    bool  anySelected = false;
+    memset(selected, 0, sizeof(selected));
+
+    for (int i = 1; i < argc; ++i)
+      {
+        if (strncmp(argv[i], "--runs=", 7) == 0)
+          {
+            runs = atoi(argv[i] + 7);
+            if (runs < 1)
+                usage();
+          }
+        else if (strncmp(argv[i], "--label=", 8) == 0)
+            label = argv[i] + 8;
+        else if (strncmp(argv[i], "--output=", 9) == 0)
+            outputFile = argv[i] + 9;
+        else if (strncmp(argv[i], "--", 2) != 0)
+          {
+            int b = 0;
+            while (b < NUM_BENCHMARKS && strcmp(argv[i], benchmarks[b].name) != 0)
+                ++b;
+            if (b == NUM_BENCHMARKS)
+              {
+                fprintf(stderr, "Unknown benchmark %s\n", argv[i]);
+                usage();
+              }
+            selected[b] = true;
+            anySelected = true;
+          }
+        else
+            usage();
+      }
+
+    FILE* out = stdout;
+    if (outputFile != NULL && (out = fopen(outputFile, "a")) == NULL)
+      {
+        fprintf(stderr, "Error opening file %s\n", outputFile);
+        exit(FAILURE);
+      }
+
+    if (ftell(out) <= 0)
+        fprintf(out, "label,benchmark,engine,instructions,target_share,seconds,"
+                     "ns_per_instruction,cycles_per_instruction\n");
+
+    devNull = fopen("/dev/null", "w");
+
+    for (int b = 0; b < NUM_BENCHMARKS; ++b)
+      {
+        if (anySelected && !selected[b])
+            continue;
+
+        // build the body once to size the loop
+        const Benchmark* benchmark = benchmarks + b;
+        Code body = { NULL, 0, 0, 0, 0, { benchmark->targets[0], benchmark->targets[1] }, -1 };
+        benchmark->emitBody(&body);
+        int iterations = TARGET_INSTRUCTIONS/(body.numInstructions + LOOP_INSTRUCTIONS);
+        double targetShare = (double) body.numTargets/(body.numInstructions + LOOP_INSTRUCTIONS);
+        free(body.bytes);
+
+        Code code = { NULL, 0, 0, 0, 0, { -1, -1 }, -1 };
+        buildProgram(&code, benchmark, iterations);
+
+        // count the instructions with a profiled run
+        CvmOptions profileOptions;
+        cvm_default_options(&profileOptions);
+        profileOptions.profile = true;
+        unsigned long long instructions = 0;
+        runProgram(&code, &profileOptions, NULL, &instructions);
+
+        for (int e = 0; e < NUM_ENGINES; ++e)
+          {
+            CvmOptions options;
+            cvm_default_options(&options);
+            options.predecode = engines[e].predecode;
+            options.fuse      = engines[e].fuse;
+            options.cacheTos  = engines[e].cacheTos;
+            options.jit       = engines[e].jit;
+
+            double seconds = 0.0;
+            unsigned long long cycles = 0;
+            for (int i = 0; i < runs; ++i)
+              {
+                unsigned long long runCycles;
+                double runSeconds = runProgram(&code, &options, &runCycles, NULL);
+                if (i == 0 || runSeconds < seconds)
+                  {
+                    seconds = runSeconds;
+                    cycles  = runCycles;
+                  }
+              }
+
+            fprintf(out, "%s,%s,%s,%llu,%.4f,%.6f,%.3f,", label, benchmark->name,
+                    engines[e].name, instructions, targetShare, seconds,
+                    seconds*1.0e9/instructions);
+            if (HAVE_TSC)
+                fprintf(out, "%.3f", (double) cycles/instructions);
+            fprintf(out, "\n");
+            fflush(out);
+          }
+
+        free(code.bytes);
+      }
+
+    if (out != stdout)
+        fclose(out);
+    if (devNull != NULL)
+        fclose(devNull);
+    return 0;
+  }
+
+// Start: building programs
+// ------------------------
+
+void appendByte(Code* code, int b)
+  {
+    if (code->length == code->capacity)
+      {
+        code->capacity = code->capacity == 0 ? 4096 : 2*code->capacity;
+        code->bytes = (unsigned char*) realloc(code->bytes, code->capacity);
+      }
+    code->bytes[code->length++] = (unsigned char) b;
+  }
+
+void emit(Code* code, int opcode)
+  {
+    appendByte(code, opcode);
+    ++code->numInstructions;
+    if (opcode == code->targets[0] || opcode == code->targets[1])
+        ++code->numTargets;
+  }
+
+void emitInt(Code* code, int opcode, int operand)
+  {
+    emit(code, opcode);
+
+    unsigned u = (unsigned) operand;
+    appendByte(code, (u >> 24) & 0xFF);
+    appendByte(code, (u >> 16) & 0xFF);
+    appendByte(code, (u >> 8) & 0xFF);
+    appendByte(code, u & 0xFF);
+  }
+
+/**
+ * Emits an instruction with a relative displacement to an address.
+ */
+void emitBranchTo(Code* code, int opcode, int address)
+  {
+    emitInt(code, opcode, address - (code->length + 5));
+  }
+
+void emitLoop(Code* code)
+  {
+  }
+
+/**
+ * LOADW of global 8, which holds its own address, over and over.
+ */
+void emitLoadW(Code* code)
+  {
+    emitInt(code, LDGADDR, 8);
+    emitInt(code, LDGADDR, 8);
+    for (int i = 0; i < UNROLL; ++i)
+        emit(code, LOADW);
+    emit(code, STOREW);
+  }
+
+void emitStoreW(Code* code)
+  {
+    for (int i = 0; i < UNROLL; ++i)
+      {
+        emitInt(code, LDGADDR, 16);
+        emit(code, LDCINT1);
+        emit(code, STOREW);
+      }
+  }
+
+/**
+ * Calls of a procedure that only returns.
+ */
+void emitCallReturn(Code* code)
+  {
+    // the procedure follows the HALT (see buildProgram())
+    for (int i = 0; i < UNROLL; ++i)
+      {
+        if (code->callTarget >= 0)
+            emitBranchTo(code, CALL, code->callTarget);
+        else
+            emitInt(code, CALL, 0);
+
+        // count the RET0 that each CALL executes
+        ++code->numInstructions;
+        ++code->numTargets;
+      }
+  }
+
+/**
+ * LOAD 16 of globals 16 to 31, stored back with STORE 16.
+ */
+void emitLoad(Code* code)
+  {
+    for (int i = 0; i < UNROLL; ++i)
+      {
+        emitInt(code, LDGADDR, 16);
+        emitInt(code, LDGADDR, 16);
+        emitInt(code, LOAD, 16);
+        emitInt(code, STORE, 16);
+      }
+  }
+
+/**
+ * Branches to the next instruction.
+ */
+void emitBranch(Code* code)
+  {
+    for (int i = 0; i < UNROLL; ++i)
+        emitInt(code, BR, 0);
+  }
+
+/**
+ * Taken branches to the next instruction.
+ */
+void emitBranchEqual(Code* code)
+  {
+    for (int i = 0; i < UNROLL; ++i)
+      {
+        emit(code, LDCINT1);
+        emit(code, LDCINT1);
+        emitInt(code, BE, 0);
+      }
+  }
+
+void emitAdd(Code* code)
+  {
+    emitInt(code, LDGADDR, 16);
+    emit(code, LDCINT0);
+    for (int i = 0; i < UNROLL; ++i)
+      {
+        emitInt(code, LDCINT, 3);
+        emit(code, ADD);
+      }
+    emit(code, STOREW);
+  }
+
+void emitIncrement(Code* code)
+  {
+    emitInt(code, LDGADDR, 16);
+    emit(code, LDCINT0);
+    for (int i = 0; i < UNROLL; ++i)
+        emit(code, INC);
+    emit(code, STOREW);
+  }
+
+void emitPutInt(Code* code)
+  {
+    for (int i = 0; i < UNROLL; ++i)
+      {
+        emitInt(code, LDCINT, 123456);
+        emit(code, PUTINT);
+      }
+  }
+
+/**
+ * Builds the program for a benchmark:
+ *
+ *         PROGRAM 32
+ *         LDGADDR 0; LDCINT iterations; STOREW     (global 0 counts down)
+ *         LDGADDR 8; LDGADDR 8; STOREW             (global 8 holds its address)
+ *   loop: body
+ *         loop control (see LOOP_INSTRUCTIONS)
+ *         HALT
+ *         RET0                                     (the procedure for CALL)
+ *
+ * The body is emitted twice, since the address of the procedure is only
+ * known after the first time.
+ */
+void buildProgram(Code* code, const Benchmark* benchmark, int iterations)
+  {
+    code->targets[0] = benchmark->targets[0];
+    code->targets[1] = benchmark->targets[1];
+
+    for (int pass = 0; pass < 2; ++pass)
+      {
+        code->length     = 0;
+        code->numTargets = 0;
+        code->numInstructions = 0;
+
+        emitInt(code, PROGRAM, 32);
+        emitInt(code, LDGADDR, 0);
+        emitInt(code, LDCINT, iterations);
+        emit(code, STOREW);
+        emitInt(code, LDGADDR, 8);
+        emitInt(code, LDGADDR, 8);
+        emit(code, STOREW);
+
+        int loop = code->length;
+        benchmark->emitBody(code);
+
+        emitInt(code, LDGADDR, 0);
+        emitInt(code, LDGADDR, 0);
+        emit(code, LOADW);
+        emit(code, DEC);
+        emit(code, STOREW);
+        emitInt(code, LDGADDR, 0);
+        emit(code, LOADW);
+        emit(code, LDCINT0);
+        emitBranchTo(code, BNE, loop);
+        emit(code, HALT);
+
+        code->callTarget = code->length;
+        emit(code, RET0);
+      }
+  }
+
+// End: building programs
+// Start: running programs
+// -----------------------
+
+size_t noInput(void* userData, char* bytes, size_t capacity)
+  {
+    return 0;
+  }
+
+void writeDevNull(void* userData, const char* bytes, size_t length)
+  {
+    if (devNull != NULL)
+        fwrite(bytes, 1, length, devNull);
+  }
+
+/**
+ * Loads the program into a new context and runs it.  Returns the seconds
+ * taken by cvm_run(), and stores the time stamp counter cycles in cycles
+ * and the instructions executed in count, if they are not NULL.  Exits if
+ * the program cannot be loaded or fails.
+ */
+double runProgram(const Code* code, const CvmOptions* options,
+                  unsigned long long* cycles, unsigned long long* count)
+  {
+    CvmIO io = { NULL, noInput, writeDevNull, false };
+
+    CvmContext* context = cvm_create(options, &io);
+    if (context == NULL)
+      {
+        fwprintf(stderr, L"*** Out of memory ***\n");
+        exit(FAILURE);
+      }
+
+    if (cvm_load_from_buffer(context, code->bytes, code->length) != CVM_OK)
+      {
+        fwprintf(stderr, L"%ls\n", cvm_error_message(context));
+        exit(FAILURE);
+      }
+
+    struct timespec start, end;
+    unsigned long long startCycles = 0, endCycles = 0;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+#if HAVE_TSC
+    startCycles = __rdtsc();
+#endif
+    CvmStatus status = cvm_run(context);
+#if HAVE_TSC
+    endCycles = __rdtsc();
+#endif
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    if (status != CVM_OK)
+      {
+        fwprintf(stderr, L"%ls\n", cvm_error_message(context));
+        exit(FAILURE);
+      }
+
+    if (cycles != NULL)
+        *cycles = endCycles - startCycles;
+    if (count != NULL)
+        *count = cvm_instruction_count(context);
+    cvm_destroy(context);
+
+    return (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec)/1.0e9;
+  }
+
+// End: running programs
+// ---------------------
+
+/**
+ * Print the usage message and exit with nonzero status code.
+ */
+void usage()
+  {
+    fprintf(stderr, "Usage: cvm-microbench [--runs=N] [--label=TEXT] [--output=FILE] [benchmark...]\n"
+                    "Benchmarks:");
+    for (int b = 0; b < NUM_BENCHMARKS; ++b)
+        fprintf(stderr, " %s", benchmarks[b].name);
+    fprintf(stderr, "\n");
+    exit(FAILURE);
+  }
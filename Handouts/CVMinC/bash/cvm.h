@@ -0,0 +1,240 @@
+#ifndef CVM_H
+#define CVM_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <wchar.h>
+
+/**
+ * The public interface of libcvm, the CPRL virtual machine as a library.
+ *
+ * Each program is loaded into its own CvmContext, which holds the memory,
+ * registers, and translated code of the program.  Contexts are independent
+ * of each other: any number of them may exist at once, and different
+ * threads may run different contexts at the same time.  A context must not
+ * be used by two threads at once.
+ *
+ * Runtime errors do not exit the process; cvm_run() returns CVM_ERROR and
+ * cvm_error_message() describes the error.  On Unix systems, memory is
+ * followed by an inaccessible guard page, and libcvm installs a SIGSEGV
+ * handler that reports a stack overflow into the guard page as an error.
+ * Other faults are passed on to the handler that was installed before.
+ */
+
+typedef struct CvmContext CvmContext;
+
+/**
+ * Result of loading or running a program.
+ */
+typedef enum
+  {
+    CVM_OK       = 0,    // the program was loaded, or it ran until HALT
+    CVM_ERROR    = 1,    // see cvm_error_message()
+    CVM_IO_ERROR = 2     // the object file could not be read
+  } CvmStatus;
+
+/**
+ * Selects the execution engine and the memory size used for a context.
+ * The defaults are set by cvm_default_options().
+ */
+typedef struct
+  {
+    bool   predecode;    // run decoded instructions instead of the byte code
+    bool   fuse;         // let the predecoder use superinstructions
+    bool   cacheTos;     // cache the top of the stack in registers
+    bool   jit;          // compile to native code where supported
+    bool   verify;       // verify the program and check its stack at procedure entry
+    bool   profile;      // count the instructions executed (see cvm_write_profile())
+    bool   callGraph;    // record the calls between procedures (see cvm_write_call_graph())
+    int    sampleRate;   // samples per second of CPU time, 0 for none (see cvm_write_samples())
+    bool   counters;     // count hardware events while running (see cvm_write_counters())
+    size_t memorySize;   // bytes of memory for code, variables, and the stack
+  } CvmOptions;
+
+// largest memory size (INT_MAX/2), so that addresses and offsets fit in an int
+#define CVM_MAX_MEMORY_SIZE ((size_t) 0x3FFFFFFF)
+
+/**
+ * Input and output for a program, both in UTF-8.  read() stores up to
+ * capacity bytes of input and returns how many, or 0 at the end of the
+ * input; the context reads ahead into its own buffer.  Output is buffered
+ * by the context and passed to write() when the buffer is full, at the end
+ * of each run, and, if interactive is true, before the context waits for
+ * input.  If a context is created without I/O callbacks, it uses standard
+ * input and standard output, and is interactive if standard output is a
+ * terminal.
+ */
+typedef struct
+  {
+    void*  userData;   // passed to every callback
+    size_t (*read)(void* userData, char* bytes, size_t capacity);
+    void   (*write)(void* userData, const char* bytes, size_t length);
+    bool   interactive;   // write the output before each read
+  } CvmIO;
+
+/**
+ * In-memory I/O, set up by cvm_memory_io(): the input is read from a
+ * buffer, and the output is kept in memory allocated with malloc(), or
+ * only counted if keepOutput is false.  If the output cannot grow, it is
+ * freed, output becomes NULL, and keepOutput becomes false.  The caller
+ * frees output.
+ */
+typedef struct
+  {
+    const char* input;
+    size_t      inputLength;
+    size_t      inputPosition;
+    bool        keepOutput;
+    char*       output;
+    size_t      outputLength;     // every byte written, kept or not
+    size_t      outputCapacity;
+  } CvmMemoryIO;
+
+/**
+ * Sets options to the default: the byte code interpreter, with
+ * superinstructions enabled for the predecoder, and 8192 bytes of memory.
+ */
+void cvm_default_options(CvmOptions* options);
+
+/**
+ * Parses a memory size for the options: a number of bytes, optionally
+ * followed by K, M, or G.  Returns 0 if the size is not valid or is larger
+ * than CVM_MAX_MEMORY_SIZE.
+ */
+size_t cvm_parse_size(const char* s);
+
+/**
+ * Sets io to read input from the buffer and write output to memory, kept
+ * in memory if keepOutput is true (see CvmMemoryIO).  The input must stay
+ * valid while the context uses io.
+ */
+void cvm_memory_io(CvmIO* io, CvmMemoryIO* memory, const char* input, size_t inputLength,
+                   bool keepOutput);
+
+/**
+ * Reads a whole file into memory that the caller frees with free().
+ * Returns NULL if the file cannot be read.
+ */
+char* cvm_read_file(const char* filename, size_t* length);
+
+/**
+ * Creates a context with the specified options and I/O callbacks (either
+ * may be NULL for the defaults).  Returns NULL if out of memory.
+ */
+CvmContext* cvm_create(const CvmOptions* options, const CvmIO* io);
+
+/**
+ * Frees a context and everything allocated for its program.
+ */
+void cvm_destroy(CvmContext* context);
+
+/**
+ * Loads object code into the context and translates it for the selected
+ * engine.  Replaces any program loaded before.
+ */
+CvmStatus cvm_load_from_buffer(CvmContext* context, const void* code, size_t length);
+
+/**
+ * Loads the object file into the context, like cvm_load_from_buffer().
+ * Where supported, the file is mapped into the address space and copied
+ * into memory in one step.
+ */
+CvmStatus cvm_load_file(CvmContext* context, const char* filename);
+
+/**
+ * Runs the loaded program from the beginning until it halts or fails.
+ */
+CvmStatus cvm_run(CvmContext* context);
+
+// snapshot address for the first instruction that reads input
+#define CVM_FIRST_INPUT (-1)
+
+/**
+ * Makes the next cvm_run() write an image of the machine to the file just
+ * before it executes the instruction at the code address (or the first
+ * GETCH, GETINT, or GETSTR if address is CVM_FIRST_INPUT), and then go on.
+ * The run uses the byte code interpreter.  No image is written if the
+ * program halts first.
+ */
+CvmStatus cvm_snapshot_at(CvmContext* context, int address, const char* filename);
+
+/**
+ * Loads an image written by a snapshot, in place of the loaded program.
+ * The next cvm_run() continues from where the snapshot was taken, with
+ * the selected engine; later runs start the program from the beginning.
+ */
+CvmStatus cvm_restore(CvmContext* context, const char* filename);
+
+/**
+ * Writes a report of the instructions executed by the runs of a context
+ * created with the profile option: the counts for each opcode and for
+ * each instruction, with its disassembly, and the loops (backward
+ * branches) taken most often.  Profiled runs use the byte code
+ * interpreter, whatever engine was selected.
+ */
+void cvm_write_profile(CvmContext* context, FILE* fp);
+
+/**
+ * Returns the number of instructions executed by the runs of a context
+ * created with the profile or callGraph option, or 0 for other contexts.
+ */
+unsigned long long cvm_instruction_count(const CvmContext* context);
+
+/**
+ * Writes the calls recorded by the runs of a context created with the
+ * callGraph option as folded stacks: a line for each chain of calls from
+ * the program to a procedure, with the procedure names separated by
+ * semicolons, followed by the instructions executed in the innermost
+ * procedure itself.  Flame graph tools such as flamegraph.pl accept this
+ * format.  The report of cvm_write_profile() then also lists the calls,
+ * and the inclusive and exclusive instructions and time, of each
+ * procedure.
+ */
+void cvm_write_call_graph(CvmContext* context, FILE* fp);
+
+/**
+ * Makes the runs of the context write a binary trace of the instructions
+ * they execute to the file, replacing its contents, or stops tracing if
+ * filename is NULL.  The trace has a record for each instruction with
+ * its code address, the stack pointer, the int on top of the stack, and
+ * the opcode; cvmtrace prints it as text.  Traced runs use the byte code
+ * interpreter, whatever engine was selected, and cannot be profiled.
+ */
+CvmStatus cvm_trace(CvmContext* context, const char* filename);
+
+/**
+ * Writes the report of the samples taken by the runs of a context created
+ * with a sample rate: the samples in each procedure itself and in each
+ * procedure or the ones it called (as far as a short walk of the dynamic
+ * links reaches), and the samples at each instruction.  Sampled runs use
+ * the byte code interpreter, whatever engine was selected, and only one
+ * context should be sampled at a time.
+ */
+void cvm_write_samples(CvmContext* context, FILE* fp);
+
+/**
+ * Writes the hardware performance counters of the runs of a context
+ * created with the counters option: the cycles, instructions, branch
+ * misses, and L1 data cache read misses counted while the engine ran,
+ * and its wall and CPU time.  If instructions (the CVM instructions those
+ * runs executed) is not 0, each count is also divided by it.  Counting
+ * uses perf_event_open() on Linux; where the kernel denies access, or
+ * does not support an event, only the times and the events it allows are
+ * reported.
+ */
+void cvm_write_counters(CvmContext* context, FILE* fp, unsigned long long instructions);
+
+/**
+ * Names the procedures in the reports with the labels of the assembly
+ * listing (.asm file) that the loaded program was assembled from, instead
+ * of their code addresses.
+ */
+CvmStatus cvm_load_symbols(CvmContext* context, const char* filename);
+
+/**
+ * Returns the message for the last error, or NULL if there was none.
+ */
+const wchar_t* cvm_error_message(const CvmContext* context);
+
+#endif
@@ -0,0 +1,604 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "opcode.h"
+
+
+/**
+ * This C program translates a CVM object file into a standalone C program
+ * that behaves like the object file run by cvm.  Usage:
+ *
+ *     cvm2c program.obj [program.c]
+ *     gcc -O2 program.c -o program
+ *
+ * The generated program contains the runtime helpers of libcvm.c and a
+ * single function with one label per instruction.  The body of each label
+ * is the body of the corresponding handler in libcvm.c with its operands
+ * replaced by constants, except that the I/O instructions keep the wide
+ * character stdio (getwchar() and putwchar()) that cvm used before libcvm
+ * did its own buffered I/O.  Branches become direct gotos to the label of the
+ * target instruction, CALL becomes a goto to the called procedure, and RET
+ * jumps through a switch over the return addresses of all CALL
+ * instructions in the program.
+ */
+
+typedef int8_t byte;
+
+// largest object file that can be translated (the memory size of cvm)
+#define NUM_BYTES_MEMORY 8192
+
+const int BYTES_PER_INTEGER = 4;
+const int BYTES_PER_CHAR    = 2;
+
+// exit return value for failure
+const int FAILURE = -1;
+
+// declare prototypes
+void loadProgram(FILE* fp);
+void findInstructions();
+void writeProgram(FILE* out);
+void writeInstruction(FILE* out, int address);
+void writeBody(FILE* out, const char* body, int values[]);
+int  instructionLength(int address);
+int  branchTarget(int address);
+void fail(const char* message, int address);
+
+// the code segment read from the object file
+byte code[NUM_BYTES_MEMORY];
+
+// number of bytes in the code segment
+int codeLength = 0;
+
+// true for each address where an instruction starts
+bool isInstruction[NUM_BYTES_MEMORY + 1];
+
+// address of an invalid instruction that ends translation, or codeLength
+int endAddress = 0;
+
+/**
+ * Definitions copied into every generated program.  These are the helper
+ * functions of libcvm.c that the inlined instruction bodies rely on, with
+ * the wide character stdio versions of the I/O helpers.
+ */
+const char* runtimeSource[] =
+  {
+    "#include <stdio.h>",
+    "#include <stdlib.h>",
+    "#include <string.h>",
+    "#include <stdint.h>",
+    "#include <wchar.h>",
+    "#include <stdbool.h>",
+    "#include <locale.h>",
+    "",
+    "// every instruction has a label, and not every program uses every helper",
+    "#if defined(__GNUC__)",
+    "#pragma GCC diagnostic ignored \"-Wunused-label\"",
+    "#pragma GCC diagnostic ignored \"-Wunused-function\"",
+    "#pragma GCC diagnostic ignored \"-Wunused-const-variable\"",
+    "#endif",
+    "",
+    "typedef int8_t byte;",
+    "",
+    "#define NUM_BYTES_MEMORY 8192",
+    "",
+    "static const int BYTES_PER_INTEGER = 4;",
+    "static const int BYTES_PER_CHAR    = 2;",
+    "static const int BYTES_PER_CONTEXT = 8;",
+    "",
+    "static const byte FALSE = (byte) 0;",
+    "static const byte TRUE  = (byte) 1;",
+    "",
+    "static byte memory[NUM_BYTES_MEMORY];",
+    "static int pc = 0;",
+    "static int bp = 0;",
+    "static int sp = 0;",
+    "static int sb = 0;",
+    "",
+    "static void error(wchar_t* message)",
+    "  {",
+    "    fwprintf(stderr, L\"%ls\\n\", message);",
+    "    exit(-1);",
+    "  }",
+    "",
+    "static wchar_t bytesToChar(byte b0, byte b1)",
+    "  {",
+    "    return (wchar_t) ((((int) b0 << 8) & 0x0000FF00) | ((int) b1 & 0x000000FF));",
+    "  }",
+    "",
+    "static int bytesToInt(byte b0, byte b1, byte b2, byte b3)",
+    "  {",
+    "    return ((int) b0 << 24 & 0xFF000000)",
+    "         | ((int) b1 << 16 & 0x00FF0000)",
+    "         | ((int) b2 << 8  & 0x0000FF00)",
+    "         | ((int) b3       & 0x000000FF);",
+    "  }",
+    "",
+    "static byte popByte()",
+    "  {",
+    "    return memory[sp--];",
+    "  }",
+    "",
+    "static wchar_t popChar()",
+    "  {",
+    "    byte b1 = popByte();",
+    "    byte b0 = popByte();",
+    "    return bytesToChar(b0, b1);",
+    "  }",
+    "",
+    "static int popInt()",
+    "  {",
+    "    byte b3 = popByte();",
+    "    byte b2 = popByte();",
+    "    byte b1 = popByte();",
+    "    byte b0 = popByte();",
+    "    return bytesToInt(b0, b1, b2, b3);",
+    "  }",
+    "",
+    "static void pushByte(byte b)",
+    "  {",
+    "    memory[++sp] = b;",
+    "  }",
+    "",
+    "static void pushChar(wchar_t c)",
+    "  {",
+    "    pushByte((byte) ((c >> 8) & 0x00FF));",
+    "    pushByte((byte) ((c >> 0) & 0x00FF));",
+    "  }",
+    "",
+    "static void pushInt(int n)",
+    "  {",
+    "    pushByte((byte) ((n >> 24) & 0x000000FF));",
+    "    pushByte((byte) ((n >> 16) & 0x000000FF));",
+    "    pushByte((byte) ((n >> 8)  & 0x000000FF));",
+    "    pushByte((byte) ((n >> 0)  & 0x000000FF));",
+    "  }",
+    "",
+    "static wchar_t getCharAtAddr(int address)",
+    "  {",
+    "    return bytesToChar(memory[address], memory[address + 1]);",
+    "  }",
+    "",
+    "static int getIntAtAddr(int address)",
+    "  {",
+    "    return bytesToInt(memory[address], memory[address + 1],",
+    "                      memory[address + 2], memory[address + 3]);",
+    "  }",
+    "",
+    "static void putCharToAddr(wchar_t value, int address)",
+    "  {",
+    "    memory[address + 0] = (byte) ((value >> 8) & 0x00FF);",
+    "    memory[address + 1] = (byte) ((value >> 0) & 0x00FF);",
+    "  }",
+    "",
+    "static void putIntToAddr(int value, int address)",
+    "  {",
+    "    memory[address + 0] = (byte) ((value >> 24) & 0x000000FF);",
+    "    memory[address + 1] = (byte) ((value >> 16) & 0x000000FF);",
+    "    memory[address + 2] = (byte) ((value >> 8)  & 0x000000FF);",
+    "    memory[address + 3] = (byte) ((value >> 0)  & 0x000000FF);",
+    "  }",
+    "",
+    "static size_t getln(wchar_t s[], size_t lim)",
+    "  {",
+    "    size_t i = 0;",
+    "    wint_t c;",
+    "",
+    "    while (--lim > 0 && (c = getwchar()) != WEOF && c != L'\\n')",
+    "      {",
+    "        if (c != L'\\r')",
+    "            s[i++] = c;",
+    "      }",
+    "",
+    "    s[i] = L'\\0';",
+    "",
+    "    return i;",
+    "  }",
+    "",
+    "static void readString(int destAddr, int capacity)",
+    "  {",
+    "    wchar_t* data = (wchar_t*) malloc(sizeof(wchar_t)*capacity);",
+    "    int length = getln(data, capacity);",
+    "",
+    "    putIntToAddr(length, destAddr);",
+    "    destAddr = destAddr + BYTES_PER_INTEGER;",
+    "    for (int i = 0; i < length; ++i)",
+    "      {",
+    "        putCharToAddr(data[i], destAddr);",
+    "        destAddr = destAddr + BYTES_PER_CHAR;",
+    "      }",
+    "",
+    "    free(data);",
+    "  }",
+    "",
+    "static void writeString(int capacity)",
+    "  {",
+    "    int numBytes = BYTES_PER_INTEGER + capacity*BYTES_PER_CHAR;",
+    "",
+    "    int addr = sp - numBytes + 1;",
+    "    int strLength = getIntAtAddr(addr);",
+    "    addr = addr + BYTES_PER_INTEGER;",
+    "",
+    "    for (int i = 0; i < strLength; ++i)",
+    "      {",
+    "        putwchar(getCharAtAddr(addr));",
+    "        addr = addr + BYTES_PER_CHAR;",
+    "      }",
+    "    fflush(stdout);",
+    "",
+    "    sp = sp - capacity;",
+    "  }",
+    "",
+    NULL
+  };
+
+/**
+ * Bodies of the instructions without operands, indexed by opcode.
+ */
+const char* zeroOperandBody[256] =
+  {
+    [ADD]      = "int operand2 = popInt(); int operand1 = popInt(); pushInt(operand1 + operand2);",
+    [BITAND]   = "int operand2 = popInt(); int operand1 = popInt(); pushInt(operand1 & operand2);",
+    [BITNOT]   = "int operand = popInt(); pushInt(~operand);",
+    [BITOR]    = "int operand2 = popInt(); int operand1 = popInt(); pushInt(operand1 | operand2);",
+    [BITXOR]   = "int operand2 = popInt(); int operand1 = popInt(); pushInt(operand1 ^ operand2);",
+    [BYTE2INT] = "byte b = popByte(); pushInt((int) b);",
+    [DEC]      = "int operand = popInt(); pushInt(operand - 1);",
+    [DIV]      = "int operand2 = popInt(); int operand1 = popInt();"
+                 " if (operand2 != 0) pushInt(operand1/operand2);"
+                 " else error(L\"*** FAULT: Divide by zero ***\");",
+    [GETCH]    = "int destAddr = popInt(); wint_t ch = getwchar();"
+                 " if (ch == WEOF) error(L\"Invalid input: EOF\");"
+                 " putCharToAddr((wchar_t) ch, destAddr);",
+    [GETINT]   = "int n = 0; int destAddr = popInt(); int result = wscanf(L\"%d\", &n);"
+                 " if (result != EOF) putIntToAddr(n, destAddr); else error(L\"Invalid input\");",
+    [HALT]     = "goto halt;",
+    [INC]      = "int operand = popInt(); pushInt(operand + 1);",
+    [INT2BYTE] = "int n = popInt(); pushByte((byte) n);",
+    [LOADB]    = "int address = popInt(); pushByte(memory[address]);",
+    [LOAD2B]   = "int address = popInt(); byte b0 = memory[address + 0]; byte b1 = memory[address + 1];"
+                 " pushByte(b0); pushByte(b1);",
+    [LOADW]    = "int address = popInt(); pushInt(getIntAtAddr(address));",
+    [LDCB0]    = "pushByte((byte) 0);",
+    [LDCB1]    = "pushByte((byte) 1);",
+    [LDCINT0]  = "pushInt(0);",
+    [LDCINT1]  = "pushInt(1);",
+    [MOD]      = "int operand2 = popInt(); int operand1 = popInt(); pushInt(operand1%operand2);",
+    [MUL]      = "int operand2 = popInt(); int operand1 = popInt(); pushInt(operand1*operand2);",
+    [NEG]      = "int operand1 = popInt(); pushInt(-operand1);",
+    [NOT]      = "byte operand = popByte(); pushByte(operand == FALSE ? TRUE : FALSE);",
+    [PUTBYTE]  = "wprintf(L\"%d\", popByte());",
+    [PUTCH]    = "putwchar(popChar());",
+    [PUTINT]   = "wprintf(L\"%d\", popInt());",
+    [PUTEOL]   = "putwchar(L'\\n');",
+    [RET0]     = "pc = getIntAtAddr(bp + BYTES_PER_INTEGER); sp = bp - 1; bp = getIntAtAddr(bp);"
+                 " goto returnDispatch;",
+    [RET4]     = "pc = getIntAtAddr(bp + BYTES_PER_INTEGER); sp = bp - 5; bp = getIntAtAddr(bp);"
+                 " goto returnDispatch;",
+    [SHL]      = "int operand2 = popInt(); int operand1 = popInt();"
+                 " pushInt(operand1 << (operand2 & 0x1F));",
+    [SHR]      = "int operand2 = popInt(); int operand1 = popInt();"
+                 " pushInt(operand1 >> (operand2 & 0x1F));",
+    [STOREB]   = "byte value = popByte(); int destAddr = popInt(); memory[destAddr] = value;",
+    [STORE2B]  = "byte byte1 = popByte(); byte byte0 = popByte(); int destAddr = popInt();"
+                 " memory[destAddr + 0] = byte0; memory[destAddr + 1] = byte1;",
+    [STOREW]   = "int value = popInt(); int destAddr = popInt(); putIntToAddr(value, destAddr);",
+    [SUB]      = "int operand2 = popInt(); int operand1 = popInt(); pushInt(operand1 - operand2);",
+  };
+
+/**
+ * Bodies of the instructions with an int operand, indexed by opcode.  The
+ * operand is substituted for $OPERAND; for branches and calls, $TARGET is
+ * replaced by the target address and $RETURN by the return address.
+ */
+const char* intOperandBody[256] =
+  {
+    [ALLOC]   = "sp = sp + $OPERAND; if (sp >= NUM_BYTES_MEMORY) error(L\"*** Out of memory ***\");",
+    [BR]      = "goto L$TARGET;",
+    [BE]      = "int operand2 = popInt(); int operand1 = popInt(); if (operand1 == operand2) goto L$TARGET;",
+    [BNE]     = "int operand2 = popInt(); int operand1 = popInt(); if (operand1 != operand2) goto L$TARGET;",
+    [BG]      = "int operand2 = popInt(); int operand1 = popInt(); if (operand1 > operand2) goto L$TARGET;",
+    [BGE]     = "int operand2 = popInt(); int operand1 = popInt(); if (operand1 >= operand2) goto L$TARGET;",
+    [BL]      = "int operand2 = popInt(); int operand1 = popInt(); if (operand1 < operand2) goto L$TARGET;",
+    [BLE]     = "int operand2 = popInt(); int operand1 = popInt(); if (operand1 <= operand2) goto L$TARGET;",
+    [BZ]      = "byte value = popByte(); if (value == 0) goto L$TARGET;",
+    [BNZ]     = "byte value = popByte(); if (value != 0) goto L$TARGET;",
+    [CALL]    = "pushInt(bp); pushInt($RETURN); bp = sp - BYTES_PER_CONTEXT + 1; goto L$TARGET;",
+    [GETSTR]  = "int destAddr = popInt(); readString(destAddr, $OPERAND);",
+    [LOAD]    = "int address = popInt(); for (int i = 0; i < $OPERAND; ++i) pushByte(memory[address + i]);",
+    [LDCINT]  = "pushInt($OPERAND);",
+    [LDLADDR] = "pushInt(bp + $OPERAND);",
+    [LDGADDR] = "pushInt(sb + $OPERAND);",
+    [PROC]    = "sp = sp + $OPERAND; if (sp >= NUM_BYTES_MEMORY) error(L\"*** Out of memory ***\");",
+    [PROGRAM] = "bp = sb; sp = bp + $OPERAND - 1; if (sp >= NUM_BYTES_MEMORY) error(L\"*** Out of memory ***\");",
+    [PUTSTR]  = "writeString($OPERAND);",
+    [RET]     = "pc = getIntAtAddr(bp + BYTES_PER_INTEGER); sp = bp - $OPERAND - 1; bp = getIntAtAddr(bp);"
+                " goto returnDispatch;",
+    [STORE]   = "int destAddr = getIntAtAddr(sp - $OPERAND - 3);"
+                " for (int i = $OPERAND - 1; i >= 0; --i) memory[destAddr + i] = popByte(); popInt();",
+  };
+
+/**
+ * This function reads the object file specified by argv[1] and writes the
+ * translated C program to argv[2] (default: the object file name with the
+ * suffix ".obj" replaced by ".c").
+ */
+int main(int argc, char* argv[])
+  {
+    if (argc < 2 || argc > 3)
+      {
+        fprintf(stderr, "Usage: cvm2c filename.obj [filename.c]\n");
+        exit(FAILURE);
+      }
+
+    char* objFilename = argv[1];
+    char* cFilename   = argc == 3 ? argv[2] : NULL;
+
+    if (cFilename == NULL)
+      {
+        cFilename = (char*) malloc((strlen(objFilename) + 3)*sizeof(char));
+        strcpy(cFilename, objFilename);
+        char *dot = strrchr(cFilename, '.');
+        if (dot && strcmp(dot, ".obj") == 0)
+            *dot = '\0';
+        strcat(cFilename, ".c");
+      }
+
+    FILE *fp = fopen(objFilename, "rb");
+    if (!fp)
+      {
+        fprintf(stderr, "Error opening file %s\n", objFilename);
+        exit(FAILURE);
+      }
+    loadProgram(fp);
+    fclose(fp);
+
+    findInstructions();
+
+    FILE *out = fopen(cFilename, "w");
+    if (!out)
+      {
+        fprintf(stderr, "Error opening file %s\n", cFilename);
+        exit(FAILURE);
+      }
+    writeProgram(out);
+    fclose(out);
+
+    return 0;
+  }
+
+/**
+ * Reads the code segment from the object file.
+ */
+void loadProgram(FILE* fp)
+  {
+    codeLength = fread(code, 1, sizeof(code), fp);
+    if (codeLength == sizeof(code) && fgetc(fp) != EOF)
+      {
+        fprintf(stderr, "*** Out of memory ***\n");
+        exit(FAILURE);
+      }
+  }
+
+/**
+ * Prints an error message for the instruction at the specified address
+ * and exits with nonzero status code.
+ */
+void fail(const char* message, int address)
+  {
+    fprintf(stderr, "cvm2c: %s (address %d)\n", message, address);
+    exit(FAILURE);
+  }
+
+/**
+ * Returns the int operand of the instruction at the specified address.
+ */
+int intOperand(int address)
+  {
+    return (int) (((uint32_t) (uint8_t) code[address + 1] << 24)
+                | ((uint32_t) (uint8_t) code[address + 2] << 16)
+                | ((uint32_t) (uint8_t) code[address + 3] << 8)
+                |  (uint32_t) (uint8_t) code[address + 4]);
+  }
+
+/**
+ * Returns the char operand of the instruction at the specified address.
+ */
+int charOperand(int address)
+  {
+    return ((uint8_t) code[address + 1] << 8) | (uint8_t) code[address + 2];
+  }
+
+/**
+ * Returns the length in bytes of the instruction at the specified address,
+ * or 0 if it is not a valid instruction.
+ */
+int instructionLength(int address)
+  {
+    int opcode = code[address];
+
+    if (isZeroOperandOpcode(opcode))
+        return 1;
+    else if (isByteOperandOpcode(opcode))
+        return 2;
+    else if (isIntOperandOpcode(opcode))
+        return 1 + BYTES_PER_INTEGER;
+    else if (opcode == LDCCH)
+        return 1 + BYTES_PER_CHAR;
+    else if (opcode == LDCSTR && address + BYTES_PER_INTEGER < codeLength
+                              && intOperand(address) >= 0)
+        return 1 + BYTES_PER_INTEGER + intOperand(address)*BYTES_PER_CHAR;
+    else
+        return 0;
+  }
+
+/**
+ * Returns the target address of the branch or call at the specified address.
+ */
+int branchTarget(int address)
+  {
+    return address + 1 + BYTES_PER_INTEGER + intOperand(address);
+  }
+
+/**
+ * Marks the start of each instruction.  Translation ends at the end of the
+ * code segment or at the first invalid instruction, which is translated
+ * into a runtime error just as cvm reports it.
+ */
+void findInstructions()
+  {
+    int address = 0;
+    while (address < codeLength)
+      {
+        int length = instructionLength(address);
+        if (length == 0)
+            break;
+        else if (address + length > codeLength)
+            fail("truncated instruction", address);
+
+        isInstruction[address] = true;
+        address = address + length;
+      }
+
+    endAddress = address;
+    isInstruction[endAddress] = true;
+
+    // all branches must lead to the start of an instruction
+    for (address = 0; address < endAddress; address = address + instructionLength(address))
+      {
+        int opcode = code[address];
+        if (intOperandBody[opcode] != NULL && strstr(intOperandBody[opcode], "$TARGET") != NULL)
+          {
+            int target = branchTarget(address);
+            if (target < 0 || target > endAddress || !isInstruction[target])
+                fail("branch target is not an instruction", address);
+          }
+      }
+  }
+
+/**
+ * Writes the complete C program.
+ */
+void writeProgram(FILE* out)
+  {
+    fprintf(out, "// Generated by cvm2c.  Compile with: gcc -O2 <this file>\n\n");
+    for (int i = 0; runtimeSource[i] != NULL; ++i)
+        fprintf(out, "%s\n", runtimeSource[i]);
+
+    // initial contents of the code segment
+    fprintf(out, "static const byte code[%d] =\n  {", codeLength > 0 ? codeLength : 1);
+    for (int i = 0; i < codeLength; ++i)
+        fprintf(out, "%s%d,", i % 16 == 0 ? "\n    " : " ", code[i]);
+    fprintf(out, "\n  };\n\n");
+
+    fprintf(out, "int main()\n");
+    fprintf(out, "  {\n");
+    fprintf(out, "#if defined(_WIN64) || defined(_WIN32)\n");
+    fprintf(out, "    setlocale(LC_ALL, \".UTF-8\");\n");
+    fprintf(out, "#else\n");
+    fprintf(out, "    setlocale(LC_ALL, \"\");\n");
+    fprintf(out, "#endif\n\n");
+    fprintf(out, "    memcpy(memory, code, %d);\n", codeLength);
+    fprintf(out, "    bp = %d;\n", codeLength);
+    fprintf(out, "    sb = %d;\n", codeLength);
+    fprintf(out, "    sp = bp - 1;\n\n");
+
+    for (int address = 0; address < endAddress; address = address + instructionLength(address))
+        writeInstruction(out, address);
+
+    // running off the end of the translated code
+    fprintf(out, "L%d:\n", endAddress);
+    fprintf(out, "    error(L\"invalid machine instruction\");\n\n");
+
+    // RET continues after the CALL that pushed the return address
+    fprintf(out, "returnDispatch:\n");
+    fprintf(out, "    switch (pc)\n");
+    fprintf(out, "      {\n");
+    for (int address = 0; address < endAddress; address = address + instructionLength(address))
+      {
+        if (code[address] == CALL)
+          {
+            int returnAddress = address + 1 + BYTES_PER_INTEGER;
+            fprintf(out, "        case %d: goto L%d;\n", returnAddress, returnAddress);
+          }
+      }
+    fprintf(out, "        default: error(L\"*** FAULT: Invalid return address ***\");\n");
+    fprintf(out, "      }\n\n");
+
+    fprintf(out, "halt:\n");
+    fprintf(out, "    return 0;\n");
+    fprintf(out, "  }\n");
+  }
+
+/**
+ * Writes an instruction body, replacing $OPERAND, $TARGET, and $RETURN by
+ * values[0], values[1], and values[2].
+ */
+void writeBody(FILE* out, const char* body, int values[])
+  {
+    const char* names[] = { "$OPERAND", "$TARGET", "$RETURN" };
+
+    while (*body != '\0')
+      {
+        int i = 0;
+        while (i < 3 && strncmp(body, names[i], strlen(names[i])) != 0)
+            ++i;
+
+        if (i < 3)
+          {
+            fprintf(out, "%d", values[i]);
+            body = body + strlen(names[i]);
+          }
+        else
+            fputc(*body++, out);
+      }
+  }
+
+/**
+ * Writes the label and inlined body of the instruction at the specified address.
+ */
+void writeInstruction(FILE* out, int address)
+  {
+    int opcode = code[address];
+
+    fprintf(out, "L%d:   // %s", address, toString(opcode));
+    if (isIntOperandOpcode(opcode) || opcode == LDCSTR)
+        fprintf(out, " %d", intOperand(address));
+    else if (isByteOperandOpcode(opcode))
+        fprintf(out, " %d", code[address + 1]);
+    else if (opcode == LDCCH)
+        fprintf(out, " %d", charOperand(address));
+    fprintf(out, "\n    { ");
+
+    if (isZeroOperandOpcode(opcode))
+        fprintf(out, "%s", zeroOperandBody[opcode]);
+    else if (isIntOperandOpcode(opcode))
+      {
+        int values[3] = { intOperand(address), branchTarget(address),
+                          address + 1 + BYTES_PER_INTEGER };
+        writeBody(out, intOperandBody[opcode], values);
+      }
+    else if (opcode == LDCB)
+        fprintf(out, "pushByte((byte) %d);", code[address + 1]);
+    else if (opcode == LDCCH)
+        fprintf(out, "char ch = (char) %d; pushChar(ch);", charOperand(address));
+    else   // LDCSTR
+      {
+        int capacity = intOperand(address);
+        fprintf(out, "pushInt(%d);", capacity);
+        if (capacity > 0)
+          {
+            fprintf(out, "\n      static const wchar_t chars[%d] = {", capacity);
+            for (int i = 0; i < capacity; ++i)
+              {
+                int charAddress = address + 1 + BYTES_PER_INTEGER + i*BYTES_PER_CHAR;
+                fprintf(out, "%s%d", i == 0 ? " " : ", ", charOperand(charAddress - 1));
+              }
+            fprintf(out, " };\n");
+            fprintf(out, "      for (int i = 0; i < %d; ++i) pushChar(chars[i]);\n    ", capacity);
+          }
+      }
+
+    fprintf(out, " }\n");
+  }
@@ -0,0 +1,83 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "opcode.h"
+
+
+/**
+ * This C program prints a trace written by cvm --trace=FILE as text, one
+ * line for each instruction executed: its code address, its opcode, and
+ * the stack pointer and the int on top of the stack before it executed.
+ * Usage:
+ *
+ *     cvm --trace=program.trace program.obj
+ *     cvmtrace program.trace
+ *
+ * The format of a trace is described in trace.c.
+ */
+
+// the bytes at the start of a trace file, and the size of each record
+#define TRACE_MAGIC       "CVMTRACE"
+#define TRACE_RECORD_SIZE 13
+
+// exit return value for failure
+const int FAILURE = -1;
+
+/**
+ * Returns the int stored in little-endian byte order at bytes.
+ */
+int traceInt(const unsigned char* bytes)
+  {
+    uint32_t u = (uint32_t) bytes[0]
+               | (uint32_t) bytes[1] << 8
+               | (uint32_t) bytes[2] << 16
+               | (uint32_t) bytes[3] << 24;
+    return (int) u;
+  }
+
+int main(int argc, char* argv[])
+  {
+    if (argc != 2)
+      {
+        fprintf(stderr, "Usage: cvmtrace filename.trace\n");
+        exit(FAILURE);
+      }
+
+    FILE* fp = fopen(argv[1], "rb");
+    if (!fp)
+      {
+        fprintf(stderr, "Error opening file %s\n", argv[1]);
+        exit(FAILURE);
+      }
+
+    char magic[8];
+    if (fread(magic, 1, 8, fp) != 8 || memcmp(magic, TRACE_MAGIC, 8) != 0)
+      {
+        fprintf(stderr, "%s is not a cvm trace\n", argv[1]);
+        exit(FAILURE);
+      }
+
+    printf("%7s  %-10s %8s %12s\n", "pc", "opcode", "sp", "top");
+
+    unsigned char record[TRACE_RECORD_SIZE];
+    unsigned long long numRecords = 0;
+    size_t length;
+    while ((length = fread(record, 1, TRACE_RECORD_SIZE, fp)) == TRACE_RECORD_SIZE)
+      {
+        printf("%7d  %-10s %8d %12d\n", traceInt(record), toString(record[12]),
+               traceInt(record + 4), traceInt(record + 8));
+        ++numRecords;
+      }
+    fclose(fp);
+
+    if (length != 0)
+      {
+        fprintf(stderr, "%s ends in the middle of a record\n", argv[1]);
+        exit(FAILURE);
+      }
+
+    fprintf(stderr, "%llu instructions\n", numRecords);
+    return 0;
+  }
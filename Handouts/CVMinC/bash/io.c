@@ -0,0 +1,556 @@
+#include "vm.h"
+
+#include <limits.h>
+#include <wctype.h>
+
+#if defined(_WIN64) || defined(_WIN32)
+#include <io.h>
+#define isatty _isatty
+#define read   _read
+#define STDIN_FILENO  0
+#define STDOUT_FILENO 1
+#else
+#include <errno.h>
+#include <unistd.h>
+#endif
+
+
+/**
+ * Input and output of programs.
+ *
+ * Input is read by the read() callback into a buffer in the context and
+ * decoded from UTF-8 there.  GETCH, GETINT, and GETSTR behave as getwchar(),
+ * wscanf(L"%d"), and the line reader built on getwchar() did: an invalid
+ * or incomplete UTF-8 sequence reads as WEOF and stays in the input, an
+ * int is read as strtol() reads it and then narrowed to int, and a line
+ * of input is stored directly into the string in memory.
+ *
+ * Output is encoded as UTF-8 into a buffer in the context and handed to
+ * the write() callback in large chunks: when the buffer is full, when a
+ * run ends (at HALT or after an error), and before each read if the I/O
+ * is interactive.  Chars in CVM memory are UTF-16 code units, so a
+ * surrogate pair is combined into one code point; an unpaired surrogate
+ * cannot be encoded and is dropped, as wide stdio did before.
+ *
+ * The default I/O reads standard input with read(2) and writes standard
+ * output with write(2).  It is interactive when standard output
+ * is a terminal, so that prompts appear before the program waits.
+ * Memory I/O (cvm_memory_io()) reads a buffer and keeps or only counts
+ * the output, for tools that run many programs in one process.
+ */
+
+/**
+ * Makes at least n bytes of input available at inputPosition, unless the
+ * input ends first.  Returns the number of bytes available.
+ */
+size_t fillInput(CvmContext* context, size_t n)
+  {
+    size_t available = context->inputLength - context->inputPosition;
+    if (available >= n || context->inputEnd)
+        return available;
+
+    // the program is about to wait for input
+    if (context->io.interactive)
+        flushOutput();
+
+    memmove(context->input, context->input + context->inputPosition, available);
+    context->inputPosition = 0;
+    context->inputLength   = available;
+
+    while (context->inputLength < n && !context->inputEnd)
+      {
+        size_t length = context->io.read(context->io.userData,
+                                         context->input + context->inputLength,
+                                         INPUT_BUFFER_SIZE - context->inputLength);
+        if (length == 0)
+            context->inputEnd = true;
+        context->inputLength = context->inputLength + length;
+      }
+
+    return context->inputLength;
+  }
+
+/**
+ * Decodes the next character of the input without consuming it and sets
+ * *length to its length in bytes.  Returns WEOF at the end of the input
+ * or for an invalid sequence, which is then never consumed.
+ */
+wint_t peekChar(CvmContext* context, size_t* length)
+  {
+    *length = 0;
+    if (fillInput(context, 1) == 0)
+        return WEOF;
+
+    const unsigned char* s = (const unsigned char*) context->input + context->inputPosition;
+    if (s[0] < 0x80)
+      {
+        *length = 1;
+        return s[0];
+      }
+
+    size_t n;
+    wint_t c;
+    if (s[0] >= 0xC2 && s[0] < 0xE0)
+      {
+        n = 2;
+        c = s[0] & 0x1F;
+      }
+    else if (s[0] >= 0xE0 && s[0] < 0xF0)
+      {
+        n = 3;
+        c = s[0] & 0x0F;
+      }
+    else if (s[0] >= 0xF0 && s[0] < 0xF5)
+      {
+        n = 4;
+        c = s[0] & 0x07;
+      }
+    else
+        return WEOF;
+
+    // a line of input never ends inside a sequence, so this only waits
+    // for more input if the sequence is incomplete
+    if (fillInput(context, n) < n)
+        return WEOF;
+    s = (const unsigned char*) context->input + context->inputPosition;
+
+    for (size_t i = 1; i < n; ++i)
+      {
+        if ((s[i] & 0xC0) != 0x80)
+            return WEOF;
+        c = (c << 6) | (s[i] & 0x3F);
+      }
+
+    // reject overlong forms, surrogates, and values beyond Unicode
+    if ((n == 3 && c < 0x800) || (n == 4 && c < 0x10000)
+          || (c >= 0xD800 && c <= 0xDFFF) || c > 0x10FFFF)
+        return WEOF;
+
+    *length = n;
+    return c;
+  }
+
+/**
+ * Reads the next character from the program's input; WEOF at end of input.
+ */
+wint_t inputChar()
+  {
+    CvmContext* context = currentContext;
+
+    if (context->inputPosition < context->inputLength)
+      {
+        unsigned char b = (unsigned char) context->input[context->inputPosition];
+        if (b < 0x80)
+          {
+            context->inputPosition = context->inputPosition + 1;
+            return b;
+          }
+      }
+
+    size_t length;
+    wint_t c = peekChar(context, &length);
+    context->inputPosition = context->inputPosition + length;
+    return c;
+  }
+
+/**
+ * Returns true if b is an ASCII white-space character.
+ */
+static inline bool isSpace(unsigned char b)
+  {
+    return b == ' ' || (b >= '\t' && b <= '\r');
+  }
+
+/**
+ * Reads an int from the program's input; returns the same values as
+ * wscanf(L"%d", n), and leaves *n unchanged unless an int was read.
+ */
+int inputInt(int* n)
+  {
+    CvmContext* context = currentContext;
+    const unsigned char* s = (const unsigned char*) context->input;
+
+    // skip white space
+    for (;;)
+      {
+        while (context->inputPosition < context->inputLength && isSpace(s[context->inputPosition]))
+            context->inputPosition = context->inputPosition + 1;
+
+        if (context->inputPosition < context->inputLength && s[context->inputPosition] < 0x80)
+            break;
+
+        size_t length;
+        wint_t c = peekChar(context, &length);
+        if (c == WEOF)
+            return EOF;
+        else if (!iswspace(c))
+            break;
+
+        context->inputPosition = context->inputPosition + length;
+      }
+
+    bool negative = false;
+    if (s[context->inputPosition] == '-' || s[context->inputPosition] == '+')
+      {
+        negative = s[context->inputPosition] == '-';
+        context->inputPosition = context->inputPosition + 1;
+      }
+
+    if (fillInput(context, 1) == 0 || (unsigned) (s[context->inputPosition] - '0') > 9)
+        return 0;
+
+    // accumulate the digits, saturating past any value that fits in a long
+    unsigned long long value = 0;
+    for (;;)
+      {
+        size_t i   = context->inputPosition;
+        size_t end = context->inputLength;
+        unsigned digit;
+        while (i < end && (digit = (unsigned) (s[i] - '0')) <= 9)
+          {
+            value = value <= (ULLONG_MAX - 9)/10 ? 10*value + digit : ULLONG_MAX;
+            ++i;
+          }
+        context->inputPosition = i;
+
+        if (i < end || fillInput(context, 1) == 0)
+            break;
+      }
+
+    // narrow as strtol() and then scanf() do
+    long result;
+    if (value > (unsigned long long) LONG_MAX)
+        result = negative ? LONG_MIN : LONG_MAX;
+    else
+        result = negative ? -(long) value : (long) value;
+
+    *n = (int) result;
+    return 1;
+  }
+
+/**
+ * Reads a line of input into the chars at the memory address, without the
+ * '\n' and skipping '\r', as getln() did: at most capacity - 1 characters
+ * are consumed.  Returns the number of chars stored.
+ */
+int inputLine(int address, int capacity)
+  {
+    CvmContext* context = currentContext;
+    const unsigned char* s = (const unsigned char*) context->input;
+    int length = 0;
+
+    for (int i = 1; i < capacity; ++i)
+      {
+        wint_t c;
+        if (context->inputPosition < context->inputLength && s[context->inputPosition] < 0x80)
+          {
+            c = s[context->inputPosition];
+            context->inputPosition = context->inputPosition + 1;
+          }
+        else if ((c = inputChar()) == WEOF)
+            break;
+
+        if (c == L'\n')
+            break;
+        else if (c != L'\r')
+          {
+            putCharToAddr((wchar_t) c, address);
+            address = address + 2;
+            ++length;
+          }
+      }
+
+    return length;
+  }
+
+/**
+ * Hands the buffered output to the write() callback.
+ */
+void flushOutput()
+  {
+    CvmContext* context = currentContext;
+
+    if (context->outputLength > 0)
+      {
+        context->io.write(context->io.userData, context->output, context->outputLength);
+        context->outputLength = 0;
+      }
+  }
+
+/**
+ * Encodes a char that is not a surrogate as UTF-8 at out.  Returns the
+ * number of bytes, at most 3.
+ */
+static inline int encodeBmpChar(char* out, unsigned c)
+  {
+    if (c < 0x80)
+      {
+        out[0] = (char) c;
+        return 1;
+      }
+    else if (c < 0x800)
+      {
+        out[0] = (char) (0xC0 | (c >> 6));
+        out[1] = (char) (0x80 | (c & 0x3F));
+        return 2;
+      }
+    else
+      {
+        out[0] = (char) (0xE0 | (c >> 12));
+        out[1] = (char) (0x80 | ((c >> 6) & 0x3F));
+        out[2] = (char) (0x80 | (c & 0x3F));
+        return 3;
+      }
+  }
+
+/**
+ * Encodes one UTF-16 code unit into the output buffer, which must have
+ * room for at least 4 more bytes.
+ */
+void encodeChar(CvmContext* context, unsigned c)
+  {
+    char* out = context->output + context->outputLength;
+    unsigned highSurrogate = context->highSurrogate;
+    context->highSurrogate = 0;
+
+    if (c >= 0xD800 && c <= 0xDBFF)
+        context->highSurrogate = c;   // wait for the low surrogate
+    else if (c >= 0xDC00 && c <= 0xDFFF)
+      {
+        if (highSurrogate != 0)
+          {
+            unsigned codePoint = 0x10000 + ((highSurrogate - 0xD800) << 10) + (c - 0xDC00);
+            out[0] = (char) (0xF0 | (codePoint >> 18));
+            out[1] = (char) (0x80 | ((codePoint >> 12) & 0x3F));
+            out[2] = (char) (0x80 | ((codePoint >> 6) & 0x3F));
+            out[3] = (char) (0x80 | (codePoint & 0x3F));
+            context->outputLength = context->outputLength + 4;
+          }
+      }
+    else
+        context->outputLength = context->outputLength + encodeBmpChar(out, c);
+  }
+
+/**
+ * Encodes the string of length chars at the memory address as UTF-8 at
+ * out, which must have room for 3 bytes per char.  Returns the number of
+ * bytes, or -1 if the string contains a surrogate, since its encoding
+ * depends on the output around it.
+ */
+int encodeString(int address, int length, char* out)
+  {
+    char* start = out;
+
+    for (int i = 0; i < length; ++i)
+      {
+        unsigned c = (unsigned) getCharAtAddr(address) & 0xFFFF;
+        if (c >= 0xD800 && c <= 0xDFFF)
+            return -1;
+
+        out = out + encodeBmpChar(out, c);
+        address = address + 2;
+      }
+
+    return (int) (out - start);
+  }
+
+/**
+ * Writes text encoded by encodeString() to the program's output.
+ */
+void outputBytes(const char* bytes, size_t length)
+  {
+    CvmContext* context = currentContext;
+
+    if (length == 0)
+        return;
+
+    // as if the chars were written one by one
+    context->highSurrogate = 0;
+
+    if (length > OUTPUT_BUFFER_SIZE - context->outputLength)
+      {
+        flushOutput();
+        if (length > OUTPUT_BUFFER_SIZE)
+          {
+            context->io.write(context->io.userData, bytes, length);
+            return;
+          }
+      }
+
+    memcpy(context->output + context->outputLength, bytes, length);
+    context->outputLength = context->outputLength + length;
+  }
+
+/**
+ * Writes a character to the program's output.
+ */
+void outputChar(wchar_t c)
+  {
+    CvmContext* context = currentContext;
+
+    if (OUTPUT_BUFFER_SIZE - context->outputLength < 4)
+        flushOutput();
+
+    encodeChar(context, (unsigned) c & 0xFFFF);
+  }
+
+/**
+ * Writes the string of length chars at the address in memory to the
+ * program's output.
+ */
+void outputString(int address, int length)
+  {
+    CvmContext* context = currentContext;
+
+    for (int i = 0; i < length; ++i)
+      {
+        if (OUTPUT_BUFFER_SIZE - context->outputLength < 4)
+            flushOutput();
+
+        encodeChar(context, (unsigned) getCharAtAddr(address) & 0xFFFF);
+        address = address + 2;
+      }
+  }
+
+/**
+ * Writes an int in decimal to the program's output.
+ */
+void outputInt(int n)
+  {
+    CvmContext* context = currentContext;
+
+    // at most a sign and 10 digits
+    if (OUTPUT_BUFFER_SIZE - context->outputLength < 11)
+        flushOutput();
+
+    char digits[10];
+    int  numDigits = 0;
+    unsigned magnitude = n < 0 ? 0u - (unsigned) n : (unsigned) n;
+    do
+      {
+        digits[numDigits++] = (char) ('0' + magnitude % 10);
+        magnitude = magnitude / 10;
+      }
+    while (magnitude != 0);
+
+    char* out = context->output + context->outputLength;
+    if (n < 0)
+        *out++ = '-';
+    while (numDigits > 0)
+        *out++ = digits[--numDigits];
+
+    context->outputLength = out - context->output;
+  }
+
+size_t stdioRead(void* userData, char* bytes, size_t capacity)
+  {
+    for (;;)
+      {
+        long length = (long) read(STDIN_FILENO, bytes, capacity > INT_MAX ? INT_MAX : capacity);
+        if (length >= 0)
+            return (size_t) length;
+#if !defined(_WIN64) && !defined(_WIN32)
+        else if (errno == EINTR)
+            continue;
+#endif
+        return 0;
+      }
+  }
+
+void stdioWrite(void* userData, const char* bytes, size_t length)
+  {
+    // anything the client printed with stdio comes first
+    fflush(stdout);
+
+#if defined(_WIN64) || defined(_WIN32)
+    fwrite(bytes, 1, length, stdout);
+    fflush(stdout);
+#else
+    while (length > 0)
+      {
+        ssize_t written = write(STDOUT_FILENO, bytes, length);
+        if (written < 0 && errno == EINTR)
+            continue;
+        else if (written <= 0)
+            break;
+
+        bytes  = bytes + written;
+        length = length - written;
+      }
+#endif
+  }
+
+/**
+ * Sets io to standard input and standard output.
+ */
+void setStdio(CvmIO* io)
+  {
+    io->userData    = NULL;
+    io->read        = stdioRead;
+    io->write       = stdioWrite;
+    io->interactive = isatty(STDOUT_FILENO);
+  }
+
+size_t memoryRead(void* userData, char* bytes, size_t capacity)
+  {
+    CvmMemoryIO* memory = (CvmMemoryIO*) userData;
+
+    size_t length = memory->inputLength - memory->inputPosition;
+    if (length > capacity)
+        length = capacity;
+
+    memcpy(bytes, memory->input + memory->inputPosition, length);
+    memory->inputPosition = memory->inputPosition + length;
+    return length;
+  }
+
+void memoryWrite(void* userData, const char* bytes, size_t length)
+  {
+    CvmMemoryIO* memory = (CvmMemoryIO*) userData;
+
+    if (memory->keepOutput && memory->outputLength + length > memory->outputCapacity)
+      {
+        size_t capacity = memory->outputCapacity == 0 ? 4096 : 2*memory->outputCapacity;
+        while (capacity < memory->outputLength + length)
+            capacity = 2*capacity;
+
+        char* output = (char*) realloc(memory->output, capacity);
+        if (output == NULL)
+          {
+            // keep counting, but not the output that no longer fits
+            free(memory->output);
+            memory->output     = NULL;
+            memory->keepOutput = false;
+          }
+        else
+          {
+            memory->output         = output;
+            memory->outputCapacity = capacity;
+          }
+      }
+
+    if (memory->keepOutput)
+        memcpy(memory->output + memory->outputLength, bytes, length);
+    memory->outputLength = memory->outputLength + length;
+  }
+
+/**
+ * Sets io to read the input from a buffer and to keep the output in
+ * memory, or only count it if keepOutput is false.
+ */
+void setMemoryIO(CvmIO* io, CvmMemoryIO* memory, const char* input, size_t inputLength,
+                 bool keepOutput)
+  {
+    memory->input          = input;
+    memory->inputLength    = inputLength;
+    memory->inputPosition  = 0;
+    memory->keepOutput     = keepOutput;
+    memory->output         = NULL;
+    memory->outputLength   = 0;
+    memory->outputCapacity = 0;
+
+    io->userData    = memory;
+    io->read        = memoryRead;
+    io->write       = memoryWrite;
+    io->interactive = false;
+  }
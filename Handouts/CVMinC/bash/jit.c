@@ -0,0 +1,838 @@
+#include "opcode.h"
+#include "vm.h"
+
+
+/**
+ * A baseline just-in-time compiler that translates CVM code into x86-64
+ * machine code (cvm --jit).
+ *
+ * The compiler works from the decoded program built by predecodeProgram()
+ * and emits a fixed template of machine instructions for each CVM
+ * instruction, one procedure after another in the order they appear in the
+ * code segment.  The compiled code keeps the virtual machine exactly as the
+ * interpreters do: the stack, frames, and variables live in memory[] in
+ * the byte order of data memory, and sp, bp, and sb keep their meanings.  While
+ * compiled code runs, the registers are cached in machine registers:
+ *
+ *     rbx  address of memory[0]
+ *     r13  bp
+ *     r14  sp
+ *     r15  table of native addresses, indexed by code address
+ *
+ * CALL pushes the same dynamic link and return address as the interpreters
+ * and jumps to the compiled procedure; RET looks the return address up in
+ * the table of native addresses.  Instructions without a template (I/O,
+ * LOAD, STORE, LDCSTR, ...) call their decoded handler out of line, after
+ * storing sp and bp back into the global registers.
+ *
+ * On other platforms jitCompile() returns false, and the program is run by
+ * the interpreter.
+ */
+
+#if defined(__x86_64__) && (defined(__linux__) || defined(__APPLE__) || defined(__unix__))
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+// machine registers
+enum { RAX = 0, RCX = 1, RDX = 2, RBX = 3, RSP = 4, RBP = 5, RSI = 6, RDI = 7,
+       R8, R9, R10, R11, R12, R13, R14, R15 };
+
+// registers that hold the state of the virtual machine
+#define MEM RBX
+#define BP  R13
+#define SP  R14
+#define TBL R15
+
+// no index register in a memory operand
+#define NO_INDEX (-1)
+
+// condition codes for jcc
+enum { CC_E = 0x4, CC_NE = 0x5, CC_L = 0xC, CC_GE = 0xD, CC_LE = 0xE, CC_G = 0xF, CC_A = 0x7 };
+
+// upper bound on the size of the code for one CVM instruction
+#define MAX_TEMPLATE_SIZE 96
+
+// The compiler's state is thread-local so that different threads can
+// compile programs at the same time.  The finished code and table of
+// native addresses are moved into the current context.
+
+// the code being generated and where the next byte will be written
+THREAD_LOCAL uint8_t* jitCode     = NULL;
+THREAD_LOCAL size_t   jitCapacity = 0;
+THREAD_LOCAL size_t   jitSize     = 0;
+
+// native address for each code address (0..sb), used by RET
+THREAD_LOCAL void** nativeAddress = NULL;
+
+// offsets of the compiled code for each decoded instruction
+THREAD_LOCAL size_t* nativeOffset = NULL;
+
+// offsets of the common exits from compiled code
+THREAD_LOCAL size_t exitOffset;
+THREAD_LOCAL size_t divideByZeroOffset;
+THREAD_LOCAL size_t outOfMemoryOffset;
+THREAD_LOCAL size_t invalidReturnOffset;
+
+/**
+ * A 32-bit jump displacement to be filled in after all code is emitted.
+ */
+typedef struct
+  {
+    size_t offset;    // offset of the displacement in the code
+    size_t* target;   // offset of the target, once known
+  } Patch;
+
+THREAD_LOCAL Patch* patches    = NULL;
+THREAD_LOCAL int    numPatches = 0;
+
+// Start: x86-64 instruction encoding
+// ----------------------------------
+
+void emitByte(int b)
+  {
+    jitCode[jitSize++] = (uint8_t) b;
+  }
+
+void emitInt32(int32_t n)
+  {
+    memcpy(jitCode + jitSize, &n, 4);
+    jitSize = jitSize + 4;
+  }
+
+void emitInt64(int64_t n)
+  {
+    memcpy(jitCode + jitSize, &n, 8);
+    jitSize = jitSize + 8;
+  }
+
+/**
+ * Converts a 32-bit value between native (little-endian) byte order and
+ * the byte order of data memory, i.e., reverses its bytes unless
+ * NATIVE_DATA is set.
+ */
+int32_t swapBytes(int32_t n)
+  {
+    if (NATIVE_DATA)
+        return n;
+
+    uint32_t u = (uint32_t) n;
+    return (int32_t) ((u >> 24) | ((u >> 8) & 0x0000FF00) | ((u << 8) & 0x00FF0000) | (u << 24));
+  }
+
+/**
+ * Emits a REX prefix if one is needed.
+ */
+void emitRex(bool w, int reg, int index, int base)
+  {
+    int rex = 0x40 | (w ? 0x08 : 0) | ((reg & 8) ? 0x04 : 0)
+                   | ((index != NO_INDEX && (index & 8)) ? 0x02 : 0)
+                   | ((base & 8) ? 0x01 : 0);
+    if (rex != 0x40)
+        emitByte(rex);
+  }
+
+/**
+ * Emits the ModRM byte, SIB byte, and displacement for the memory operand
+ * [base + index + disp].
+ */
+void emitMemoryOperand(int reg, int base, int index, int32_t disp)
+  {
+    int mod;
+    if (disp == 0 && (base & 7) != RBP)
+        mod = 0;
+    else if (disp >= -128 && disp <= 127)
+        mod = 1;
+    else
+        mod = 2;
+
+    if (index != NO_INDEX || (base & 7) == RSP)
+      {
+        emitByte((mod << 6) | ((reg & 7) << 3) | RSP);
+        emitByte(((index != NO_INDEX ? index : RSP) & 7) << 3 | (base & 7));
+      }
+    else
+        emitByte((mod << 6) | ((reg & 7) << 3) | (base & 7));
+
+    if (mod == 1)
+        emitByte(disp);
+    else if (mod == 2)
+        emitInt32(disp);
+  }
+
+/**
+ * Emits an instruction with a memory operand, e.g., mov r32, [base + index + disp].
+ */
+void emitMemoryOp(bool w, int opcode, int reg, int base, int index, int32_t disp)
+  {
+    emitRex(w, reg, index, base);
+    if (opcode > 0xFF)
+        emitByte(opcode >> 8);   // two-byte opcode (0x0F xx)
+    emitByte(opcode & 0xFF);
+    emitMemoryOperand(reg, base, index, disp);
+  }
+
+/**
+ * Emits an instruction with two register operands (ModRM mode 3).
+ */
+void emitRegisterOp(bool w, int opcode, int reg, int rm)
+  {
+    emitRex(w, reg, NO_INDEX, rm);
+    if (opcode > 0xFF)
+        emitByte(opcode >> 8);
+    emitByte(opcode & 0xFF);
+    emitByte(0xC0 | ((reg & 7) << 3) | (rm & 7));
+  }
+
+// mov r32, [base + index + disp]
+void emitLoad32(int reg, int base, int index, int32_t disp)
+  {
+    emitMemoryOp(false, 0x8B, reg, base, index, disp);
+  }
+
+// mov [base + index + disp], r32
+void emitStore32(int reg, int base, int index, int32_t disp)
+  {
+    emitMemoryOp(false, 0x89, reg, base, index, disp);
+  }
+
+// mov dword [base + index + disp], imm32
+void emitStoreImm32(int base, int index, int32_t disp, int32_t imm)
+  {
+    emitMemoryOp(false, 0xC7, 0, base, index, disp);
+    emitInt32(imm);
+  }
+
+// movzx r32, byte [base + index + disp]
+void emitLoadByte(int reg, int base, int index, int32_t disp)
+  {
+    emitMemoryOp(false, 0x0FB6, reg, base, index, disp);
+  }
+
+// movsx r32, byte [base + index + disp]
+void emitLoadSignedByte(int reg, int base, int index, int32_t disp)
+  {
+    emitMemoryOp(false, 0x0FBE, reg, base, index, disp);
+  }
+
+// mov byte [base + index + disp], r8 (reg must be al, cl, or dl)
+void emitStoreByte(int reg, int base, int index, int32_t disp)
+  {
+    emitMemoryOp(false, 0x88, reg, base, index, disp);
+  }
+
+// mov byte [base + index + disp], imm8
+void emitStoreImm8(int base, int index, int32_t disp, int imm)
+  {
+    emitMemoryOp(false, 0xC6, 0, base, index, disp);
+    emitByte(imm);
+  }
+
+// lea r32/r64, [base + disp]
+void emitLea(bool w, int reg, int base, int32_t disp)
+  {
+    emitMemoryOp(w, 0x8D, reg, base, NO_INDEX, disp);
+  }
+
+// movsxd r64, r32
+void emitSignExtend(int reg)
+  {
+    emitRegisterOp(true, 0x63, reg, reg);
+  }
+
+// bswap r32, when data memory is big-endian
+void emitSwapBytes(int reg)
+  {
+    if (NATIVE_DATA)
+        return;
+
+    emitRex(false, 0, NO_INDEX, reg);
+    emitByte(0x0F);
+    emitByte(0xC8 + (reg & 7));
+  }
+
+// add/sub/cmp r64, imm32 (ext is the ModRM reg field: 0 = add, 5 = sub, 7 = cmp)
+void emitArithImm64(int ext, int reg, int32_t imm)
+  {
+    emitRex(true, 0, NO_INDEX, reg);
+    if (imm >= -128 && imm <= 127)
+      {
+        emitByte(0x83);
+        emitByte(0xC0 | (ext << 3) | (reg & 7));
+        emitByte(imm);
+      }
+    else
+      {
+        emitByte(0x81);
+        emitByte(0xC0 | (ext << 3) | (reg & 7));
+        emitInt32(imm);
+      }
+  }
+
+// mov r64, imm64
+void emitMoveImm64(int reg, int64_t imm)
+  {
+    emitRex(true, 0, NO_INDEX, reg);
+    emitByte(0xB8 + (reg & 7));
+    emitInt64(imm);
+  }
+
+// call the C function at the specified address
+void emitCall(void* function)
+  {
+    emitMoveImm64(RAX, (int64_t) (intptr_t) function);
+    emitByte(0xFF);
+    emitByte(0xD0);   // call rax
+  }
+
+/**
+ * Emits a jump (or conditional jump if cc >= 0) to a target whose offset is
+ * not known yet.
+ */
+void emitJump(int cc, size_t* target)
+  {
+    if (cc < 0)
+        emitByte(0xE9);
+    else
+      {
+        emitByte(0x0F);
+        emitByte(0x80 + cc);
+      }
+
+    patches[numPatches].offset = jitSize;
+    patches[numPatches].target = target;
+    ++numPatches;
+    emitInt32(0);
+  }
+
+// End: x86-64 instruction encoding
+// --------------------------------
+
+// Start: templates for CVM instructions
+// -------------------------------------
+
+// the int on top of the stack is at [memory + sp - 3], the one below it at [memory + sp - 7]
+#define TOP_INT    (-3)
+#define SECOND_INT (-7)
+
+/**
+ * Called by compiled code to run a decoded handler for an instruction
+ * without a template.  The registers are thread-local, so compiled code
+ * passes sp and bp rather than storing them itself.  Returns the new sp;
+ * none of these instructions changes bp.
+ */
+int jitCallHandler(const Instruction* inst, int stackPointer, int basePointer, Handler handler)
+  {
+    sp = stackPointer;
+    bp = basePointer;
+    handler(inst);
+    return sp;
+  }
+
+/**
+ * Called by compiled code when the program halts.
+ */
+void jitSaveRegisters(int stackPointer, int basePointer)
+  {
+    sp = stackPointer;
+    bp = basePointer;
+  }
+
+/**
+ * Pushes the int in register reg (native byte order).
+ */
+void emitPushInt(int reg)
+  {
+    emitSwapBytes(reg);
+    emitStore32(reg, MEM, SP, 1);
+    emitArithImm64(0, SP, 4);
+  }
+
+/**
+ * Loads an address from the stack into rax, sign-extended as in C.
+ */
+void emitLoadAddress(int32_t disp)
+  {
+    emitLoad32(RAX, MEM, SP, disp);
+    emitSwapBytes(RAX);
+    emitSignExtend(RAX);
+  }
+
+/**
+ * Replaces the two ints on top of the stack with the result of a binary
+ * operation.  The left operand is loaded into eax and the right into ecx;
+ * the template for the operation leaves its result in resultReg.
+ */
+void emitBinaryPrologue()
+  {
+    emitLoad32(RAX, MEM, SP, SECOND_INT);
+    emitSwapBytes(RAX);
+    emitLoad32(RCX, MEM, SP, TOP_INT);
+    emitSwapBytes(RCX);
+  }
+
+void emitBinaryEpilogue(int resultReg)
+  {
+    emitSwapBytes(resultReg);
+    emitStore32(resultReg, MEM, SP, SECOND_INT);
+    emitArithImm64(5, SP, 4);
+  }
+
+void emitBinary(int aluOpcode)
+  {
+    emitBinaryPrologue();
+    emitRegisterOp(false, aluOpcode, RCX, RAX);   // op eax, ecx
+    emitBinaryEpilogue(RAX);
+  }
+
+void emitDivide(int resultReg)
+  {
+    emitBinaryPrologue();
+    if (resultReg == RAX)
+      {
+        emitRegisterOp(false, 0x85, RCX, RCX);    // test ecx, ecx
+        emitJump(CC_E, &divideByZeroOffset);
+      }
+    emitByte(0x99);                               // cdq
+    emitRegisterOp(false, 0xF7, 7, RCX);          // idiv ecx
+    emitBinaryEpilogue(resultReg);
+  }
+
+void emitShift(int ext)
+  {
+    emitBinaryPrologue();
+    emitRegisterOp(false, 0xD3, ext, RAX);        // shl/sar eax, cl
+    emitBinaryEpilogue(RAX);
+  }
+
+/**
+ * Replaces the int on top of the stack with the result of a unary operation
+ * (F7 /ext) or, if ext < 0, adds delta to it.
+ */
+void emitUnary(int ext, int delta)
+  {
+    emitLoad32(RAX, MEM, SP, TOP_INT);
+    emitSwapBytes(RAX);
+    if (ext >= 0)
+        emitRegisterOp(false, 0xF7, ext, RAX);
+    else
+      {
+        emitByte(0x83);
+        emitByte(0xC0);                           // add eax, imm8
+        emitByte(delta);
+      }
+    emitSwapBytes(RAX);
+    emitStore32(RAX, MEM, SP, TOP_INT);
+  }
+
+void emitCompareAndBranch(int cc, const Instruction* inst)
+  {
+    emitBinaryPrologue();
+    emitArithImm64(5, SP, 8);
+    emitRegisterOp(false, 0x39, RCX, RAX);        // cmp eax, ecx
+    emitJump(cc, nativeOffset + (inst->target - decodedCode));
+  }
+
+void emitByteBranch(int cc, const Instruction* inst)
+  {
+    emitLoadByte(RAX, MEM, SP, 0);
+    emitArithImm64(5, SP, 1);
+    emitRegisterOp(false, 0x85, RAX, RAX);        // test eax, eax
+    emitJump(cc, nativeOffset + (inst->target - decodedCode));
+  }
+
+/**
+ * Checks for stack overflow after sp was increased; growth is the number
+ * of bytes that the procedure can still push (see verify.c).
+ */
+void emitMemoryCheck(int growth)
+  {
+    emitArithImm64(7, SP, numBytesMemory - growth);
+    emitJump(CC_GE, &outOfMemoryOffset);
+  }
+
+/**
+ * Returns from a procedure; paramLength bytes of parameters are removed.
+ */
+void emitReturn(int paramLength)
+  {
+    emitLoad32(RAX, MEM, BP, 4);                  // return address
+    emitSwapBytes(RAX);
+    emitLoad32(RCX, MEM, BP, 0);                  // dynamic link
+    emitSwapBytes(RCX);
+    emitLea(true, SP, BP, -paramLength - 1);
+    emitRegisterOp(true, 0x63, BP, RCX);          // movsxd r13, ecx
+
+    emitByte(0x3D);                               // cmp eax, sb
+    emitInt32(sb);
+    emitJump(CC_A, &invalidReturnOffset);         // (unsigned, so also < 0)
+
+    emitByte(0x41);                               // jmp [r15 + rax*8]
+    emitByte(0xFF);
+    emitByte(0x24);
+    emitByte(0xC7);
+  }
+
+/**
+ * Calls a decoded handler for an instruction that has no template.
+ */
+void emitCallHandler(const Instruction* inst, Handler handler)
+  {
+    emitMoveImm64(RDI, (int64_t) (intptr_t) inst);
+    emitRegisterOp(false, 0x89, SP, RSI);         // mov esi, r14d
+    emitRegisterOp(false, 0x89, BP, RDX);         // mov edx, r13d
+    emitMoveImm64(RCX, (int64_t) (intptr_t) handler);
+    emitCall((void*) jitCallHandler);
+    emitRegisterOp(true, 0x63, SP, RAX);          // movsxd r14, eax
+  }
+
+/**
+ * Emits the machine code for one decoded instruction.
+ */
+void emitInstruction(const Instruction* inst)
+  {
+    int opcode = (uint8_t) memory[inst->address];
+
+    switch (opcode)
+      {
+        case LDCINT:
+        case LDCINT0:
+        case LDCINT1:
+          {
+            int value = opcode == LDCINT ? inst->operand : (opcode == LDCINT1 ? 1 : 0);
+            emitStoreImm32(MEM, SP, 1, swapBytes(value));
+            emitArithImm64(0, SP, 4);
+            break;
+          }
+
+        case LDCB:
+        case LDCB0:
+        case LDCB1:
+          {
+            int value = opcode == LDCB ? inst->operand : (opcode == LDCB1 ? 1 : 0);
+            emitStoreImm8(MEM, SP, 1, value);
+            emitArithImm64(0, SP, 1);
+            break;
+          }
+
+        case LDLADDR:
+            emitLea(false, RAX, BP, inst->operand);
+            emitPushInt(RAX);
+            break;
+
+        case LDGADDR:
+            emitStoreImm32(MEM, SP, 1, swapBytes(sb + inst->operand));
+            emitArithImm64(0, SP, 4);
+            break;
+
+        case LOADW:
+            // the word is copied without changing its byte order
+            emitLoadAddress(TOP_INT);
+            emitLoad32(RCX, MEM, RAX, 0);
+            emitStore32(RCX, MEM, SP, TOP_INT);
+            break;
+
+        case LOADB:
+            emitLoadAddress(TOP_INT);
+            emitLoadByte(RCX, MEM, RAX, 0);
+            emitArithImm64(5, SP, 3);
+            emitStoreByte(RCX, MEM, SP, 0);
+            break;
+
+        case STOREW:
+            emitLoad32(RCX, MEM, SP, TOP_INT);
+            emitLoadAddress(SECOND_INT);
+            emitStore32(RCX, MEM, RAX, 0);
+            emitArithImm64(5, SP, 8);
+            break;
+
+        case STOREB:
+            emitLoadByte(RCX, MEM, SP, 0);
+            emitLoadAddress(-4);
+            emitStoreByte(RCX, MEM, RAX, 0);
+            emitArithImm64(5, SP, 5);
+            break;
+
+        case ADD:    emitBinary(0x01);                      break;
+        case SUB:    emitBinary(0x29);                      break;
+        case BITAND: emitBinary(0x21);                      break;
+        case BITOR:  emitBinary(0x09);                      break;
+        case BITXOR: emitBinary(0x31);                      break;
+        case MUL:
+            emitBinaryPrologue();
+            emitRegisterOp(false, 0x0FAF, RAX, RCX);  // imul eax, ecx
+            emitBinaryEpilogue(RAX);
+            break;
+        case DIV:    emitDivide(RAX);                       break;
+        case MOD:    emitDivide(RDX);                       break;
+        case SHL:    emitShift(4);                          break;
+        case SHR:    emitShift(7);                          break;
+        case NEG:    emitUnary(3, 0);                       break;
+        case BITNOT: emitUnary(2, 0);                       break;
+        case INC:    emitUnary(-1, 1);                      break;
+        case DEC:    emitUnary(-1, -1);                     break;
+
+        case NOT:
+            emitLoadByte(RAX, MEM, SP, 0);
+            emitRegisterOp(false, 0x85, RAX, RAX);    // test eax, eax
+            emitByte(0x0F);
+            emitByte(0x94);
+            emitByte(0xC0);                           // sete al
+            emitStoreByte(RAX, MEM, SP, 0);
+            break;
+
+        case INT2BYTE:
+            emitLoadByte(RAX, MEM, SP, NATIVE_DATA ? TOP_INT : 0);   // low-order byte
+            emitArithImm64(5, SP, 3);
+            emitStoreByte(RAX, MEM, SP, 0);
+            break;
+
+        case BYTE2INT:
+            emitLoadSignedByte(RAX, MEM, SP, 0);
+            emitSwapBytes(RAX);
+            emitStore32(RAX, MEM, SP, 0);
+            emitArithImm64(0, SP, 3);
+            break;
+
+        case BR:
+            emitJump(-1, nativeOffset + (inst->target - decodedCode));
+            break;
+
+        case BE:     emitCompareAndBranch(CC_E,  inst);     break;
+        case BNE:    emitCompareAndBranch(CC_NE, inst);     break;
+        case BG:     emitCompareAndBranch(CC_G,  inst);     break;
+        case BGE:    emitCompareAndBranch(CC_GE, inst);     break;
+        case BL:     emitCompareAndBranch(CC_L,  inst);     break;
+        case BLE:    emitCompareAndBranch(CC_LE, inst);     break;
+        case BZ:     emitByteBranch(CC_E,  inst);           break;
+        case BNZ:    emitByteBranch(CC_NE, inst);           break;
+
+        case CALL:
+            emitSwapBytes(BP);                        // push dynamic link
+            emitStore32(BP, MEM, SP, 1);
+            emitStoreImm32(MEM, SP, 5, swapBytes(inst[1].address));   // push return address
+            emitLea(true, BP, SP, 1);                 // bp = sp - 8 + 1 after the pushes
+            emitArithImm64(0, SP, 8);
+            emitJump(-1, nativeOffset + (inst->target - decodedCode));
+            break;
+
+        case RET:    emitReturn(inst->operand);             break;
+        case RET0:   emitReturn(0);                         break;
+        case RET4:   emitReturn(4);                         break;
+
+        case PROC:
+        case ALLOC:
+            emitArithImm64(0, SP, inst->operand);
+            emitMemoryCheck(inst->operand2);
+            break;
+
+        case PROGRAM:
+            emitByte(0x49);
+            emitByte(0xC7);
+            emitByte(0xC5);                           // mov r13, imm32
+            emitInt32(sb);
+            emitLea(true, SP, BP, inst->operand - 1);
+            emitMemoryCheck(inst->operand2);
+            break;
+
+        case HALT:
+            emitJump(-1, &exitOffset);
+            break;
+
+        case LDCSTR:
+            // LDCSTR n; PUTSTR n writes the literal and skips the PUTSTR,
+            // whose code is still there for branches to it
+            if (isPutLiteral(inst))
+              {
+                emitCallHandler(inst, fusedPutLiteral);
+                emitJump(-1, nativeOffset + (inst + 2 - decodedCode));
+              }
+            else
+                emitCallHandler(inst, inst->handler);
+            break;
+
+        default:
+            emitCallHandler(inst, inst->handler);
+      }
+  }
+
+// End: templates for CVM instructions
+// -----------------------------------
+
+/**
+ * Emits the code shared by all compiled procedures: the entry sequence
+ * that sets up the registers, and the exits for halting and for errors.
+ * The entry is called as void entry(byte* memory, int sp, int bp, void* start)
+ * and jumps to start, the native address of the instruction at pc.
+ */
+void emitEntry()
+  {
+    emitByte(0x53);                               // push rbx
+    emitByte(0x41); emitByte(0x54);               // push r12
+    emitByte(0x41); emitByte(0x55);               // push r13
+    emitByte(0x41); emitByte(0x56);               // push r14
+    emitByte(0x41); emitByte(0x57);               // push r15  (stack is now 16-byte aligned)
+
+    emitRegisterOp(true, 0x89, RDI, MEM);         // mov rbx, rdi
+    emitRegisterOp(true, 0x63, SP, RSI);          // movsxd r14, esi
+    emitRegisterOp(true, 0x63, BP, RDX);          // movsxd r13, edx
+    emitMoveImm64(TBL, (int64_t) (intptr_t) nativeAddress);
+    emitByte(0xFF); emitByte(0xE1);               // jmp rcx (where the run starts)
+  }
+
+void emitExits()
+  {
+    exitOffset = jitSize;
+    emitRegisterOp(false, 0x89, SP, RDI);         // mov edi, r14d
+    emitRegisterOp(false, 0x89, BP, RSI);         // mov esi, r13d
+    emitCall((void*) jitSaveRegisters);
+    emitByte(0x41); emitByte(0x5F);               // pop r15
+    emitByte(0x41); emitByte(0x5E);               // pop r14
+    emitByte(0x41); emitByte(0x5D);               // pop r13
+    emitByte(0x41); emitByte(0x5C);               // pop r12
+    emitByte(0x5B);                               // pop rbx
+    emitByte(0xC3);                               // ret
+
+    divideByZeroOffset = jitSize;
+    emitMoveImm64(RDI, (int64_t) (intptr_t) L"*** FAULT: Divide by zero ***");
+    emitCall((void*) error);
+
+    outOfMemoryOffset = jitSize;
+    emitMoveImm64(RDI, (int64_t) (intptr_t) L"*** Out of memory ***");
+    emitCall((void*) error);
+
+    invalidReturnOffset = jitSize;
+    emitMoveImm64(RDI, (int64_t) (intptr_t) L"*** FAULT: Invalid return address ***");
+    emitCall((void*) error);
+  }
+
+/**
+ * Frees the compiler's working storage and, unless the compiled code was
+ * moved into the context, the code itself.
+ */
+void freeCompilerState()
+  {
+    if (jitCode != NULL)
+        munmap(jitCode, jitCapacity);
+    free(nativeAddress);
+    free(nativeOffset);
+    free(patches);
+    jitCode       = NULL;
+    nativeAddress = NULL;
+    nativeOffset  = NULL;
+    patches       = NULL;
+  }
+
+void jitFree()
+  {
+    CvmContext* context = currentContext;
+
+    if (context->jitCode != NULL)
+        munmap(context->jitCode, context->jitCapacity);
+    free(context->nativeAddress);
+    context->jitCode       = NULL;
+    context->jitCapacity   = 0;
+    context->nativeAddress = NULL;
+  }
+
+bool jitCompile()
+  {
+    int numInstructions = numDecodedInstructions;
+
+    // the compiler handles only unfused instructions
+    for (int i = 0; i < numInstructions; ++i)
+      {
+        if (decodedCode[i].length != 1)
+            return false;
+      }
+
+    size_t pageSize = (size_t) sysconf(_SC_PAGESIZE);
+    jitCapacity = ((size_t) (numInstructions + 1)*MAX_TEMPLATE_SIZE + 4096 + pageSize - 1)
+                      /pageSize*pageSize;
+    jitCode = mmap(NULL, jitCapacity, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (jitCode == MAP_FAILED)
+      {
+        jitCode = NULL;
+        return false;
+      }
+
+    nativeAddress = (void**) malloc(sizeof(void*)*(sb + 1));
+    nativeOffset  = (size_t*) malloc(sizeof(size_t)*(numInstructions + 1));
+    patches       = (Patch*) malloc(sizeof(Patch)*(4*numInstructions + 4));
+    if (nativeAddress == NULL || nativeOffset == NULL || patches == NULL)
+      {
+        freeCompilerState();
+        return false;
+      }
+
+    jitSize    = 0;
+    numPatches = 0;
+    emitEntry();
+
+    for (int i = 0; i < numInstructions; ++i)
+      {
+        nativeOffset[i] = jitSize;
+        emitInstruction(decodedCode + i);
+      }
+
+    // running off the end of the code segment is handled by the end marker
+    nativeOffset[numInstructions] = jitSize;
+    emitCallHandler(decodedCode + numInstructions, decodedCode[numInstructions].handler);
+
+    emitExits();
+
+    // resolve jumps
+    for (int i = 0; i < numPatches; ++i)
+      {
+        int32_t displacement = (int32_t) (*patches[i].target - (patches[i].offset + 4));
+        memcpy(jitCode + patches[i].offset, &displacement, 4);
+      }
+
+    // code addresses that are not the start of an instruction are invalid return addresses
+    for (int address = 0; address <= sb; ++address)
+        nativeAddress[address] = jitCode + invalidReturnOffset;
+    for (int i = 0; i <= numInstructions; ++i)
+        nativeAddress[decodedCode[i].address] = jitCode + nativeOffset[i];
+
+    if (mprotect(jitCode, jitCapacity, PROT_READ | PROT_EXEC) != 0)
+      {
+        freeCompilerState();
+        return false;
+      }
+
+    CvmContext* context = currentContext;
+    context->jitCode       = jitCode;
+    context->jitCapacity   = jitCapacity;
+    context->nativeAddress = nativeAddress;
+    jitCode       = NULL;
+    nativeAddress = NULL;
+    freeCompilerState();
+
+    return true;
+  }
+
+void runJit()
+  {
+    void (*entry)(byte*, int, int, void*) = (void (*)(byte*, int, int, void*)) currentContext->jitCode;
+
+    running = true;
+    entry(memory, sp, bp, currentContext->nativeAddress[pc]);
+    running = false;
+  }
+
+#else
+
+bool jitCompile()
+  {
+    return false;
+  }
+
+void runJit()
+  {
+  }
+
+void jitFree()
+  {
+  }
+
+#endif
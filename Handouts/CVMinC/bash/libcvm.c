@@ -0,0 +1,3752 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <wchar.h>
+#include <stdbool.h>
+#include "opcode.h"
+#include "vm.h"
+
+
+/**
+ * This C library implements a virtual machine for the programming language
+ * CPRL.  It interprets instructions for a hypothetical CPRL computer.  See
+ * cvm.h for the interface; cvm.c is the command-line client.
+ */
+
+// declare prototypes
+void convertOperands();
+void translateProgram();
+bool predecodeProgram(bool fuse);
+void freeDecodedProgram();
+void fuseSuperinstructions(int numInstructions);
+bool cacheProgram();
+void run();
+void runDecoded();
+void runCached();
+void runProfiled();
+void runTraced();
+void error(wchar_t* message);
+void readString(int destAddr, int capacity);
+void writeString(int capacity);
+
+const bool  DEBUG  = false;
+
+const int BYTES_PER_INTEGER = 4;
+const int BYTES_PER_CHAR    = 2;
+const int BYTES_PER_CONTEXT = 8;    // 2 saved addresses: PC and BP
+
+// The dispatch engine used by run() is selected at build time.  Compilers
+// that support the GNU "labels as values" extension (gcc and clang) get a
+// direct-threaded engine; all others get the portable switch statement.
+// Compile with -DCVM_NO_THREADED to force the switch engine.
+#if defined(__GNUC__) && !defined(CVM_NO_THREADED)
+#define THREADED_DISPATCH 1
+#else
+#define THREADED_DISPATCH 0
+#endif
+
+// virtual machine constant for false
+const byte FALSE = (byte) 0;
+
+// virtual machine constant for true
+const byte TRUE = (byte) 1;
+
+// the context being loaded or run by this thread
+THREAD_LOCAL CvmContext* currentContext = NULL;
+
+// computer memory (for the virtual CPRL machine)
+THREAD_LOCAL byte* memory = NULL;
+
+// number of bytes of memory in the current context
+THREAD_LOCAL int numBytesMemory = 0;
+
+// program counter (index of the next instruction in memory)
+THREAD_LOCAL int pc = 0;
+
+// base pointer
+THREAD_LOCAL int bp = 0;
+
+// stack pointer (index of the top of the stack)
+THREAD_LOCAL int sp = 0;
+
+// bottom of the stack
+THREAD_LOCAL int sb = 0;
+
+// true if the virtual computer is currently running
+THREAD_LOCAL bool running = false;
+
+// Start: helper functions and internal machine instructions that do NOT correspond to opcodes
+// -------------------------------------------------------------------------------------------
+
+/**
+ * Records the error message in the current context and returns from
+ * cvm_run() or cvm_load_from_buffer() with status CVM_ERROR.
+ */
+void error(wchar_t* message)
+  {
+    currentContext->errorMessage = message;
+    longjmp(currentContext->errorExit, 1);
+  }
+
+/**
+ * Converts 2 bytes to a wide char.  The bytes passed as arguments are
+ * ordered with b0 as the high order byte and b1 as the low order byte.
+ */
+wchar_t bytesToChar(byte b0, byte b1)
+  {
+    return (wchar_t) ((((int) b0 << 8) & 0x0000FF00) | ((int) b1 & 0x000000FF));
+  }
+
+/**
+ * Converts 4 bytes to an int.  The bytes passed as arguments are
+ * ordered with b0 as the high order byte and b3 as the low order byte.
+ */
+int bytesToInt(byte b0, byte b1, byte b2, byte b3)
+  {
+    return (int) b0 << 24 & 0xFF000000
+         | (int) b1 << 16 & 0x00FF0000
+         | (int) b2 << 8  & 0x0000FF00
+         | (int) b3       & 0x000000FF;
+  }
+
+/**
+ * Converts a wide char to an array of 2 bytes.  The elements in array
+ * bytes are ordered with the byte at index 0 as the high order byte
+ * and the byte at index 1 as the low order byte.
+ */
+void charToBytes(wchar_t c, byte* bytes)
+  {
+    bytes[0] = (byte) ((c >> 8) & 0x00FF);
+    bytes[1] = (byte) ((c >> 0) & 0x00FF);
+  }
+
+/**
+ * Converts an int to an array of 4 bytes.  The elements in array
+ * bytes are ordered with the byte at index 0 as the high order byte
+ * and the byte at index 3 as the low order byte.
+ */
+void intToBytes(int n, byte* bytes)
+  {
+    bytes[0] = (byte) ((n >> 24) & 0x000000FF);
+    bytes[1] = (byte) ((n >> 16) & 0x000000FF);
+    bytes[2] = (byte) ((n >> 8)  & 0x000000FF);
+    bytes[3] = (byte) ((n >> 0)  & 0x000000FF);
+  }
+
+/**
+ * Pop the top byte off the stack and return its value.
+ */
+byte popByte()
+  {
+    return memory[sp--];
+  }
+
+/**
+ * Pop the top (wide) character off the stack and return its value.
+ */
+wchar_t popChar()
+  {
+#if NATIVE_DATA
+    uint16_t c;
+    sp = sp - BYTES_PER_CHAR;
+    memcpy(&c, memory + sp + 1, sizeof(c));
+    return (wchar_t) c;
+#else
+    byte b1 = popByte();
+    byte b0 = popByte();
+    return bytesToChar(b0, b1);
+#endif
+  }
+
+/**
+ * Pop the top integer off the stack and return its value.
+ */
+int popInt()
+  {
+#if NATIVE_DATA
+    int n;
+    sp = sp - BYTES_PER_INTEGER;
+    memcpy(&n, memory + sp + 1, sizeof(n));
+    return n;
+#else
+    byte b3 = popByte();
+    byte b2 = popByte();
+    byte b1 = popByte();
+    byte b0 = popByte();
+    return bytesToInt(b0, b1, b2, b3);
+#endif
+  }
+
+/**
+ * Push a byte onto the stack.
+ */
+void pushByte(byte b)
+  {
+    memory[++sp] = b;
+  }
+
+/**
+ * Push a (wide) character onto the stack.
+ */
+void pushChar(wchar_t c)
+  {
+#if NATIVE_DATA
+    uint16_t value = (uint16_t) c;
+    memcpy(memory + sp + 1, &value, sizeof(value));
+    sp = sp + BYTES_PER_CHAR;
+#else
+    byte bytes[2];
+    charToBytes(c, bytes);
+    pushByte(bytes[0]);
+    pushByte(bytes[1]);
+#endif
+  }
+
+/**
+ * Push an integer onto the stack.
+ */
+void pushInt(int n)
+  {
+#if NATIVE_DATA
+    memcpy(memory + sp + 1, &n, sizeof(n));
+    sp = sp + BYTES_PER_INTEGER;
+#else
+    byte bytes[4];
+    intToBytes(n, bytes);
+    pushByte(bytes[0]);
+    pushByte(bytes[1]);
+    pushByte(bytes[2]);
+    pushByte(bytes[3]);
+#endif
+  }
+
+/**
+ * Fetch the next instruction/byte from memory.
+ */
+byte fetchByte()
+  {
+    return memory[pc++];
+  }
+
+/**
+ * Returns the char operand at the specified code address.  Operands are
+ * in host byte order after convertOperands().
+ */
+wchar_t getCharOperandAtAddr(int address)
+  {
+    uint16_t operand;
+    memcpy(&operand, memory + address, sizeof(operand));
+    return (wchar_t) operand;
+  }
+
+/**
+ * Returns the int operand at the specified code address.  Operands are
+ * in host byte order after convertOperands().
+ */
+int getIntOperandAtAddr(int address)
+  {
+    int operand;
+    memcpy(&operand, memory + address, sizeof(operand));
+    return operand;
+  }
+
+/**
+ * Fetch the next instruction wide char operand from memory.
+ */
+wchar_t fetchChar()
+  {
+    wchar_t operand = getCharOperandAtAddr(pc);
+    pc = pc + BYTES_PER_CHAR;
+    return operand;
+  }
+
+/**
+ * Fetch the next instruction int operand from memory.
+ */
+int fetchInt()
+  {
+    int operand = getIntOperandAtAddr(pc);
+    pc = pc + BYTES_PER_INTEGER;
+    return operand;
+  }
+
+/**
+ * Returns the (wide) character at the specified memory address.
+ * Does not alter pc, sp, or bp.
+ */
+wchar_t getCharAtAddr(int address)
+  {
+#if NATIVE_DATA
+    uint16_t c;
+    memcpy(&c, memory + address, sizeof(c));
+    return (wchar_t) c;
+#else
+    byte b0 = memory[address + 0];
+    byte b1 = memory[address + 1];
+    return bytesToChar(b0, b1);
+#endif
+  }
+
+/**
+ * Returns the integer at the specified memory address.
+ * Does not alter pc, sp, or bp.
+ */
+int getIntAtAddr(int address)
+  {
+#if NATIVE_DATA
+    int n;
+    memcpy(&n, memory + address, sizeof(n));
+    return n;
+#else
+    byte b0 = memory[address + 0];
+    byte b1 = memory[address + 1];
+    byte b2 = memory[address + 2];
+    byte b3 = memory[address + 3];
+    return bytesToInt(b0, b1, b2, b3);
+#endif
+  }
+
+/**
+ * Returns the word at the specified memory address.
+ * Does not alter pc, sp, or bp.
+ */
+int getWordAtAddr(int address)
+  {
+    return getIntAtAddr(address);
+  }
+
+/**
+ * Writes the wide char value to the specified memory address.
+ * Does not alter pc, sp, or bp.
+ */
+void putCharToAddr(wchar_t value, int address)
+  {
+#if NATIVE_DATA
+    uint16_t c = (uint16_t) value;
+    memcpy(memory + address, &c, sizeof(c));
+#else
+    byte bytes[2];
+    charToBytes(value, bytes);
+    memory[address + 0] = bytes[0];
+    memory[address + 1] = bytes[1];
+#endif
+  }
+
+/**
+ * Writes the integer value to the specified memory address.
+ * Does not alter pc, sp, or bp.
+ */
+void putIntToAddr(int value, int address)
+  {
+#if NATIVE_DATA
+    memcpy(memory + address, &value, sizeof(value));
+#else
+    byte bytes[4];
+    intToBytes(value, bytes);
+    memory[address + 0] = bytes[0];
+    memory[address + 1] = bytes[1];
+    memory[address + 2] = bytes[2];
+    memory[address + 3] = bytes[3];
+#endif
+  }
+
+/**
+ * Writes the word value to the specified memory address.
+ * Does not alter pc, sp, or bp.
+ */
+void putWordToAddr(int value, int address)
+  {
+    putIntToAddr(value, address);
+  }
+
+/**
+ * Returns the integer at the address in data, like getIntAtAddr(), for an
+ * engine that keeps memory in a local variable.
+ */
+static inline int intAt(const byte* data, int address)
+  {
+#if NATIVE_DATA
+    int n;
+    memcpy(&n, data + address, sizeof(n));
+    return n;
+#else
+    return bytesToInt(data[address], data[address + 1], data[address + 2], data[address + 3]);
+#endif
+  }
+
+/**
+ * Writes the integer value to the address in data, like putIntToAddr().
+ */
+static inline void putIntAt(byte* data, int address, int value)
+  {
+#if NATIVE_DATA
+    memcpy(data + address, &value, sizeof(value));
+#else
+    data[address + 0] = (byte) (value >> 24);
+    data[address + 1] = (byte) (value >> 16);
+    data[address + 2] = (byte) (value >> 8);
+    data[address + 3] = (byte) value;
+#endif
+  }
+
+/**
+ * Rewrites the int and char operands in the code segment from the
+ * big-endian object file format into host byte order, so that fetchInt()
+ * and fetchChar() are single (possibly unaligned) loads.  The characters
+ * of an LDCSTR string are data that is pushed onto the stack as is, so
+ * they are converted to the byte order of data memory (see NATIVE_DATA).
+ * Conversion stops at the first invalid opcode, since the length of the
+ * instruction is unknown.
+ */
+void convertOperands()
+  {
+    int address = 0;
+    while (address < sb)
+      {
+        int opcode = memory[address];
+        int length;
+
+        if (isZeroOperandOpcode(opcode))
+            length = 1;
+        else if (isByteOperandOpcode(opcode))
+            length = 2;
+        else if ((isIntOperandOpcode(opcode) || opcode == LDCSTR)
+                    && address + BYTES_PER_INTEGER < sb)
+          {
+            byte* bytes = memory + address + 1;
+            int operand = bytesToInt(bytes[0], bytes[1], bytes[2], bytes[3]);
+            memcpy(bytes, &operand, sizeof(operand));
+            length = 1 + BYTES_PER_INTEGER;
+
+            if (opcode == LDCSTR)
+              {
+                if (operand < 0 || address + length + operand*BYTES_PER_CHAR > sb)
+                    break;
+#if NATIVE_DATA
+                for (int i = 0; i < operand; ++i)
+                  {
+                    bytes = memory + address + length + i*BYTES_PER_CHAR;
+                    uint16_t c = (uint16_t) bytesToChar(bytes[0], bytes[1]);
+                    memcpy(bytes, &c, sizeof(c));
+                  }
+#endif
+                length = length + operand*BYTES_PER_CHAR;
+              }
+          }
+        else if (opcode == LDCCH && address + BYTES_PER_CHAR < sb)
+          {
+            byte* bytes = memory + address + 1;
+            uint16_t operand = (uint16_t) bytesToChar(bytes[0], bytes[1]);
+            memcpy(bytes, &operand, sizeof(operand));
+            length = 1 + BYTES_PER_CHAR;
+          }
+        else
+            break;
+
+        address = address + length;
+      }
+  }
+
+/**
+ * Reports a stack overflow unless the frame of the procedure whose PROC
+ * or PROGRAM instruction is at the specified address fits in memory.  For
+ * a verified program, this includes everything that the procedure pushes.
+ */
+void checkFrame(int address)
+  {
+    CvmContext* context = currentContext;
+    int growth = context->verified ? context->stackGrowth[address] : 0;
+
+    if (sp + growth >= numBytesMemory)
+        error(L"*** Out of memory ***");
+  }
+
+/**
+ * Reports an error unless the length bytes at the specified address lie
+ * within memory.  Block copies check their whole range once, since a
+ * copy that starts in memory could otherwise skip over the guard page.
+ */
+void checkBlock(int address, int length)
+  {
+    if (address < 0 || address > numBytesMemory - length)
+        error(L"*** FAULT: Invalid memory address ***");
+  }
+
+/**
+ * Pushes a copy of the length bytes at the specified memory address onto
+ * the stack, as one block.
+ */
+void pushBlock(int address, int length)
+  {
+    if (length <= 0)
+        return;
+
+    checkBlock(address, length);
+    if (length >= numBytesMemory - sp)
+        error(L"*** Out of memory ***");
+
+    memmove(memory + sp + 1, memory + address, length);
+    sp = sp + length;
+  }
+
+/**
+ * Pops length bytes off the stack and stores them, as one block, at the
+ * specified memory address.
+ */
+void popBlock(int address, int length)
+  {
+    if (length <= 0)
+        return;
+
+    checkBlock(address, length);
+    sp = sp - length;
+    memmove(memory + address, memory + sp + 1, length);
+  }
+
+/**
+ * Executes LDCSTR n; PUTSTR n for the n chars at the code address without
+ * copying the string through the stack.  Writes text (an int length and
+ * UTF-8 bytes, see encodeLiterals()) if the string was encoded in advance,
+ * otherwise the chars.  PUTSTR only pops n bytes (see writeString()), so
+ * the stack is left with the int and the first n bytes of the chars, as
+ * the pair leaves it.
+ */
+void putLiteral(int address, int capacity, const char* text)
+  {
+    if (BYTES_PER_INTEGER + capacity*BYTES_PER_CHAR >= numBytesMemory - sp)
+        error(L"*** Out of memory ***");
+
+    pushInt(capacity);
+    pushBlock(address, capacity);
+
+    if (text != NULL)
+      {
+        int length;
+        memcpy(&length, text, sizeof(length));
+        outputBytes(text + sizeof(length), length);
+      }
+    else
+        outputString(address, capacity);
+  }
+
+// -----------------------------------------------------------------------------------------
+// End: helper functions and internal machine instructions that do NOT correspond to opcodes
+// Start: machine instructions corresponding to opcodes
+// -----------------------------------------------------------------------------------------
+
+void add()
+  {
+    int operand2 = popInt();
+    int operand1 = popInt();
+    pushInt(operand1 + operand2);
+  }
+
+void allocate()
+  {
+    int numBytes = fetchInt();
+    sp = sp + numBytes;
+    if (sp >= numBytesMemory)
+        error(L"*** Out of memory ***");
+  }
+
+void bitAnd()
+  {
+    int operand2 = popInt();
+    int operand1 = popInt();
+    pushInt(operand1 & operand2);
+  }
+
+void bitOr()
+  {
+    int operand2 = popInt();
+    int operand1 = popInt();
+    pushInt(operand1 | operand2);
+  }
+
+void bitXor()
+  {
+    int operand2 = popInt();
+    int operand1 = popInt();
+    pushInt(operand1 ^ operand2);
+  }
+
+ void bitNot()
+  {
+    int operand = popInt();
+    pushInt(~operand);
+  }
+
+void branch()
+  {
+    int displacement = fetchInt();
+    pc = pc + displacement;
+  }
+
+void branchEqual()
+  {
+    int displacement = fetchInt();
+    int operand2 = popInt();
+    int operand1 = popInt();
+
+    if (operand1 == operand2)
+        pc = pc + displacement;
+  }
+
+void branchNotEqual()
+  {
+    int displacement = fetchInt();
+    int operand2 = popInt();
+    int operand1 = popInt();
+
+    if (operand1 != operand2)
+        pc = pc + displacement;
+  }
+
+void branchGreater()
+  {
+    int displacement = fetchInt();
+    int operand2 = popInt();
+    int operand1 = popInt();
+
+    if (operand1 > operand2)
+        pc = pc + displacement;
+  }
+
+void branchGreaterOrEqual()
+  {
+    int displacement = fetchInt();
+    int operand2 = popInt();
+    int operand1 = popInt();
+
+    if (operand1 >= operand2)
+        pc = pc + displacement;
+  }
+
+void branchLess()
+  {
+    int displacement = fetchInt();
+    int operand2 = popInt();
+    int operand1 = popInt();
+
+    if (operand1 < operand2)
+        pc = pc + displacement;
+  }
+
+void branchLessOrEqual()
+  {
+    int displacement = fetchInt();
+    int operand2 = popInt();
+    int operand1 = popInt();
+
+    if (operand1 <= operand2)
+        pc = pc + displacement;
+  }
+
+void branchZero()
+  {
+    int  displacement = fetchInt();
+    byte value = popByte();
+
+    if (value == 0)
+        pc = pc + displacement;
+  }
+
+void branchNonZero()
+  {
+    int  displacement = fetchInt();
+    byte value = popByte();
+
+    if (value != 0)
+        pc = pc + displacement;
+  }
+
+void byteToInteger()
+  {
+    byte b = popByte();
+    pushInt((int) b);
+  }
+
+void call()
+  {
+    int displacement = fetchInt();
+
+    pushInt(bp);   // dynamic link
+    pushInt(pc);   // return address
+
+    // set bp to starting address of new frame
+    bp = sp - BYTES_PER_CONTEXT + 1;
+
+    // set pc to first statement of called procedure
+    pc = pc + displacement;
+  }
+
+void decrement()
+  {
+    int operand = popInt();
+    pushInt(operand - 1);
+  }
+
+void divide()
+  {
+    int operand2 = popInt();
+    int operand1 = popInt();
+
+    if (operand2 != 0)
+        pushInt(operand1/operand2);
+    else
+        error(L"*** FAULT: Divide by zero ***");
+  }
+
+void getCh()
+  {
+    int destAddr = popInt();
+    wint_t ch = inputChar();
+
+    if (ch == WEOF)
+        error(L"Invalid input: EOF");
+
+    putCharToAddr((wchar_t) ch, destAddr);
+  }
+
+void getInt()
+  {
+    int n = 0;   // stored if the input is not an int
+    int destAddr = popInt();
+
+    int result = inputInt(&n);
+    if (result != EOF)
+        putIntToAddr(n, destAddr);
+    else
+        error(L"Invalid input");
+  }
+
+void getString()
+  {
+    int destAddr = popInt();
+    int capacity = fetchInt();
+    readString(destAddr, capacity);
+  }
+
+/**
+ * Reads a line from standard input and stores it as a string with the
+ * specified capacity at the specified memory address.
+ */
+void readString(int destAddr, int capacity)
+  {
+    int length = inputLine(destAddr + BYTES_PER_INTEGER, capacity);
+    putIntToAddr(length, destAddr);
+  }
+
+void halt()
+  {
+    running = false;
+  }
+
+void increment()
+  {
+    int operand = popInt();
+    pushInt(operand + 1);
+  }
+
+void intToByte()
+  {
+    int n = popInt();
+    pushByte((byte) n);
+  }
+
+void load()
+  {
+    int length  = fetchInt();
+    int address = popInt();
+    pushBlock(address, length);
+  }
+
+void loadConstByte()
+  {
+    byte b = fetchByte();
+    pushByte(b);
+  }
+
+void loadConstByteZero()
+  {
+    pushByte((byte) 0);
+  }
+
+void loadConstByteOne()
+  {
+    pushByte((byte) 1);
+  }
+
+void loadConstCh()
+  {
+    char ch = fetchChar();
+    pushChar(ch);
+  }
+
+void loadConstInt()
+  {
+    int value = fetchInt();
+    pushInt(value);
+  }
+
+void loadConstIntZero()
+  {
+    pushInt(0);
+  }
+
+void loadConstIntOne()
+  {
+    pushInt(1);
+  }
+
+/**
+ * Pushes the string operand of LDCSTR, whose capacity has been fetched.
+ */
+void pushConstStr(int capacity)
+  {
+    pushInt(capacity);
+
+    // the characters are kept in stack byte order (see convertOperands())
+    pushBlock(pc, capacity*BYTES_PER_CHAR);
+    pc = pc + capacity*BYTES_PER_CHAR;
+  }
+
+void loadConstStr()
+  {
+    int capacity = fetchInt();
+
+    // LDCSTR n; PUTSTR n writes the string straight from the code segment
+    int next = pc + capacity*BYTES_PER_CHAR;
+    if (next + BYTES_PER_INTEGER < sb && memory[next] == PUTSTR
+          && getIntOperandAtAddr(next + 1) == capacity)
+      {
+        putLiteral(pc, capacity, NULL);
+        pc = next + 1 + BYTES_PER_INTEGER;
+        return;
+      }
+
+    pushConstStr(capacity);
+  }
+
+void loadLocalAddress()
+  {
+    int displacement = fetchInt();
+    pushInt(bp + displacement);
+  }
+
+void loadGlobalAddress()
+  {
+    int displacement = fetchInt();
+    pushInt(sb + displacement);
+  }
+
+void loadByte()
+  {
+    int  address = popInt();
+    byte b = memory[address];
+    pushByte(b);
+  }
+
+void load2Bytes()
+  {
+    int  address = popInt();
+    byte b0 = memory[address + 0];
+    byte b1 = memory[address + 1];
+    pushByte(b0);
+    pushByte(b1);
+  }
+
+void loadWord()
+  {
+    int address = popInt();
+    int word = getWordAtAddr(address);
+    pushInt(word);
+  }
+
+void modulo()
+  {
+    int operand2 = popInt();
+    int operand1 = popInt();
+    pushInt(operand1%operand2);
+  }
+
+void multiply()
+  {
+    int operand2 = popInt();
+    int operand1 = popInt();
+    pushInt(operand1*operand2);
+  }
+
+void negate()
+  {
+    int operand1 = popInt();
+    pushInt(-operand1);
+  }
+
+void logicalNot()
+  {
+    byte operand = popByte();
+    pushByte(operand == FALSE ? TRUE : FALSE);
+  }
+
+void procedure()
+  {
+    int address   = pc - 1;
+    int varLength = fetchInt();
+
+    sp = sp + varLength;
+    checkFrame(address);
+  }
+
+void program()
+  {
+    int address   = pc - 1;
+    int varLength = fetchInt();
+
+    bp = sb;
+    sp = bp + varLength - 1;
+    checkFrame(address);
+  }
+
+void putChar()
+  {
+    outputChar(popChar());
+  }
+
+void putByte()
+  {
+    outputInt(popByte());
+  }
+
+void putInt()
+  {
+    outputInt(popInt());
+  }
+
+void putEOL()
+  {
+    outputChar(L'\n');
+  }
+
+void putString()
+  {
+    int capacity = fetchInt();
+    writeString(capacity);
+  }
+
+/**
+ * Writes the string with the specified capacity on top of the stack to
+ * standard output and removes it from the stack.
+ */
+void writeString(int capacity)
+  {
+    // number of bytes in the string
+    int numBytes = BYTES_PER_INTEGER + capacity*BYTES_PER_CHAR;
+
+    int addr = sp - numBytes + 1;
+    int strLength = getIntAtAddr(addr);
+    addr = addr + BYTES_PER_INTEGER;
+
+    outputString(addr, strLength);
+
+    // remove (pop) the string off the stack
+    sp = sp - capacity;
+  }
+
+void returnInst()
+  {
+    int paramLength = fetchInt();
+    pc = getIntAtAddr(bp + BYTES_PER_INTEGER);
+    sp = bp - paramLength - 1;
+    bp = getIntAtAddr(bp);
+  }
+
+void returnZero()
+  {
+    pc = getIntAtAddr(bp + BYTES_PER_INTEGER);
+    sp = bp - 1;
+    bp = getIntAtAddr(bp);
+  }
+
+void returnFour()
+  {
+    pc = getIntAtAddr(bp + BYTES_PER_INTEGER);
+    sp = bp - 5;
+    bp = getIntAtAddr(bp);
+  }
+
+void shiftLeft()
+  {
+    int operand2 = popInt();
+    int operand1 = popInt();
+
+    // zero out all except rightmost 5 bits of shiftAmount
+    int shiftAmount = operand2 & 0b11111;
+
+    pushInt(operand1 << shiftAmount);
+  }
+
+void shiftRight()
+  {
+    int operand2 = popInt();
+    int operand1 = popInt();
+
+    // zero out all except rightmost 5 bits of shiftAmount
+    int shiftAmount = operand2 & 0b11111;
+
+    pushInt(operand1 >> shiftAmount);
+  }
+
+void store()
+  {
+    int length   = fetchInt();
+    int destAddr = getIntAtAddr(sp - length - 3);
+
+    popBlock(destAddr, length);
+    popInt();   // remove destAddr from stack
+  }
+
+void storeByte()
+  {
+    byte value = popByte();
+    int  destAddr = popInt();
+    memory[destAddr] = value;
+  }
+
+void store2Bytes()
+  {
+    byte byte1 = popByte();
+    byte byte0 = popByte();
+    int  destAddr = popInt();
+    memory[destAddr + 0] = byte0;
+    memory[destAddr + 1] = byte1;
+  }
+
+void storeWord()
+  {
+    int value = popInt();
+    int destAddr = popInt();
+    putWordToAddr(value, destAddr);
+  }
+
+void subtract()
+  {
+    int operand2 = popInt();
+    int operand1 = popInt();
+    int result   = operand1 - operand2;
+    pushInt(result);
+  }
+
+// -----------------------------------------------------------------------------------------
+// End: machine instructions corresponding to opcodes
+// -----------------------------------------------------------------------------------------
+
+/**
+ * Prints values of internal registers to standard output.
+ */
+void printRegisters()
+  {
+    printf("PC=%d, BP=%d, SB=%d, SP=%d\n", pc, bp, sb, sp);
+  }
+
+/**
+ * Prints a view of memory to standard output.
+ */
+void printMemory()
+  {
+    int  memAddr = 0;
+
+    while (memAddr < sb)
+      {
+        // Prints "PC ->" in front of the correct memory address
+        if (pc == memAddr)
+            printf("PC ->");
+        else
+            printf("     ");
+
+        int opcode = memory[memAddr];
+        char* opcodeStr = toString(opcode);
+
+        if (isZeroOperandOpcode(opcode))
+          {
+            printf("%4d:  %s\n", memAddr, opcodeStr);
+            ++memAddr;
+          }
+        else if (isByteOperandOpcode(opcode))
+          {
+            printf("%4d:  %s", memAddr, opcodeStr);
+            ++memAddr;
+            printf(" %d\n", memory[memAddr++]);
+
+          }
+        else if (isIntOperandOpcode(opcode))
+          {
+            printf("%4d:  %s", memAddr, opcodeStr);
+            ++memAddr;
+            printf(" %d\n", getIntOperandAtAddr(memAddr));
+            memAddr = memAddr + BYTES_PER_INTEGER;
+          }
+        else if (opcode == LDCCH)
+          {
+            // special case: LDCCH
+            printf("%4d:  %s", memAddr, opcodeStr);
+            ++memAddr;
+            printf(" \'%c\'\n", getCharOperandAtAddr(memAddr));
+            memAddr = memAddr + BYTES_PER_CHAR;
+
+          }
+        else if (opcode == LDCSTR)
+          {
+            // special case: LDCSTR
+            printf("%4d:  %s", memAddr, opcodeStr);
+            ++memAddr;
+            // now print the string
+            printf("  \"");
+            int strLength = getIntOperandAtAddr(memAddr);
+            memAddr = memAddr + BYTES_PER_INTEGER;
+            for (int i = 0; i < strLength; ++i)
+              {
+                printf("%c", getCharAtAddr(memAddr));
+                memAddr = memAddr + BYTES_PER_CHAR;
+               }
+             printf("\"\n");
+          }
+        else
+            printf("*** PrintMemory: Unknown opcode %d ***\n", opcode);
+      }
+
+    // now print remaining values that compose the stack
+    for (memAddr = sb; memAddr <= sp; ++memAddr)
+      {
+        // Prints "SB ->", "BP ->", and "SP ->" in front of the correct memory address
+        if (sb == memAddr)
+            printf("SB ->");
+        else if (bp == memAddr)
+            printf("BP ->");
+        else if (sp == memAddr)
+            printf("SP ->");
+        else
+            printf("     ");
+
+        printf("%4d:  %d\n", memAddr, memory[memAddr]);
+      }
+
+    printf("\n");
+  }
+
+/**
+ * Prompt user and wait for user to press the enter key.
+ */
+void pause()
+  {
+    int ch;
+    printf("Press enter to continue...\n");
+    ch = getchar();
+    while (ch != '\n' && ch != EOF)
+        ch = getchar();
+  }
+
+/**
+ * Executes the instruction with the specified opcode, whose opcode byte
+ * has just been fetched.  Used by the switch engine and by runProfiled().
+ */
+static inline void execute(int opcode)
+  {
+    switch (opcode)
+      {
+        case ADD:      add();                  break;
+        case ALLOC:    allocate();             break;
+        case BITAND:   bitAnd();               break;
+        case BITOR:    bitOr();                break;
+        case BITXOR:   bitXor();               break;
+        case BITNOT:   bitNot();               break;
+        case BR:       branch();               break;
+        case BE:       branchEqual();          break;
+        case BNE:      branchNotEqual();       break;
+        case BG:       branchGreater();        break;
+        case BGE:      branchGreaterOrEqual(); break;
+        case BL:       branchLess();           break;
+        case BLE:      branchLessOrEqual();    break;
+        case BZ:       branchZero();           break;
+        case BNZ:      branchNonZero();        break;
+        case BYTE2INT: byteToInteger();        break;
+        case CALL:     call();                 break;
+        case DEC:      decrement();            break;
+        case DIV:      divide();               break;
+        case GETCH:    getCh();                break;
+        case GETINT:   getInt();               break;
+        case GETSTR:   getString();            break;
+        case HALT:     halt();                 break;
+        case INC:      increment();            break;
+        case INT2BYTE: intToByte();            break;
+        case LDCB:     loadConstByte();        break;
+        case LDCB0:    loadConstByteZero();    break;
+        case LDCB1:    loadConstByteOne();     break;
+        case LDCCH:    loadConstCh();          break;
+        case LDCINT:   loadConstInt();         break;
+        case LDCINT0:  loadConstIntZero();     break;
+        case LDCINT1:  loadConstIntOne();      break;
+        case LDCSTR:   loadConstStr();         break;
+        case LDLADDR:  loadLocalAddress();     break;
+        case LDGADDR:  loadGlobalAddress();    break;
+        case LOAD:     load();                 break;
+        case LOADB:    loadByte();             break;
+        case LOAD2B:   load2Bytes();           break;
+        case LOADW:    loadWord();             break;
+        case MOD:      modulo();               break;
+        case MUL:      multiply();             break;
+        case NEG:      negate();               break;
+        case NOT:      logicalNot();           break;
+        case PROC:     procedure();            break;
+        case PROGRAM:  program();              break;
+        case PUTBYTE:  putByte();              break;
+        case PUTCH:    putChar();              break;
+        case PUTEOL:   putEOL();               break;
+        case PUTINT:   putInt();               break;
+        case PUTSTR:   putString();            break;
+        case RET:      returnInst();           break;
+        case RET0:     returnZero();           break;
+        case RET4:     returnFour();           break;
+        case SHL:      shiftLeft();            break;
+        case SHR:      shiftRight();           break;
+        case STORE:    store();                break;
+        case STOREB:   storeByte();            break;
+        case STORE2B:  store2Bytes();          break;
+        case STOREW:   storeWord();            break;
+        case SUB:      subtract();             break;
+        case TRAP:     takeSnapshot();         break;
+        default:       error(L"invalid machine instruction");
+      }
+  }
+
+#if THREADED_DISPATCH
+
+/**
+ * Runs the program using direct-threaded dispatch.  Each opcode has its own
+ * label, and the dispatch step (fetch the next opcode and jump through the
+ * table) is replicated at the end of every handler rather than shared in a
+ * single loop.  This gives the branch predictor one indirect jump per opcode
+ * to learn from instead of one for the whole program.
+ */
+void run()
+  {
+    // dispatch table indexed by opcode; unused entries are invalid instructions
+    static void* dispatchTable[256] =
+      {
+        [0 ... 255] = &&do_INVALID,
+        [ADD]      = &&do_ADD,
+        [ALLOC]    = &&do_ALLOC,
+        [BITAND]   = &&do_BITAND,
+        [BITOR]    = &&do_BITOR,
+        [BITXOR]   = &&do_BITXOR,
+        [BITNOT]   = &&do_BITNOT,
+        [BR]       = &&do_BR,
+        [BE]       = &&do_BE,
+        [BNE]      = &&do_BNE,
+        [BG]       = &&do_BG,
+        [BGE]      = &&do_BGE,
+        [BL]       = &&do_BL,
+        [BLE]      = &&do_BLE,
+        [BZ]       = &&do_BZ,
+        [BNZ]      = &&do_BNZ,
+        [BYTE2INT] = &&do_BYTE2INT,
+        [CALL]     = &&do_CALL,
+        [DEC]      = &&do_DEC,
+        [DIV]      = &&do_DIV,
+        [GETCH]    = &&do_GETCH,
+        [GETINT]   = &&do_GETINT,
+        [GETSTR]   = &&do_GETSTR,
+        [HALT]     = &&do_HALT,
+        [INC]      = &&do_INC,
+        [INT2BYTE] = &&do_INT2BYTE,
+        [LDCB]     = &&do_LDCB,
+        [LDCB0]    = &&do_LDCB0,
+        [LDCB1]    = &&do_LDCB1,
+        [LDCCH]    = &&do_LDCCH,
+        [LDCINT]   = &&do_LDCINT,
+        [LDCINT0]  = &&do_LDCINT0,
+        [LDCINT1]  = &&do_LDCINT1,
+        [LDCSTR]   = &&do_LDCSTR,
+        [LDLADDR]  = &&do_LDLADDR,
+        [LDGADDR]  = &&do_LDGADDR,
+        [LOAD]     = &&do_LOAD,
+        [LOADB]    = &&do_LOADB,
+        [LOAD2B]   = &&do_LOAD2B,
+        [LOADW]    = &&do_LOADW,
+        [MOD]      = &&do_MOD,
+        [MUL]      = &&do_MUL,
+        [NEG]      = &&do_NEG,
+        [NOT]      = &&do_NOT,
+        [PROC]     = &&do_PROC,
+        [PROGRAM]  = &&do_PROGRAM,
+        [PUTBYTE]  = &&do_PUTBYTE,
+        [PUTCH]    = &&do_PUTCH,
+        [PUTEOL]   = &&do_PUTEOL,
+        [PUTINT]   = &&do_PUTINT,
+        [PUTSTR]   = &&do_PUTSTR,
+        [RET]      = &&do_RET,
+        [RET0]     = &&do_RET0,
+        [RET4]     = &&do_RET4,
+        [SHL]      = &&do_SHL,
+        [SHR]      = &&do_SHR,
+        [STORE]    = &&do_STORE,
+        [STOREB]   = &&do_STOREB,
+        [STORE2B]  = &&do_STORE2B,
+        [STOREW]   = &&do_STOREW,
+        [SUB]      = &&do_SUB,
+        [TRAP]     = &&do_TRAP,
+      };
+
+// fetch the next opcode and jump directly to its handler
+#define DISPATCH()                                         \
+    do                                                     \
+      {                                                    \
+        if (DEBUG)                                         \
+          {                                                \
+            printRegisters();                              \
+            printMemory();                                 \
+            pause();                                       \
+          }                                                \
+        goto *dispatchTable[(uint8_t) fetchByte()];        \
+      }                                                    \
+    while (0)
+
+    running = true;
+
+    DISPATCH();
+
+    do_ADD:      add();                  DISPATCH();
+    do_ALLOC:    allocate();             DISPATCH();
+    do_BITAND:   bitAnd();               DISPATCH();
+    do_BITOR:    bitOr();                DISPATCH();
+    do_BITXOR:   bitXor();               DISPATCH();
+    do_BITNOT:   bitNot();               DISPATCH();
+    do_BR:       branch();               DISPATCH();
+    do_BE:       branchEqual();          DISPATCH();
+    do_BNE:      branchNotEqual();       DISPATCH();
+    do_BG:       branchGreater();        DISPATCH();
+    do_BGE:      branchGreaterOrEqual(); DISPATCH();
+    do_BL:       branchLess();           DISPATCH();
+    do_BLE:      branchLessOrEqual();    DISPATCH();
+    do_BZ:       branchZero();           DISPATCH();
+    do_BNZ:      branchNonZero();        DISPATCH();
+    do_BYTE2INT: byteToInteger();        DISPATCH();
+    do_CALL:     call();                 DISPATCH();
+    do_DEC:      decrement();            DISPATCH();
+    do_DIV:      divide();               DISPATCH();
+    do_GETCH:    getCh();                DISPATCH();
+    do_GETINT:   getInt();               DISPATCH();
+    do_GETSTR:   getString();            DISPATCH();
+    do_INC:      increment();            DISPATCH();
+    do_INT2BYTE: intToByte();            DISPATCH();
+    do_LDCB:     loadConstByte();        DISPATCH();
+    do_LDCB0:    loadConstByteZero();    DISPATCH();
+    do_LDCB1:    loadConstByteOne();     DISPATCH();
+    do_LDCCH:    loadConstCh();          DISPATCH();
+    do_LDCINT:   loadConstInt();         DISPATCH();
+    do_LDCINT0:  loadConstIntZero();     DISPATCH();
+    do_LDCINT1:  loadConstIntOne();      DISPATCH();
+    do_LDCSTR:   loadConstStr();         DISPATCH();
+    do_LDLADDR:  loadLocalAddress();     DISPATCH();
+    do_LDGADDR:  loadGlobalAddress();    DISPATCH();
+    do_LOAD:     load();                 DISPATCH();
+    do_LOADB:    loadByte();             DISPATCH();
+    do_LOAD2B:   load2Bytes();           DISPATCH();
+    do_LOADW:    loadWord();             DISPATCH();
+    do_MOD:      modulo();               DISPATCH();
+    do_MUL:      multiply();             DISPATCH();
+    do_NEG:      negate();               DISPATCH();
+    do_NOT:      logicalNot();           DISPATCH();
+    do_PROC:     procedure();            DISPATCH();
+    do_PROGRAM:  program();              DISPATCH();
+    do_PUTBYTE:  putByte();              DISPATCH();
+    do_PUTCH:    putChar();              DISPATCH();
+    do_PUTEOL:   putEOL();               DISPATCH();
+    do_PUTINT:   putInt();               DISPATCH();
+    do_PUTSTR:   putString();            DISPATCH();
+    do_RET:      returnInst();           DISPATCH();
+    do_RET0:     returnZero();           DISPATCH();
+    do_RET4:     returnFour();           DISPATCH();
+    do_SHL:      shiftLeft();            DISPATCH();
+    do_SHR:      shiftRight();           DISPATCH();
+    do_STORE:    store();                DISPATCH();
+    do_STOREB:   storeByte();            DISPATCH();
+    do_STORE2B:  store2Bytes();          DISPATCH();
+    do_STOREW:   storeWord();            DISPATCH();
+    do_SUB:      subtract();             DISPATCH();
+
+    do_TRAP:     takeSnapshot();         DISPATCH();
+    do_HALT:     halt();                 return;
+    do_INVALID:  error(L"invalid machine instruction");
+
+#undef DISPATCH
+  }
+
+#else
+
+/**
+ * Runs the program using a portable switch statement for dispatch.
+ */
+void run()
+  {
+    running = true;
+
+    while (running)
+      {
+        if (DEBUG)
+          {
+            printRegisters();
+            printMemory();
+            pause();
+          }
+
+        execute((uint8_t) fetchByte());
+      }
+  }
+
+#endif
+
+/**
+ * Runs the program like the switch engine, counting the instructions
+ * executed at each code address and the backward branches taken, and
+ * following the calls and returns if the call graph is recorded (see
+ * profile.c).  This is a separate loop so that run() costs nothing extra
+ * when no profile is wanted.
+ */
+void runProfiled()
+  {
+    CvmContext* context = currentContext;
+    uint64_t* executionCounts = context->executionCounts;
+    uint64_t* branchCounts    = context->branchCounts;
+    bool      recordCalls     = context->callGraph != NULL;
+
+    if (recordCalls)
+        beginCallGraph();
+
+    running = true;
+
+    while (running)
+      {
+        int address = pc;
+        int opcode  = (uint8_t) fetchByte();
+
+        // TRAP runs the instruction it replaced next (see snapshot.c)
+        if (address < sb && opcode != TRAP)
+          {
+            ++executionCounts[address];
+            ++context->instructionsExecuted;
+          }
+
+        execute(opcode);
+
+        // LDCSTR n; PUTSTR n runs as one step (see loadConstStr())
+        if (opcode == LDCSTR)
+          {
+            int next = address + 1 + BYTES_PER_INTEGER
+                     + getIntOperandAtAddr(address + 1)*BYTES_PER_CHAR;
+            if (pc != next)
+              {
+                ++executionCounts[next];
+                ++context->instructionsExecuted;
+              }
+          }
+
+        // a loop branches back to the same or an earlier address
+        if (pc <= address && isRelativeJumpOpcode(opcode) && opcode != CALL)
+            ++branchCounts[address];
+
+        if (recordCalls)
+          {
+            if (opcode == CALL)
+                enterProcedure(pc);
+            else if (opcode == RET || opcode == RET0 || opcode == RET4)
+                exitProcedure();
+          }
+      }
+  }
+
+/**
+ * Runs the program like the switch engine, adding a record for each
+ * instruction to the trace before executing it (see trace.c).  This is a
+ * separate loop so that run() costs nothing extra when no trace is wanted.
+ */
+void runTraced()
+  {
+    running = true;
+
+    while (running)
+      {
+        int address = pc;
+        int opcode  = (uint8_t) fetchByte();
+
+        // TRAP runs the instruction it replaced next (see snapshot.c)
+        if (opcode != TRAP)
+            traceInstruction(address, opcode);
+
+        // LDCSTR runs on its own, so that the PUTSTR after it is traced
+        if (opcode == LDCSTR)
+            pushConstStr(fetchInt());
+        else
+            execute(opcode);
+      }
+  }
+
+// -----------------------------------------------------------------------------------------
+// Start: predecoded execution engine
+// -----------------------------------------------------------------------------------------
+
+/*
+ * With the --predecode option, loadProgram() translates the byte code into an
+ * array of decoded instructions, and the program is run from that array
+ * instead of from memory.  Each decoded instruction holds a pointer to its
+ * handler, its operand as a native int, and for branches and calls a pointer
+ * to the decoded target, so no operand is decoded more than once.  With
+ * threaded dispatch (see run()), runDecoded() also resolves each decoded
+ * instruction to the address of its code and executes the frequent
+ * instructions inline with the registers in local variables.
+ *
+ * Return addresses pushed by CALL are still code addresses, exactly as in
+ * run(), so the contents of the stack do not change.  RET uses the table
+ * instructionIndex[] to map a code address back to a decoded instruction.
+ *
+ * Unless --no-fuse is given, the predecoder also replaces a fixed catalog
+ * of instruction sequences that the CPRL compiler generates over and over
+ * with superinstructions, each of which does the work of the whole sequence
+ * in one dispatch and without the intermediate stack traffic.  Only the
+ * first decoded instruction of a sequence is changed; it executes the
+ * sequence and continues after its last instruction.  A sequence is never
+ * fused if a branch, call, or return can land inside it.
+ */
+
+// the decoded program, followed by an entry that marks the end of the code
+THREAD_LOCAL Instruction* decodedCode = NULL;
+
+// number of decoded instructions, not counting the end marker
+THREAD_LOCAL int numDecodedInstructions = 0;
+
+// decoded index for each code address, or -1 if not the start of an instruction
+THREAD_LOCAL int* instructionIndex = NULL;
+
+/**
+ * Returns the number of bytes in the instruction at the specified code
+ * address, or 0 if the address does not contain a valid opcode.
+ */
+int instructionLength(int address)
+  {
+    int opcode = memory[address];
+
+    if (isZeroOperandOpcode(opcode))
+        return 1;
+    else if (isByteOperandOpcode(opcode))
+        return 2;
+    else if (isIntOperandOpcode(opcode))
+        return 1 + BYTES_PER_INTEGER;
+    else if (opcode == LDCCH)
+        return 1 + BYTES_PER_CHAR;
+    else if (opcode == LDCSTR && address + BYTES_PER_INTEGER < sb
+                              && getIntOperandAtAddr(address + 1) >= 0)
+        return 1 + BYTES_PER_INTEGER + getIntOperandAtAddr(address + 1)*BYTES_PER_CHAR;
+    else
+        return 0;
+  }
+
+/**
+ * Returns the decoded instruction that starts at the specified code address.
+ */
+const Instruction* decodedInstructionAt(int address)
+  {
+    int index = (address >= 0 && address <= sb) ? instructionIndex[address] : -1;
+    if (index < 0)
+        error(L"*** FAULT: Invalid return address ***");
+
+    return decodedCode + index;
+  }
+
+// Decoded handlers for instructions without operands simply call the
+// corresponding machine instruction and fall through to the next one.
+#define DECODED_HANDLER(name, instruction)                          \
+    const Instruction* decoded##name(const Instruction* inst)       \
+      {                                                             \
+        instruction();                                              \
+        return inst + 1;                                            \
+      }
+
+DECODED_HANDLER(Add,            add)
+DECODED_HANDLER(BitAnd,         bitAnd)
+DECODED_HANDLER(BitOr,          bitOr)
+DECODED_HANDLER(BitXor,         bitXor)
+DECODED_HANDLER(BitNot,         bitNot)
+DECODED_HANDLER(ByteToInteger,  byteToInteger)
+DECODED_HANDLER(Decrement,      decrement)
+DECODED_HANDLER(Divide,         divide)
+DECODED_HANDLER(GetCh,          getCh)
+DECODED_HANDLER(GetInt,         getInt)
+DECODED_HANDLER(Increment,      increment)
+DECODED_HANDLER(IntToByte,      intToByte)
+DECODED_HANDLER(LoadConstByteZero, loadConstByteZero)
+DECODED_HANDLER(LoadConstByteOne,  loadConstByteOne)
+DECODED_HANDLER(LoadConstIntZero,  loadConstIntZero)
+DECODED_HANDLER(LoadConstIntOne,   loadConstIntOne)
+DECODED_HANDLER(LoadByte,       loadByte)
+DECODED_HANDLER(Load2Bytes,     load2Bytes)
+DECODED_HANDLER(LoadWord,       loadWord)
+DECODED_HANDLER(Modulo,         modulo)
+DECODED_HANDLER(Multiply,       multiply)
+DECODED_HANDLER(Negate,         negate)
+DECODED_HANDLER(LogicalNot,     logicalNot)
+DECODED_HANDLER(PutByte,        putByte)
+DECODED_HANDLER(PutChar,        putChar)
+DECODED_HANDLER(PutEOL,         putEOL)
+DECODED_HANDLER(PutInt,         putInt)
+DECODED_HANDLER(ShiftLeft,      shiftLeft)
+DECODED_HANDLER(ShiftRight,     shiftRight)
+DECODED_HANDLER(StoreByte,      storeByte)
+DECODED_HANDLER(Store2Bytes,    store2Bytes)
+DECODED_HANDLER(StoreWord,      storeWord)
+DECODED_HANDLER(Subtract,       subtract)
+
+#undef DECODED_HANDLER
+
+const Instruction* decodedAllocate(const Instruction* inst)
+  {
+    sp = sp + inst->operand;
+    if (sp >= numBytesMemory)
+        error(L"*** Out of memory ***");
+
+    return inst + 1;
+  }
+
+const Instruction* decodedBranch(const Instruction* inst)
+  {
+    return inst->target;
+  }
+
+const Instruction* decodedBranchEqual(const Instruction* inst)
+  {
+    int operand2 = popInt();
+    int operand1 = popInt();
+    return operand1 == operand2 ? inst->target : inst + 1;
+  }
+
+const Instruction* decodedBranchNotEqual(const Instruction* inst)
+  {
+    int operand2 = popInt();
+    int operand1 = popInt();
+    return operand1 != operand2 ? inst->target : inst + 1;
+  }
+
+const Instruction* decodedBranchGreater(const Instruction* inst)
+  {
+    int operand2 = popInt();
+    int operand1 = popInt();
+    return operand1 > operand2 ? inst->target : inst + 1;
+  }
+
+const Instruction* decodedBranchGreaterOrEqual(const Instruction* inst)
+  {
+    int operand2 = popInt();
+    int operand1 = popInt();
+    return operand1 >= operand2 ? inst->target : inst + 1;
+  }
+
+const Instruction* decodedBranchLess(const Instruction* inst)
+  {
+    int operand2 = popInt();
+    int operand1 = popInt();
+    return operand1 < operand2 ? inst->target : inst + 1;
+  }
+
+const Instruction* decodedBranchLessOrEqual(const Instruction* inst)
+  {
+    int operand2 = popInt();
+    int operand1 = popInt();
+    return operand1 <= operand2 ? inst->target : inst + 1;
+  }
+
+const Instruction* decodedBranchZero(const Instruction* inst)
+  {
+    byte value = popByte();
+    return value == 0 ? inst->target : inst + 1;
+  }
+
+const Instruction* decodedBranchNonZero(const Instruction* inst)
+  {
+    byte value = popByte();
+    return value != 0 ? inst->target : inst + 1;
+  }
+
+const Instruction* decodedCall(const Instruction* inst)
+  {
+    pushInt(bp);                   // dynamic link
+    pushInt(inst[1].address);      // return address
+
+    // set bp to starting address of new frame
+    bp = sp - BYTES_PER_CONTEXT + 1;
+
+    return inst->target;
+  }
+
+const Instruction* decodedGetString(const Instruction* inst)
+  {
+    int destAddr = popInt();
+    readString(destAddr, inst->operand);
+    return inst + 1;
+  }
+
+const Instruction* decodedHalt(const Instruction* inst)
+  {
+    halt();
+    return NULL;
+  }
+
+const Instruction* decodedInvalid(const Instruction* inst)
+  {
+    error(L"invalid machine instruction");
+    return NULL;
+  }
+
+const Instruction* decodedLoad(const Instruction* inst)
+  {
+    int length  = inst->operand;
+    int address = popInt();
+    pushBlock(address, length);
+
+    return inst + 1;
+  }
+
+const Instruction* decodedLoadConstByte(const Instruction* inst)
+  {
+    pushByte((byte) inst->operand);
+    return inst + 1;
+  }
+
+const Instruction* decodedLoadConstCh(const Instruction* inst)
+  {
+    char ch = (char) inst->operand;   // same conversion as loadConstCh()
+    pushChar(ch);
+    return inst + 1;
+  }
+
+const Instruction* decodedLoadConstInt(const Instruction* inst)
+  {
+    pushInt(inst->operand);
+    return inst + 1;
+  }
+
+const Instruction* decodedLoadConstStr(const Instruction* inst)
+  {
+    int capacity = inst->operand;
+    pushInt(capacity);
+
+    // the characters follow the capacity in the code segment
+    pushBlock(inst->address + 1 + BYTES_PER_INTEGER, capacity*BYTES_PER_CHAR);
+
+    return inst + 1;
+  }
+
+const Instruction* decodedLoadLocalAddress(const Instruction* inst)
+  {
+    pushInt(bp + inst->operand);
+    return inst + 1;
+  }
+
+const Instruction* decodedLoadGlobalAddress(const Instruction* inst)
+  {
+    pushInt(sb + inst->operand);
+    return inst + 1;
+  }
+
+// For PROC and PROGRAM, operand2 is the stack growth of the procedure
+// after the instruction (0 if the program was not verified).
+
+const Instruction* decodedProcedure(const Instruction* inst)
+  {
+    sp = sp + inst->operand;
+    if (sp + inst->operand2 >= numBytesMemory)
+        error(L"*** Out of memory ***");
+
+    return inst + 1;
+  }
+
+const Instruction* decodedProgram(const Instruction* inst)
+  {
+    bp = sb;
+    sp = bp + inst->operand - 1;
+
+    if (sp + inst->operand2 >= numBytesMemory)
+        error(L"*** Out of memory ***");
+
+    return inst + 1;
+  }
+
+const Instruction* decodedPutString(const Instruction* inst)
+  {
+    writeString(inst->operand);
+    return inst + 1;
+  }
+
+const Instruction* decodedReturn(const Instruction* inst)
+  {
+    int paramLength   = inst->operand;
+    int returnAddress = getIntAtAddr(bp + BYTES_PER_INTEGER);
+    sp = bp - paramLength - 1;
+    bp = getIntAtAddr(bp);
+    return decodedInstructionAt(returnAddress);
+  }
+
+const Instruction* decodedReturnZero(const Instruction* inst)
+  {
+    int returnAddress = getIntAtAddr(bp + BYTES_PER_INTEGER);
+    sp = bp - 1;
+    bp = getIntAtAddr(bp);
+    return decodedInstructionAt(returnAddress);
+  }
+
+const Instruction* decodedReturnFour(const Instruction* inst)
+  {
+    int returnAddress = getIntAtAddr(bp + BYTES_PER_INTEGER);
+    sp = bp - 5;
+    bp = getIntAtAddr(bp);
+    return decodedInstructionAt(returnAddress);
+  }
+
+const Instruction* decodedStore(const Instruction* inst)
+  {
+    int length   = inst->operand;
+    int destAddr = getIntAtAddr(sp - length - 3);
+
+    popBlock(destAddr, length);
+    popInt();   // remove destAddr from stack
+    return inst + 1;
+  }
+
+// decoded handlers indexed by opcode; NULL for invalid opcodes
+const Handler decodedHandlers[256] =
+  {
+    [ADD]      = decodedAdd,
+    [ALLOC]    = decodedAllocate,
+    [BITAND]   = decodedBitAnd,
+    [BITOR]    = decodedBitOr,
+    [BITXOR]   = decodedBitXor,
+    [BITNOT]   = decodedBitNot,
+    [BR]       = decodedBranch,
+    [BE]       = decodedBranchEqual,
+    [BNE]      = decodedBranchNotEqual,
+    [BG]       = decodedBranchGreater,
+    [BGE]      = decodedBranchGreaterOrEqual,
+    [BL]       = decodedBranchLess,
+    [BLE]      = decodedBranchLessOrEqual,
+    [BZ]       = decodedBranchZero,
+    [BNZ]      = decodedBranchNonZero,
+    [BYTE2INT] = decodedByteToInteger,
+    [CALL]     = decodedCall,
+    [DEC]      = decodedDecrement,
+    [DIV]      = decodedDivide,
+    [GETCH]    = decodedGetCh,
+    [GETINT]   = decodedGetInt,
+    [GETSTR]   = decodedGetString,
+    [HALT]     = decodedHalt,
+    [INC]      = decodedIncrement,
+    [INT2BYTE] = decodedIntToByte,
+    [LDCB]     = decodedLoadConstByte,
+    [LDCB0]    = decodedLoadConstByteZero,
+    [LDCB1]    = decodedLoadConstByteOne,
+    [LDCCH]    = decodedLoadConstCh,
+    [LDCINT]   = decodedLoadConstInt,
+    [LDCINT0]  = decodedLoadConstIntZero,
+    [LDCINT1]  = decodedLoadConstIntOne,
+    [LDCSTR]   = decodedLoadConstStr,
+    [LDLADDR]  = decodedLoadLocalAddress,
+    [LDGADDR]  = decodedLoadGlobalAddress,
+    [LOAD]     = decodedLoad,
+    [LOADB]    = decodedLoadByte,
+    [LOAD2B]   = decodedLoad2Bytes,
+    [LOADW]    = decodedLoadWord,
+    [MOD]      = decodedModulo,
+    [MUL]      = decodedMultiply,
+    [NEG]      = decodedNegate,
+    [NOT]      = decodedLogicalNot,
+    [PROC]     = decodedProcedure,
+    [PROGRAM]  = decodedProgram,
+    [PUTBYTE]  = decodedPutByte,
+    [PUTCH]    = decodedPutChar,
+    [PUTEOL]   = decodedPutEOL,
+    [PUTINT]   = decodedPutInt,
+    [PUTSTR]   = decodedPutString,
+    [RET]      = decodedReturn,
+    [RET0]     = decodedReturnZero,
+    [RET4]     = decodedReturnFour,
+    [SHL]      = decodedShiftLeft,
+    [SHR]      = decodedShiftRight,
+    [STORE]    = decodedStore,
+    [STOREB]   = decodedStoreByte,
+    [STORE2B]  = decodedStore2Bytes,
+    [STOREW]   = decodedStoreWord,
+    [SUB]      = decodedSubtract,
+  };
+
+/**
+ * Returns true if the opcode is a branch or call whose int operand is a
+ * displacement relative to the end of the instruction.
+ */
+bool isRelativeJumpOpcode(int opcode)
+  {
+    switch (opcode)
+      {
+        case BR:
+        case BE:
+        case BNE:
+        case BG:
+        case BGE:
+        case BL:
+        case BLE:
+        case BZ:
+        case BNZ:
+        case CALL:
+            return true;
+        default:
+            return false;
+      }
+  }
+
+// Start: superinstructions
+// ------------------------
+
+/*
+ * A superinstruction leaves the stack exactly as the sequence it replaces,
+ * except for the bytes above sp, which the sequence would have used as
+ * scratch space and which no instruction reads before writing.
+ */
+
+/**
+ * LDLADDR n; LOADW -- push the value of a local int variable.
+ */
+const Instruction* fusedLoadLocalWord(const Instruction* inst)
+  {
+    pushInt(getWordAtAddr(bp + inst->operand));
+    return inst + inst->length;
+  }
+
+/**
+ * LDGADDR n; LOADW -- push the value of a global int variable.
+ */
+const Instruction* fusedLoadGlobalWord(const Instruction* inst)
+  {
+    pushInt(getWordAtAddr(sb + inst->operand));
+    return inst + inst->length;
+  }
+
+/**
+ * LDCINT k; MUL; ADD; LOADW -- replace an array address and an index on
+ * top of the stack with the int element at that index (k = element size).
+ */
+const Instruction* fusedLoadElementWord(const Instruction* inst)
+  {
+    int index   = popInt();
+    int address = popInt();
+    pushInt(getWordAtAddr(address + index*inst->operand));
+    return inst + inst->length;
+  }
+
+/**
+ * LDLADDR n; LDLADDR n; LOADW; INC; STOREW -- add one to a local int
+ * variable.  Also used for the unoptimized form with LDCINT1; ADD.
+ */
+const Instruction* fusedIncrementLocal(const Instruction* inst)
+  {
+    int address = bp + inst->operand;
+    putWordToAddr(getWordAtAddr(address) + 1, address);
+    return inst + inst->length;
+  }
+
+/**
+ * LDLADDR n; LDLADDR n; LOADW; DEC; STOREW -- subtract one from a local
+ * int variable.
+ */
+const Instruction* fusedDecrementLocal(const Instruction* inst)
+  {
+    int address = bp + inst->operand;
+    putWordToAddr(getWordAtAddr(address) - 1, address);
+    return inst + inst->length;
+  }
+
+// LDLADDR n; LOADW; LDCINT k; Bxx -- compare a local int variable with
+// a constant and branch, as in the test at the top of a for loop.
+#define FUSED_LOCAL_BRANCH(name, relation)                                 \
+    const Instruction* fusedLocalBranch##name(const Instruction* inst)     \
+      {                                                                    \
+        int value = getWordAtAddr(bp + inst->operand);                     \
+        return value relation inst->operand2 ? inst->target                \
+                                             : inst + inst->length;        \
+      }
+
+FUSED_LOCAL_BRANCH(Equal,          ==)
+FUSED_LOCAL_BRANCH(NotEqual,       !=)
+FUSED_LOCAL_BRANCH(Greater,        >)
+FUSED_LOCAL_BRANCH(GreaterOrEqual, >=)
+FUSED_LOCAL_BRANCH(Less,           <)
+FUSED_LOCAL_BRANCH(LessOrEqual,    <=)
+
+#undef FUSED_LOCAL_BRANCH
+
+/**
+ * LDCSTR n; PUTSTR n -- write a string literal, using its text encoded by
+ * encodeLiterals() if operand2 is not -1.
+ */
+const Instruction* fusedPutLiteral(const Instruction* inst)
+  {
+    const char* text = inst->operand2 >= 0 ? currentContext->literals + inst->operand2 : NULL;
+    putLiteral(inst->address + 1 + BYTES_PER_INTEGER, inst->operand, text);
+    return inst + inst->length;
+  }
+
+// maximum number of instructions in a superinstruction
+#define MAX_FUSED_LENGTH 6
+
+/**
+ * An entry in the catalog of superinstructions.  The superinstruction takes
+ * its first operand and its target (if any) from the first and last
+ * instructions in the sequence, and its second operand from the instruction
+ * at operand2Index (-1 if none).
+ */
+typedef struct
+  {
+    Handler handler;
+    int     length;
+    int     opcodes[MAX_FUSED_LENGTH];
+    int     operand2Index;
+    bool    sameOperands;   // true if the first two instructions must have equal operands
+  } Superinstruction;
+
+// the catalog, with longer sequences ahead of any sequence they start with
+const Superinstruction superinstructions[] =
+  {
+    { fusedIncrementLocal, 6, { LDLADDR, LDLADDR, LOADW, LDCINT1, ADD, STOREW }, -1, true  },
+    { fusedIncrementLocal, 5, { LDLADDR, LDLADDR, LOADW, INC, STOREW },          -1, true  },
+    { fusedDecrementLocal, 5, { LDLADDR, LDLADDR, LOADW, DEC, STOREW },          -1, true  },
+    { fusedLocalBranchEqual,          4, { LDLADDR, LOADW, LDCINT, BE  },         2, false },
+    { fusedLocalBranchNotEqual,       4, { LDLADDR, LOADW, LDCINT, BNE },         2, false },
+    { fusedLocalBranchGreater,        4, { LDLADDR, LOADW, LDCINT, BG  },         2, false },
+    { fusedLocalBranchGreaterOrEqual, 4, { LDLADDR, LOADW, LDCINT, BGE },         2, false },
+    { fusedLocalBranchLess,           4, { LDLADDR, LOADW, LDCINT, BL  },         2, false },
+    { fusedLocalBranchLessOrEqual,    4, { LDLADDR, LOADW, LDCINT, BLE },         2, false },
+    { fusedLoadElementWord, 4, { LDCINT, MUL, ADD, LOADW },                      -1, false },
+    { fusedLoadLocalWord,   2, { LDLADDR, LOADW },                               -1, false },
+    { fusedLoadGlobalWord,  2, { LDGADDR, LOADW },                               -1, false },
+    { fusedPutLiteral,      2, { LDCSTR, PUTSTR },                               -1, true  },
+  };
+
+const int NUM_SUPERINSTRUCTIONS = sizeof(superinstructions)/sizeof(superinstructions[0]);
+
+/**
+ * Returns true if the decoded instructions starting at index first match
+ * the superinstruction and no instruction after the first is a jump target.
+ */
+bool matchesSuperinstruction(const Superinstruction* super, int first,
+                             int numInstructions, const bool* isJumpTarget)
+  {
+    if (first + super->length > numInstructions)
+        return false;
+
+    for (int i = 0; i < super->length; ++i)
+      {
+        const Instruction* inst = decodedCode + first + i;
+        if (memory[inst->address] != super->opcodes[i] || inst->length != 1)
+            return false;
+        if (i > 0 && isJumpTarget[first + i])
+            return false;
+      }
+
+    if (super->sameOperands && decodedCode[first].operand != decodedCode[first + 1].operand)
+        return false;
+
+    return true;
+  }
+
+/**
+ * Returns a newly allocated array that is true for each decoded instruction
+ * that can be reached other than by falling through from its predecessor,
+ * i.e., branch and call targets, return addresses, and the instruction
+ * where a restored program resumes.  Returns NULL if
+ * there is not enough memory.
+ */
+bool* findJumpTargets(int numInstructions)
+  {
+    bool* isJumpTarget = (bool*) calloc(numInstructions + 1, sizeof(bool));
+    if (isJumpTarget == NULL)
+        return NULL;
+
+    for (int i = 0; i < numInstructions; ++i)
+      {
+        const Instruction* inst = decodedCode + i;
+        if (inst->target != NULL)
+            isJumpTarget[inst->target - decodedCode] = true;
+        if (inst->handler == decodedCall)
+            isJumpTarget[i + 1] = true;   // return address
+      }
+
+    // where a restored program resumes (see snapshot.c)
+    int resumeIndex = instructionIndex[currentContext->resumeAddress];
+    if (resumeIndex >= 0)
+        isJumpTarget[resumeIndex] = true;
+
+    return isJumpTarget;
+  }
+
+/**
+ * Replaces sequences in the decoded program that match the catalog of
+ * superinstructions.  Must be called after branch targets are resolved.
+ */
+void fuseSuperinstructions(int numInstructions)
+  {
+    bool* isJumpTarget = findJumpTargets(numInstructions);
+    if (isJumpTarget == NULL)
+        return;   // run unfused
+
+    int i = 0;
+    while (i < numInstructions)
+      {
+        int length = 1;
+        for (int j = 0; j < NUM_SUPERINSTRUCTIONS; ++j)
+          {
+            const Superinstruction* super = superinstructions + j;
+            if (matchesSuperinstruction(super, i, numInstructions, isJumpTarget))
+              {
+                Instruction* inst = decodedCode + i;
+                const Instruction* last = inst + super->length - 1;
+
+                inst->handler = super->handler;
+                inst->length  = super->length;
+                inst->target  = last->target;
+                if (super->operand2Index >= 0)
+                    inst->operand2 = inst[super->operand2Index].operand;
+
+                length = super->length;
+                break;
+              }
+          }
+
+        i = i + length;
+      }
+
+    free(isJumpTarget);
+  }
+
+/**
+ * Returns true if the decoded instruction is LDCSTR n and the next one is
+ * PUTSTR n.
+ */
+bool isPutLiteral(const Instruction* inst)
+  {
+    return memory[inst[0].address] == LDCSTR && memory[inst[1].address] == PUTSTR
+        && inst[0].operand == inst[1].operand;
+  }
+
+/**
+ * Encodes the string of each LDCSTR n that is followed by PUTSTR n as
+ * UTF-8 in currentContext->literals, preceded by its length as an int,
+ * and sets operand2 of the LDCSTR to where it starts.  operand2 is -1 for
+ * an LDCSTR whose string is not encoded.  Must be called before
+ * fuseSuperinstructions(), which passes operand2 on to fusedPutLiteral().
+ */
+void encodeLiterals(int numInstructions)
+  {
+    CvmContext* context = currentContext;
+
+    // at most 3 bytes per char
+    size_t size = 0;
+    for (int i = 0; i < numInstructions; ++i)
+      {
+        Instruction* inst = decodedCode + i;
+        if (memory[inst->address] == LDCSTR)
+            inst->operand2 = -1;
+        if (i + 1 < numInstructions && isPutLiteral(inst))
+            size = size + sizeof(int) + 3*(size_t) inst->operand;
+      }
+
+    if (size == 0 || (context->literals = (char*) malloc(size)) == NULL)
+        return;   // write the chars instead
+
+    size_t used = 0;
+    for (int i = 0; i + 1 < numInstructions; ++i)
+      {
+        Instruction* inst = decodedCode + i;
+        if (!isPutLiteral(inst))
+            continue;
+
+        char* text = context->literals + used;
+        int length = encodeString(inst->address + 1 + BYTES_PER_INTEGER, inst->operand,
+                                  text + sizeof(int));
+        if (length >= 0)
+          {
+            memcpy(text, &length, sizeof(length));
+            inst->operand2 = (int) used;
+            used = used + sizeof(int) + length;
+          }
+      }
+  }
+
+// End: superinstructions
+// ----------------------
+
+/**
+ * Translates the code segment (memory[0..sb-1]) into decoded instructions.
+ * Decoding stops at the first invalid opcode, which is decoded as an
+ * instruction that reports the error if it is ever executed.  Returns false
+ * if the program cannot be decoded (e.g., a branch into the middle of an
+ * instruction), in which case the program must be run by run().  The
+ * superinstructions are used only if fuse is true.
+ */
+bool predecodeProgram(bool fuse)
+  {
+    // there is at most one instruction per byte, plus the end marker
+    decodedCode      = (Instruction*) malloc(sizeof(Instruction)*(sb + 1));
+    instructionIndex = (int*) malloc(sizeof(int)*(sb + 1));
+    if (decodedCode == NULL || instructionIndex == NULL)
+        goto fail;
+
+    for (int i = 0; i <= sb; ++i)
+        instructionIndex[i] = -1;
+
+    // first pass: decode handlers and operands
+    int numInstructions = 0;
+    int address = 0;
+    while (address < sb)
+      {
+        Instruction* inst = decodedCode + numInstructions;
+        int opcode = (uint8_t) memory[address];
+        int length = instructionLength(address);
+
+        instructionIndex[address] = numInstructions++;
+        inst->address  = address;
+        inst->operand  = 0;
+        inst->operand2 = 0;
+        inst->length   = 1;
+        inst->target   = NULL;
+
+        if (length == 0 || decodedHandlers[opcode] == NULL)
+          {
+            inst->handler = decodedInvalid;
+            break;
+          }
+        else if (address + length > sb)
+            goto fail;   // truncated instruction
+
+        inst->handler = decodedHandlers[opcode];
+
+        if (isByteOperandOpcode(opcode))
+            inst->operand = memory[address + 1];
+        else if (opcode == LDCCH)
+            inst->operand = getCharOperandAtAddr(address + 1);
+        else if (isIntOperandOpcode(opcode) || opcode == LDCSTR)
+            inst->operand = getIntOperandAtAddr(address + 1);
+
+        if ((opcode == PROC || opcode == PROGRAM) && currentContext->verified)
+            inst->operand2 = currentContext->stackGrowth[address];
+
+        address = address + length;
+      }
+
+    // the end marker; code that runs off the end is not valid
+    Instruction* end = decodedCode + numInstructions;
+    end->handler  = decodedInvalid;
+    end->address  = sb;
+    end->operand  = 0;
+    end->operand2 = 0;
+    end->length   = 1;
+    end->target   = NULL;
+    if (address >= sb)
+        instructionIndex[sb] = numInstructions;
+
+    // second pass: resolve branch and call targets
+    for (int i = 0; i < numInstructions; ++i)
+      {
+        Instruction* inst = decodedCode + i;
+        if (inst->handler != decodedInvalid && isRelativeJumpOpcode(memory[inst->address]))
+          {
+            int targetAddr = inst->address + 1 + BYTES_PER_INTEGER + inst->operand;
+            if (targetAddr < 0 || targetAddr > sb || instructionIndex[targetAddr] < 0)
+                goto fail;
+
+            inst->target = decodedCode + instructionIndex[targetAddr];
+          }
+      }
+
+    encodeLiterals(numInstructions);
+    if (fuse)
+        fuseSuperinstructions(numInstructions);
+
+    numDecodedInstructions = numInstructions;
+    return true;
+
+  fail:
+    free(decodedCode);
+    free(instructionIndex);
+    decodedCode      = NULL;
+    instructionIndex = NULL;
+    return false;
+  }
+
+/**
+ * Frees the decoded program and the literals encoded for it.
+ */
+void freeDecodedProgram()
+  {
+    free(decodedCode);
+    free(instructionIndex);
+    free(currentContext->literals);
+
+    decodedCode              = NULL;
+    instructionIndex         = NULL;
+    numDecodedInstructions   = 0;
+    currentContext->literals = NULL;
+  }
+
+#if THREADED_DISPATCH
+
+/**
+ * Runs the predecoded program.  Each decoded instruction is dispatched with
+ * goto through the address of its code, and sp, bp, and memory are kept in
+ * local variables that the compiler can keep in machine registers.  The
+ * frequent instructions and the superinstructions are executed inline; the
+ * others store the registers and call their decoded handler.
+ */
+void runDecoded()
+  {
+    const Instruction* inst = decodedInstructionAt(pc);
+
+    // labels indexed by opcode; opcodes not listed call their handler
+    static const void* labels[256] =
+      {
+        [0 ... 255] = &&do_HANDLER,
+        [ADD]      = &&do_ADD,
+        [ALLOC]    = &&do_ALLOC,
+        [BITAND]   = &&do_BITAND,
+        [BITOR]    = &&do_BITOR,
+        [BITXOR]   = &&do_BITXOR,
+        [BITNOT]   = &&do_BITNOT,
+        [BR]       = &&do_BR,
+        [BE]       = &&do_BE,
+        [BNE]      = &&do_BNE,
+        [BG]       = &&do_BG,
+        [BGE]      = &&do_BGE,
+        [BL]       = &&do_BL,
+        [BLE]      = &&do_BLE,
+        [BZ]       = &&do_BZ,
+        [BNZ]      = &&do_BNZ,
+        [BYTE2INT] = &&do_BYTE2INT,
+        [CALL]     = &&do_CALL,
+        [DEC]      = &&do_DEC,
+        [DIV]      = &&do_DIV,
+        [HALT]     = &&do_HALT,
+        [INC]      = &&do_INC,
+        [INT2BYTE] = &&do_INT2BYTE,
+        [LDCB]     = &&do_LDCB,
+        [LDCB0]    = &&do_LDCB0,
+        [LDCB1]    = &&do_LDCB1,
+        [LDCINT]   = &&do_LDCINT,
+        [LDCINT0]  = &&do_LDCINT0,
+        [LDCINT1]  = &&do_LDCINT1,
+        [LDLADDR]  = &&do_LDLADDR,
+        [LDGADDR]  = &&do_LDGADDR,
+        [LOADB]    = &&do_LOADB,
+        [LOADW]    = &&do_LOADW,
+        [MOD]      = &&do_MOD,
+        [MUL]      = &&do_MUL,
+        [NEG]      = &&do_NEG,
+        [NOT]      = &&do_NOT,
+        [PROC]     = &&do_PROC,
+        [PROGRAM]  = &&do_PROGRAM,
+        [RET]      = &&do_RET,
+        [RET0]     = &&do_RET0,
+        [RET4]     = &&do_RET4,
+        [SHL]      = &&do_SHL,
+        [SHR]      = &&do_SHR,
+        [STOREB]   = &&do_STOREB,
+        [STOREW]   = &&do_STOREW,
+        [SUB]      = &&do_SUB,
+      };
+
+    // resolve each decoded instruction, including the end marker,
+    // to the address of its code
+    for (int i = 0; i <= numDecodedInstructions; ++i)
+      {
+        Instruction* decoded = decodedCode + i;
+        Handler handler = decoded->handler;
+
+        if (handler == fusedLoadLocalWord)
+            decoded->label = &&do_LOADLOCAL;
+        else if (handler == fusedLoadGlobalWord)
+            decoded->label = &&do_LOADGLOBAL;
+        else if (handler == fusedLoadElementWord)
+            decoded->label = &&do_LOADELEMENT;
+        else if (handler == fusedIncrementLocal)
+            decoded->label = &&do_INCLOCAL;
+        else if (handler == fusedDecrementLocal)
+            decoded->label = &&do_DECLOCAL;
+        else if (handler == fusedLocalBranchEqual)
+            decoded->label = &&do_LBE;
+        else if (handler == fusedLocalBranchNotEqual)
+            decoded->label = &&do_LBNE;
+        else if (handler == fusedLocalBranchGreater)
+            decoded->label = &&do_LBG;
+        else if (handler == fusedLocalBranchGreaterOrEqual)
+            decoded->label = &&do_LBGE;
+        else if (handler == fusedLocalBranchLess)
+            decoded->label = &&do_LBL;
+        else if (handler == fusedLocalBranchLessOrEqual)
+            decoded->label = &&do_LBLE;
+        else if (handler == decodedHandlers[memory[decoded->address]])
+            decoded->label = labels[memory[decoded->address]];
+        else
+            decoded->label = &&do_HANDLER;   // other superinstructions, end marker
+      }
+
+    // the registers of the virtual machine
+    byte* data         = memory;
+    int   stackPointer = sp;
+    int   basePointer  = bp;
+    int   stackBase    = sb;
+    int   memorySize   = numBytesMemory;
+
+#define DISPATCH()        goto *inst->label
+#define NEXT()            do { ++inst; DISPATCH(); } while (0)
+#define JUMP(dest)        do { inst = (dest); DISPATCH(); } while (0)
+#define PUSH_INT(value)   do { int n_ = (value);                                   \
+                               putIntAt(data, stackPointer + 1, n_);               \
+                               stackPointer = stackPointer + BYTES_PER_INTEGER;    \
+                             } while (0)
+#define POP_INT()         (stackPointer = stackPointer - BYTES_PER_INTEGER,        \
+                           intAt(data, stackPointer + 1))
+
+// pop two ints and push the result of an int operation on them
+#define BINARY(op, expr)                                                       \
+    do_##op:                                                                   \
+      {                                                                        \
+        int operand2 = POP_INT();                                              \
+        int operand1 = POP_INT();                                              \
+        PUSH_INT(expr);                                                        \
+        NEXT();                                                                \
+      }
+
+// pop two ints and branch if the relation holds
+#define BRANCH(op, relation)                                                   \
+    do_##op:                                                                   \
+      {                                                                        \
+        int operand2 = POP_INT();                                              \
+        int operand1 = POP_INT();                                              \
+        JUMP(operand1 relation operand2 ? inst->target : inst + 1);            \
+      }
+
+// compare a local int variable with a constant and branch (superinstruction)
+#define LOCAL_BRANCH(op, relation)                                             \
+    do_##op:                                                                   \
+      {                                                                        \
+        int value = intAt(data, basePointer + inst->operand);                  \
+        JUMP(value relation inst->operand2 ? inst->target : inst + inst->length); \
+      }
+
+    running = true;
+    DISPATCH();
+
+    do_LDCINT:    PUSH_INT(inst->operand);                 NEXT();
+    do_LDCINT0:   PUSH_INT(0);                             NEXT();
+    do_LDCINT1:   PUSH_INT(1);                             NEXT();
+    do_LDCB:      data[++stackPointer] = (byte) inst->operand;   NEXT();
+    do_LDCB0:     data[++stackPointer] = FALSE;            NEXT();
+    do_LDCB1:     data[++stackPointer] = TRUE;             NEXT();
+    do_LDLADDR:   PUSH_INT(basePointer + inst->operand);   NEXT();
+    do_LDGADDR:   PUSH_INT(stackBase + inst->operand);     NEXT();
+
+    do_LOADW:
+      {
+        int address = POP_INT();
+        PUSH_INT(intAt(data, address));
+        NEXT();
+      }
+
+    do_LOADB:
+      {
+        int address = POP_INT();
+        data[++stackPointer] = data[address];
+        NEXT();
+      }
+
+    do_STOREW:
+      {
+        int value    = POP_INT();
+        int destAddr = POP_INT();
+        putIntAt(data, destAddr, value);
+        NEXT();
+      }
+
+    do_STOREB:
+      {
+        byte value    = data[stackPointer--];
+        int  destAddr = POP_INT();
+        data[destAddr] = value;
+        NEXT();
+      }
+
+    BINARY(ADD,    operand1 + operand2)
+    BINARY(SUB,    operand1 - operand2)
+    BINARY(MUL,    operand1*operand2)
+    BINARY(MOD,    operand1%operand2)
+    BINARY(BITAND, operand1 & operand2)
+    BINARY(BITOR,  operand1 | operand2)
+    BINARY(BITXOR, operand1 ^ operand2)
+    BINARY(SHL,    operand1 << (operand2 & 0b11111))
+    BINARY(SHR,    operand1 >> (operand2 & 0b11111))
+
+    do_DIV:
+      {
+        int operand2 = POP_INT();
+        int operand1 = POP_INT();
+        if (operand2 == 0)
+            error(L"*** FAULT: Divide by zero ***");
+
+        PUSH_INT(operand1/operand2);
+        NEXT();
+      }
+
+    do_NEG:       PUSH_INT(-POP_INT());                    NEXT();
+    do_INC:       PUSH_INT(POP_INT() + 1);                 NEXT();
+    do_DEC:       PUSH_INT(POP_INT() - 1);                 NEXT();
+    do_BITNOT:    PUSH_INT(~POP_INT());                    NEXT();
+
+    do_NOT:
+        data[stackPointer] = data[stackPointer] == FALSE ? TRUE : FALSE;
+        NEXT();
+
+    do_BYTE2INT:
+      {
+        byte b = data[stackPointer--];
+        PUSH_INT((int) b);
+        NEXT();
+      }
+
+    do_INT2BYTE:
+      {
+        int n = POP_INT();
+        data[++stackPointer] = (byte) n;
+        NEXT();
+      }
+
+    do_BR:        JUMP(inst->target);
+
+    BRANCH(BE,  ==)
+    BRANCH(BNE, !=)
+    BRANCH(BG,  >)
+    BRANCH(BGE, >=)
+    BRANCH(BL,  <)
+    BRANCH(BLE, <=)
+
+    do_BZ:
+      {
+        byte value = data[stackPointer--];
+        JUMP(value == 0 ? inst->target : inst + 1);
+      }
+
+    do_BNZ:
+      {
+        byte value = data[stackPointer--];
+        JUMP(value != 0 ? inst->target : inst + 1);
+      }
+
+    do_CALL:
+        PUSH_INT(basePointer);         // dynamic link
+        PUSH_INT(inst[1].address);     // return address
+
+        // set bp to starting address of new frame
+        basePointer = stackPointer - BYTES_PER_CONTEXT + 1;
+        JUMP(inst->target);
+
+    do_RET:
+      {
+        int returnAddress = intAt(data, basePointer + BYTES_PER_INTEGER);
+        stackPointer = basePointer - inst->operand - 1;
+        basePointer  = intAt(data, basePointer);
+        JUMP(decodedInstructionAt(returnAddress));
+      }
+
+    do_RET0:
+      {
+        int returnAddress = intAt(data, basePointer + BYTES_PER_INTEGER);
+        stackPointer = basePointer - 1;
+        basePointer  = intAt(data, basePointer);
+        JUMP(decodedInstructionAt(returnAddress));
+      }
+
+    do_RET4:
+      {
+        int returnAddress = intAt(data, basePointer + BYTES_PER_INTEGER);
+        stackPointer = basePointer - 5;
+        basePointer  = intAt(data, basePointer);
+        JUMP(decodedInstructionAt(returnAddress));
+      }
+
+    do_PROC:
+        stackPointer = stackPointer + inst->operand;
+        if (stackPointer + inst->operand2 >= memorySize)
+            error(L"*** Out of memory ***");
+
+        NEXT();
+
+    do_PROGRAM:
+        basePointer  = stackBase;
+        stackPointer = basePointer + inst->operand - 1;
+        if (stackPointer + inst->operand2 >= memorySize)
+            error(L"*** Out of memory ***");
+
+        NEXT();
+
+    do_ALLOC:
+        stackPointer = stackPointer + inst->operand;
+        if (stackPointer >= memorySize)
+            error(L"*** Out of memory ***");
+
+        NEXT();
+
+    do_HALT:
+        sp = stackPointer;
+        bp = basePointer;
+        halt();
+        return;
+
+    // superinstructions
+
+    do_LOADLOCAL:
+        PUSH_INT(intAt(data, basePointer + inst->operand));
+        JUMP(inst + inst->length);
+
+    do_LOADGLOBAL:
+        PUSH_INT(intAt(data, stackBase + inst->operand));
+        JUMP(inst + inst->length);
+
+    do_LOADELEMENT:
+      {
+        int index   = POP_INT();
+        int address = POP_INT();
+        PUSH_INT(intAt(data, address + index*inst->operand));
+        JUMP(inst + inst->length);
+      }
+
+    do_INCLOCAL:
+      {
+        int address = basePointer + inst->operand;
+        putIntAt(data, address, intAt(data, address) + 1);
+        JUMP(inst + inst->length);
+      }
+
+    do_DECLOCAL:
+      {
+        int address = basePointer + inst->operand;
+        putIntAt(data, address, intAt(data, address) - 1);
+        JUMP(inst + inst->length);
+      }
+
+    LOCAL_BRANCH(LBE,  ==)
+    LOCAL_BRANCH(LBNE, !=)
+    LOCAL_BRANCH(LBG,  >)
+    LOCAL_BRANCH(LBGE, >=)
+    LOCAL_BRANCH(LBL,  <)
+    LOCAL_BRANCH(LBLE, <=)
+
+    // all other instructions, with the registers stored for the handler
+    do_HANDLER:
+        sp = stackPointer;
+        bp = basePointer;
+        inst = inst->handler(inst);
+        if (inst == NULL)
+            return;
+
+        stackPointer = sp;
+        basePointer  = bp;
+        DISPATCH();
+
+#undef LOCAL_BRANCH
+#undef BRANCH
+#undef BINARY
+#undef POP_INT
+#undef PUSH_INT
+#undef JUMP
+#undef NEXT
+#undef DISPATCH
+  }
+
+#else
+
+/**
+ * Runs the predecoded program.
+ */
+void runDecoded()
+  {
+    running = true;
+
+    const Instruction* inst = decodedInstructionAt(pc);
+    while (inst != NULL)
+        inst = inst->handler(inst);
+  }
+
+#endif
+
+// -----------------------------------------------------------------------------------------
+// Start: top-of-stack caching engine
+// -----------------------------------------------------------------------------------------
+
+/*
+ * With the --cache-tos option, the decoded program is translated once more
+ * and run by runCached(), which keeps up to two ints from the top of the
+ * stack in local variables (tos and nos) that the compiler can keep in
+ * machine registers.  Cached ints are logically on top of the stack but are
+ * not yet in memory, i.e., sp does not include them.
+ *
+ * The number of cached ints at each instruction (its cache state, 0 to 2)
+ * is known when the program is translated, so each operation has a variant
+ * for each state, and the translator picks the variant for the state left
+ * by the previous instruction.  The variants are written as a chain of
+ * labels that fall through into each other, e.g. for ADD
+ *
+ *     ADD_0: tos = popInt();
+ *     ADD_1: nos = popInt();
+ *     ADD_2: tos = nos + tos;
+ *
+ * Operations that pop and push ints (arithmetic, LDLADDR, LOADW, STOREW,
+ * compare-and-branch, ...) work on the cached values.  Every other
+ * instruction first spills the cached ints to memory and then runs as in
+ * runDecoded(), so instructions that use the stack in memory (LOAD, STORE,
+ * CALL, PUTSTR, ...) see exactly the same stack.  The state is always 0 at
+ * branch targets and return addresses; if the instruction before one of
+ * them leaves ints cached, the translator inserts a SPILL.
+ */
+
+// The operations of the caching engine.  Fused operations correspond to
+// the superinstructions of the decoded program, and MEMORY runs any other
+// instruction through its decoded handler after spilling.
+#define CACHED_OPERATIONS(X)                                                   \
+    X(LDCINT)  X(LDLADDR) X(LDGADDR) X(LOADLOCAL) X(LOADGLOBAL)                \
+    X(NEG)     X(INC)     X(DEC)     X(BITNOT)    X(LOADW)                     \
+    X(ADD)     X(SUB)     X(MUL)     X(DIV)       X(MOD)                       \
+    X(BITAND)  X(BITOR)   X(BITXOR)  X(SHL)       X(SHR)     X(LOADELEMENT)    \
+    X(STOREW)  X(BE)      X(BNE)     X(BG)        X(BGE)     X(BL)  X(BLE)     \
+    X(INCLOCAL) X(DECLOCAL)                                                    \
+    X(LBE)     X(LBNE)    X(LBG)     X(LBGE)      X(LBL)     X(LBLE)           \
+    X(BR)      X(BZ)      X(BNZ)     X(CALL)      X(RET)     X(RET0) X(RET4)   \
+    X(HALT)    X(MEMORY)  X(SPILL)
+
+// one variant for each cache state
+#define DECLARE_VARIANTS(op) CACHED_##op##_0, CACHED_##op##_1, CACHED_##op##_2,
+
+enum { CACHED_OPERATIONS(DECLARE_VARIANTS) NUM_CACHED_VARIANTS };
+
+#undef DECLARE_VARIANTS
+
+// how an operation changes the cache state
+typedef enum
+  {
+    PUSH_INT,      // pushes an int
+    UNARY_INT,     // replaces the int on top of the stack
+    BINARY_INT,    // replaces the two ints on top of the stack with one
+    POP_TWO_INTS,  // pops two ints
+    NO_STACK,      // does not use the stack
+    SPILL_ALL      // spills, then uses the stack in memory
+  } CacheEffect;
+
+typedef struct CachedInstruction CachedInstruction;
+
+struct CachedInstruction
+  {
+    const void* label;                  // address of the variant's code (threaded dispatch)
+    int         variant;                // CACHED_op_state
+    int         operand;
+    int         operand2;
+    const Instruction* decoded;         // the decoded instruction that was translated
+    const CachedInstruction* target;    // target of a branch or call
+  };
+
+// the translated program, followed by the translation of the end marker
+THREAD_LOCAL CachedInstruction* cachedCode = NULL;
+
+// number of translated instructions, including the end marker
+THREAD_LOCAL int numCachedInstructions = 0;
+
+// cached index for each decoded instruction, or -1 if it was not translated
+THREAD_LOCAL int* cachedIndex = NULL;
+
+/**
+ * Returns the cached instruction for the specified return address.  An
+ * address inside a fused sequence has a decoded instruction but no cached
+ * one, so it is as invalid as one that is not an instruction at all.
+ */
+const CachedInstruction* cachedInstructionAt(int address)
+  {
+    const Instruction* inst = decodedInstructionAt(address);
+    int index = cachedIndex[inst - decodedCode];
+    if (index < 0)
+        error(L"*** FAULT: Invalid return address ***");
+
+    return cachedCode + index;
+  }
+
+/**
+ * Returns the cache state after an instruction with the specified effect
+ * is executed in the specified state.
+ */
+int cacheStateAfter(CacheEffect effect, int state)
+  {
+    switch (effect)
+      {
+        case PUSH_INT:   return state == 0 ? 1 : 2;
+        case UNARY_INT:  return state == 0 ? 1 : state;
+        case BINARY_INT: return 1;
+        case NO_STACK:   return state;
+        default:         return 0;
+      }
+  }
+
+/**
+ * Returns the first variant (state 0) of the operation that executes the
+ * decoded instruction, and sets its effect on the cache state.
+ */
+int cachedOperation(const Instruction* inst, CacheEffect* effect)
+  {
+    // superinstructions
+    if (inst->handler == fusedLoadLocalWord)
+        return *effect = PUSH_INT, CACHED_LOADLOCAL_0;
+    else if (inst->handler == fusedLoadGlobalWord)
+        return *effect = PUSH_INT, CACHED_LOADGLOBAL_0;
+    else if (inst->handler == fusedLoadElementWord)
+        return *effect = BINARY_INT, CACHED_LOADELEMENT_0;
+    else if (inst->handler == fusedIncrementLocal)
+        return *effect = NO_STACK, CACHED_INCLOCAL_0;
+    else if (inst->handler == fusedDecrementLocal)
+        return *effect = NO_STACK, CACHED_DECLOCAL_0;
+    else if (inst->handler == fusedLocalBranchEqual)
+        return *effect = SPILL_ALL, CACHED_LBE_0;
+    else if (inst->handler == fusedLocalBranchNotEqual)
+        return *effect = SPILL_ALL, CACHED_LBNE_0;
+    else if (inst->handler == fusedLocalBranchGreater)
+        return *effect = SPILL_ALL, CACHED_LBG_0;
+    else if (inst->handler == fusedLocalBranchGreaterOrEqual)
+        return *effect = SPILL_ALL, CACHED_LBGE_0;
+    else if (inst->handler == fusedLocalBranchLess)
+        return *effect = SPILL_ALL, CACHED_LBL_0;
+    else if (inst->handler == fusedLocalBranchLessOrEqual)
+        return *effect = SPILL_ALL, CACHED_LBLE_0;
+    else if (inst->handler == decodedInvalid)
+        return *effect = SPILL_ALL, CACHED_MEMORY_0;
+
+    *effect = SPILL_ALL;
+    switch (memory[inst->address])
+      {
+        case LDCINT:
+        case LDCINT0:
+        case LDCINT1:  *effect = PUSH_INT;     return CACHED_LDCINT_0;
+        case LDLADDR:  *effect = PUSH_INT;     return CACHED_LDLADDR_0;
+        case LDGADDR:  *effect = PUSH_INT;     return CACHED_LDGADDR_0;
+        case NEG:      *effect = UNARY_INT;    return CACHED_NEG_0;
+        case INC:      *effect = UNARY_INT;    return CACHED_INC_0;
+        case DEC:      *effect = UNARY_INT;    return CACHED_DEC_0;
+        case BITNOT:   *effect = UNARY_INT;    return CACHED_BITNOT_0;
+        case LOADW:    *effect = UNARY_INT;    return CACHED_LOADW_0;
+        case ADD:      *effect = BINARY_INT;   return CACHED_ADD_0;
+        case SUB:      *effect = BINARY_INT;   return CACHED_SUB_0;
+        case MUL:      *effect = BINARY_INT;   return CACHED_MUL_0;
+        case DIV:      *effect = BINARY_INT;   return CACHED_DIV_0;
+        case MOD:      *effect = BINARY_INT;   return CACHED_MOD_0;
+        case BITAND:   *effect = BINARY_INT;   return CACHED_BITAND_0;
+        case BITOR:    *effect = BINARY_INT;   return CACHED_BITOR_0;
+        case BITXOR:   *effect = BINARY_INT;   return CACHED_BITXOR_0;
+        case SHL:      *effect = BINARY_INT;   return CACHED_SHL_0;
+        case SHR:      *effect = BINARY_INT;   return CACHED_SHR_0;
+        case STOREW:   *effect = POP_TWO_INTS; return CACHED_STOREW_0;
+        case BE:       *effect = POP_TWO_INTS; return CACHED_BE_0;
+        case BNE:      *effect = POP_TWO_INTS; return CACHED_BNE_0;
+        case BG:       *effect = POP_TWO_INTS; return CACHED_BG_0;
+        case BGE:      *effect = POP_TWO_INTS; return CACHED_BGE_0;
+        case BL:       *effect = POP_TWO_INTS; return CACHED_BL_0;
+        case BLE:      *effect = POP_TWO_INTS; return CACHED_BLE_0;
+        case BR:       return CACHED_BR_0;
+        case BZ:       return CACHED_BZ_0;
+        case BNZ:      return CACHED_BNZ_0;
+        case CALL:     return CACHED_CALL_0;
+        case RET:      return CACHED_RET_0;
+        case RET0:     return CACHED_RET0_0;
+        case RET4:     return CACHED_RET4_0;
+        case HALT:     return CACHED_HALT_0;
+        default:       return CACHED_MEMORY_0;
+      }
+  }
+
+/**
+ * Translates the decoded program for runCached().  Returns false if there
+ * is not enough memory, in which case the decoded program must be run by
+ * runDecoded().
+ */
+bool cacheProgram()
+  {
+    int numInstructions = numDecodedInstructions;
+
+    // at most one spill per instruction, plus the end marker and its spill
+    cachedCode   = (CachedInstruction*) malloc(sizeof(CachedInstruction)*(2*numInstructions + 2));
+    cachedIndex  = (int*) malloc(sizeof(int)*(numInstructions + 1));
+    bool* isJumpTarget = findJumpTargets(numInstructions);
+    if (cachedCode == NULL || cachedIndex == NULL || isJumpTarget == NULL)
+      {
+        free(cachedCode);
+        free(cachedIndex);
+        free(isJumpTarget);
+        cachedCode  = NULL;
+        cachedIndex = NULL;
+        return false;
+      }
+
+    for (int i = 0; i <= numInstructions; ++i)
+        cachedIndex[i] = -1;
+
+    int numCached = 0;
+    int state = 0;
+    int i = 0;
+    while (i <= numInstructions)   // includes the end marker
+      {
+        const Instruction* inst = decodedCode + i;
+        CachedInstruction* cachedInst;
+
+        if ((isJumpTarget[i] || i == numInstructions) && state > 0)
+          {
+            cachedInst = cachedCode + numCached++;
+            cachedInst->variant  = CACHED_SPILL_0 + state;
+            cachedInst->operand  = 0;
+            cachedInst->operand2 = 0;
+            cachedInst->decoded  = inst;
+            cachedInst->target   = NULL;
+            state = 0;
+          }
+
+        CacheEffect effect;
+        int operation = cachedOperation(inst, &effect);
+
+        cachedIndex[i] = numCached;
+        cachedInst = cachedCode + numCached++;
+        cachedInst->variant  = operation + state;
+        cachedInst->operand  = inst->operand;
+        cachedInst->operand2 = inst->operand2;
+        cachedInst->decoded  = inst;
+        cachedInst->target   = NULL;
+
+        // the optimized constant loads have no operand
+        if (operation == CACHED_LDCINT_0 && memory[inst->address] == LDCINT1)
+            cachedInst->operand = 1;
+
+        state = cacheStateAfter(effect, state);
+        i = i + inst->length;
+      }
+
+    // resolve branch and call targets
+    for (i = 0; i < numInstructions; ++i)
+      {
+        const Instruction* inst = decodedCode + i;
+        if (cachedIndex[i] >= 0 && inst->target != NULL)
+            cachedCode[cachedIndex[i]].target = cachedCode + cachedIndex[inst->target - decodedCode];
+      }
+
+    numCachedInstructions = numCached;
+    free(isJumpTarget);
+    return true;
+  }
+
+/**
+ * Runs the translated program with the top of the stack cached.
+ */
+void runCached()
+  {
+    const CachedInstruction* inst = cachedInstructionAt(pc);
+
+    // the top of stack (tos) and next on stack (nos) when cached
+    int tos = 0;
+    int nos = 0;
+
+#if THREADED_DISPATCH
+
+#define LABEL_ADDRESSES(op) &&CACHED_##op##_0, &&CACHED_##op##_1, &&CACHED_##op##_2,
+
+    static const void* labels[NUM_CACHED_VARIANTS] = { CACHED_OPERATIONS(LABEL_ADDRESSES) };
+
+#undef LABEL_ADDRESSES
+
+    // resolve the variant of each instruction to the address of its code
+    for (int i = 0; i < numCachedInstructions; ++i)
+        cachedCode[i].label = labels[cachedCode[i].variant];
+
+#define VARIANT(name) name:
+#define DISPATCH()         goto *inst->label
+
+#else
+
+#define VARIANT(name) case name:
+#define DISPATCH()         goto dispatch
+
+#endif
+
+#define NEXT()      do { ++inst; DISPATCH(); } while (0)
+#define JUMP(dest)  do { inst = (dest); DISPATCH(); } while (0)
+
+    running = true;
+
+#if THREADED_DISPATCH
+    DISPATCH();
+#else
+  dispatch:
+    switch (inst->variant)
+      {
+#endif
+
+        // push an int, spilling nos if both registers are in use
+#define CACHED_PUSH_INT(op, value)                                             \
+        VARIANT(CACHED_##op##_2) pushInt(nos);                                 \
+        VARIANT(CACHED_##op##_1) nos = tos;                                    \
+        VARIANT(CACHED_##op##_0) tos = (value);                                \
+                                 NEXT();
+
+        CACHED_PUSH_INT(LDCINT,     inst->operand)
+        CACHED_PUSH_INT(LDLADDR,    bp + inst->operand)
+        CACHED_PUSH_INT(LDGADDR,    sb + inst->operand)
+        CACHED_PUSH_INT(LOADLOCAL,  getWordAtAddr(bp + inst->operand))
+        CACHED_PUSH_INT(LOADGLOBAL, getWordAtAddr(sb + inst->operand))
+
+        // replace the int on top of the stack
+#define CACHED_UNARY_INT(op, value)                                            \
+        VARIANT(CACHED_##op##_0) tos = popInt();                               \
+        VARIANT(CACHED_##op##_1)                                               \
+        VARIANT(CACHED_##op##_2) tos = (value);                                \
+                                 NEXT();
+
+        CACHED_UNARY_INT(NEG,    -tos)
+        CACHED_UNARY_INT(INC,    tos + 1)
+        CACHED_UNARY_INT(DEC,    tos - 1)
+        CACHED_UNARY_INT(BITNOT, ~tos)
+        CACHED_UNARY_INT(LOADW,  getWordAtAddr(tos))
+
+        // replace the two ints on top of the stack (nos, tos) with one
+#define CACHED_BINARY_INT(op, value)                                           \
+        VARIANT(CACHED_##op##_0) tos = popInt();                               \
+        VARIANT(CACHED_##op##_1) nos = popInt();                               \
+        VARIANT(CACHED_##op##_2) tos = (value);                                \
+                                 NEXT();
+
+        CACHED_BINARY_INT(ADD,         nos + tos)
+        CACHED_BINARY_INT(SUB,         nos - tos)
+        CACHED_BINARY_INT(MUL,         nos*tos)
+        CACHED_BINARY_INT(MOD,         nos%tos)
+        CACHED_BINARY_INT(BITAND,      nos & tos)
+        CACHED_BINARY_INT(BITOR,       nos | tos)
+        CACHED_BINARY_INT(BITXOR,      nos ^ tos)
+        CACHED_BINARY_INT(SHL,         nos << (tos & 0b11111))
+        CACHED_BINARY_INT(SHR,         nos >> (tos & 0b11111))
+        CACHED_BINARY_INT(LOADELEMENT, getWordAtAddr(nos + tos*inst->operand))
+
+        VARIANT(CACHED_DIV_0) tos = popInt();
+        VARIANT(CACHED_DIV_1) nos = popInt();
+        VARIANT(CACHED_DIV_2) if (tos == 0)
+                                  error(L"*** FAULT: Divide by zero ***");
+                              tos = nos/tos;
+                              NEXT();
+
+        // pop two ints (nos, tos)
+#define CACHED_POP_TWO_INTS(op)                                                \
+        VARIANT(CACHED_##op##_0) tos = popInt();                               \
+        VARIANT(CACHED_##op##_1) nos = popInt();                               \
+        VARIANT(CACHED_##op##_2)
+
+        CACHED_POP_TWO_INTS(STOREW)
+            putWordToAddr(tos, nos);
+            NEXT();
+
+#define CACHED_BRANCH(op, relation)                                            \
+        VARIANT(CACHED_##op##_0) tos = popInt();                               \
+        VARIANT(CACHED_##op##_1) nos = popInt();                               \
+        VARIANT(CACHED_##op##_2)                                               \
+            if (nos relation tos)                                              \
+                JUMP(inst->target);                                            \
+            NEXT();
+
+        CACHED_BRANCH(BE,  ==)
+        CACHED_BRANCH(BNE, !=)
+        CACHED_BRANCH(BG,  >)
+        CACHED_BRANCH(BGE, >=)
+        CACHED_BRANCH(BL,  <)
+        CACHED_BRANCH(BLE, <=)
+
+        // operations that do not use the stack keep the cache state
+        VARIANT(CACHED_INCLOCAL_0)
+        VARIANT(CACHED_INCLOCAL_1)
+        VARIANT(CACHED_INCLOCAL_2)
+          {
+            int address = bp + inst->operand;
+            putWordToAddr(getWordAtAddr(address) + 1, address);
+            NEXT();
+          }
+
+        VARIANT(CACHED_DECLOCAL_0)
+        VARIANT(CACHED_DECLOCAL_1)
+        VARIANT(CACHED_DECLOCAL_2)
+          {
+            int address = bp + inst->operand;
+            putWordToAddr(getWordAtAddr(address) - 1, address);
+            NEXT();
+          }
+
+        // all other operations spill the cached ints first
+#define CACHED_SPILL_ALL(op)                                                   \
+        VARIANT(CACHED_##op##_2) pushInt(nos);                                 \
+        VARIANT(CACHED_##op##_1) pushInt(tos);                                 \
+        VARIANT(CACHED_##op##_0)
+
+#define CACHED_LOCAL_BRANCH(op, relation)                                      \
+        CACHED_SPILL_ALL(op)                                                   \
+            if (getWordAtAddr(bp + inst->operand) relation inst->operand2)     \
+                JUMP(inst->target);                                            \
+            NEXT();
+
+        CACHED_LOCAL_BRANCH(LBE,  ==)
+        CACHED_LOCAL_BRANCH(LBNE, !=)
+        CACHED_LOCAL_BRANCH(LBG,  >)
+        CACHED_LOCAL_BRANCH(LBGE, >=)
+        CACHED_LOCAL_BRANCH(LBL,  <)
+        CACHED_LOCAL_BRANCH(LBLE, <=)
+
+        CACHED_SPILL_ALL(BR)
+            JUMP(inst->target);
+
+        CACHED_SPILL_ALL(BZ)
+            if (popByte() == 0)
+                JUMP(inst->target);
+            NEXT();
+
+        CACHED_SPILL_ALL(BNZ)
+            if (popByte() != 0)
+                JUMP(inst->target);
+            NEXT();
+
+        CACHED_SPILL_ALL(CALL)
+            pushInt(bp);                          // dynamic link
+            pushInt(inst->decoded[1].address);    // return address
+            bp = sp - BYTES_PER_CONTEXT + 1;
+            JUMP(inst->target);
+
+        CACHED_SPILL_ALL(RET)
+          {
+            int returnAddress = getIntAtAddr(bp + BYTES_PER_INTEGER);
+            sp = bp - inst->operand - 1;
+            bp = getIntAtAddr(bp);
+            JUMP(cachedInstructionAt(returnAddress));
+          }
+
+        CACHED_SPILL_ALL(RET0)
+          {
+            int returnAddress = getIntAtAddr(bp + BYTES_PER_INTEGER);
+            sp = bp - 1;
+            bp = getIntAtAddr(bp);
+            JUMP(cachedInstructionAt(returnAddress));
+          }
+
+        CACHED_SPILL_ALL(RET4)
+          {
+            int returnAddress = getIntAtAddr(bp + BYTES_PER_INTEGER);
+            sp = bp - 5;
+            bp = getIntAtAddr(bp);
+            JUMP(cachedInstructionAt(returnAddress));
+          }
+
+        CACHED_SPILL_ALL(HALT)
+            halt();
+            return;
+
+        CACHED_SPILL_ALL(MEMORY)
+            inst->decoded->handler(inst->decoded);
+            NEXT();
+
+        CACHED_SPILL_ALL(SPILL)
+            NEXT();
+
+#if !THREADED_DISPATCH
+      }
+#endif
+
+#undef CACHED_PUSH_INT
+#undef CACHED_UNARY_INT
+#undef CACHED_BINARY_INT
+#undef CACHED_POP_TWO_INTS
+#undef CACHED_BRANCH
+#undef CACHED_SPILL_ALL
+#undef CACHED_LOCAL_BRANCH
+#undef VARIANT
+#undef DISPATCH
+#undef NEXT
+#undef JUMP
+  }
+
+// Start: contexts and the libcvm interface
+// ----------------------------------------
+
+/**
+ * Copies the registers and tables of the current context from the
+ * thread-local variables back into the context.
+ */
+void saveContext()
+  {
+    CvmContext* context = currentContext;
+
+    context->pc      = pc;
+    context->bp      = bp;
+    context->sp      = sp;
+    context->sb      = sb;
+    context->running = running;
+
+    context->decodedCode            = decodedCode;
+    context->numDecodedInstructions = numDecodedInstructions;
+    context->instructionIndex       = instructionIndex;
+    context->cachedCode             = cachedCode;
+    context->numCachedInstructions  = numCachedInstructions;
+    context->cachedIndex            = cachedIndex;
+  }
+
+/**
+ * Copies the registers and tables of the context into the thread-local
+ * variables and makes it the current context.
+ */
+void restoreContext(CvmContext* context)
+  {
+    currentContext = context;
+
+    memory         = context->memory;
+    numBytesMemory = context->memorySize;
+    pc             = context->pc;
+    bp             = context->bp;
+    sp             = context->sp;
+    sb             = context->sb;
+    running        = context->running;
+
+    decodedCode            = context->decodedCode;
+    numDecodedInstructions = context->numDecodedInstructions;
+    instructionIndex       = context->instructionIndex;
+    cachedCode             = context->cachedCode;
+    numCachedInstructions  = context->numCachedInstructions;
+    cachedIndex            = context->cachedIndex;
+  }
+
+/**
+ * Binds the context to this thread.  Returns the context that was bound
+ * before (for example, when an I/O callback runs another program), which
+ * is saved and must be passed to unbindContext().
+ */
+CvmContext* bindContext(CvmContext* context)
+  {
+    CvmContext* previous = currentContext;
+    if (previous != NULL)
+        saveContext();
+
+    restoreContext(context);
+    return previous;
+  }
+
+/**
+ * Saves the current context and binds the previous one again.
+ */
+void unbindContext(CvmContext* previous)
+  {
+    saveContext();
+
+    currentContext = NULL;
+    if (previous != NULL)
+        restoreContext(previous);
+  }
+
+/**
+ * Frees the translated forms of the program in the current context.
+ */
+void freeProgram()
+  {
+    jitFree();
+    free(cachedCode);
+    free(cachedIndex);
+
+    cachedCode             = NULL;
+    cachedIndex            = NULL;
+    numCachedInstructions  = 0;
+
+    freeDecodedProgram();
+    free(currentContext->stackGrowth);
+    freeProfile();
+    freeSamples();
+    freeCounters();
+    currentContext->stackGrowth = NULL;
+
+    currentContext->verified   = false;
+    currentContext->predecoded = false;
+    currentContext->cached     = false;
+    currentContext->jitted     = false;
+  }
+
+/**
+ * Loads the program into memory and translates it for the selected engine.
+ */
+void loadProgram(const void* code, size_t length)
+  {
+    CvmContext* context = currentContext;
+
+    freeProgram();
+    context->loaded        = false;
+    context->resume        = false;
+    context->resumeAddress = 0;
+
+    if (length > (size_t) numBytesMemory)
+        error(L"*** Out of memory ***");
+
+    memcpy(memory, code, length);
+    clearMemory(context, (int) length);
+    context->cleared = true;
+
+    bp = (int) length;
+    sb = (int) length;
+    sp = bp - 1;
+
+    convertOperands();
+    translateProgram();
+  }
+
+/**
+ * Verifies the program in memory and translates it for the selected
+ * engine.
+ */
+void translateProgram()
+  {
+    CvmContext* context = currentContext;
+    CvmOptions* options = &context->options;
+
+    if (options->verify)
+        context->verified = verifyProgram();
+
+    // the compiler works from unfused decoded instructions
+    if (options->predecode || options->cacheTos || options->jit)
+        context->predecoded = predecodeProgram(options->fuse && !options->jit);
+
+    if (context->predecoded && options->jit)
+      {
+        context->jitted = jitCompile();
+
+        // if compilation fails, the interpreters get the program as requested
+        if (!context->jitted && options->fuse)
+          {
+            jitFree();
+            freeDecodedProgram();
+            context->predecoded = predecodeProgram(true);
+          }
+      }
+
+    if (context->predecoded && options->cacheTos && !context->jitted)
+        context->cached = cacheProgram();
+
+    if (options->profile || options->callGraph)
+        allocateProfile();
+
+    if (options->sampleRate > 0)
+        allocateSamples();
+
+    if (options->counters)
+        allocateCounters();
+
+    context->loaded = true;
+  }
+
+void cvm_default_options(CvmOptions* options)
+  {
+    options->predecode  = false;
+    options->fuse       = true;
+    options->cacheTos   = false;
+    options->jit        = false;
+    options->verify     = true;
+    options->profile    = false;
+    options->callGraph  = false;
+    options->sampleRate = 0;
+    options->counters   = false;
+    options->memorySize = NUM_BYTES_MEMORY;
+  }
+
+size_t cvm_parse_size(const char* s)
+  {
+    // strtoull() would accept a sign and white space
+    if (*s < '0' || *s > '9')
+        return 0;
+
+    char* end;
+    unsigned long long size = strtoull(s, &end, 10);
+
+    unsigned long long unit = 1;
+    if (*end == 'K' || *end == 'k')
+        unit = 1024;
+    else if (*end == 'M' || *end == 'm')
+        unit = 1024*1024;
+    else if (*end == 'G' || *end == 'g')
+        unit = 1024*1024*1024;
+    if (unit != 1)
+        ++end;
+
+    // compare before multiplying, so that a huge size cannot wrap around
+    if (*end != '\0' || size > CVM_MAX_MEMORY_SIZE/unit)
+        return 0;
+
+    return (size_t) (size*unit);
+  }
+
+void cvm_memory_io(CvmIO* io, CvmMemoryIO* memory, const char* input, size_t inputLength,
+                   bool keepOutput)
+  {
+    setMemoryIO(io, memory, input, inputLength, keepOutput);
+  }
+
+char* cvm_read_file(const char* filename, size_t* length)
+  {
+    return readFile(filename, length);
+  }
+
+CvmContext* cvm_create(const CvmOptions* options, const CvmIO* io)
+  {
+    CvmContext* context = (CvmContext*) calloc(1, sizeof(CvmContext));
+    if (context == NULL)
+        return NULL;
+
+    if (options != NULL)
+        context->options = *options;
+    else
+        cvm_default_options(&context->options);
+
+    if (!allocateMemory(context, context->options.memorySize))
+      {
+        free(context);
+        return NULL;
+      }
+
+    context->input  = (char*) malloc(INPUT_BUFFER_SIZE);
+    context->output = (char*) malloc(OUTPUT_BUFFER_SIZE);
+    if (context->input == NULL || context->output == NULL)
+      {
+        free(context->input);
+        free(context->output);
+        freeMemory(context);
+        free(context);
+        return NULL;
+      }
+
+    if (io != NULL)
+        context->io = *io;
+    else
+        setStdio(&context->io);
+
+    return context;
+  }
+
+void cvm_destroy(CvmContext* context)
+  {
+    if (context == NULL)
+        return;
+
+    CvmContext* previous = bindContext(context);
+    freeProgram();
+    closeTrace();
+    unbindContext(previous);
+
+    free(context->snapshotFile);
+    free(context->input);
+    free(context->output);
+    freeMemory(context);
+    free(context);
+  }
+
+CvmStatus cvm_load_from_buffer(CvmContext* context, const void* code, size_t length)
+  {
+    CvmContext* previous = bindContext(context);
+    context->errorMessage = NULL;
+
+    CvmStatus status = CVM_OK;
+    if (setjmp(context->errorExit) == 0)
+        loadProgram(code, length);
+    else
+        status = CVM_ERROR;
+
+    unbindContext(previous);
+    return status;
+  }
+
+CvmStatus cvm_load_file(CvmContext* context, const char* filename)
+  {
+    size_t length;
+    const void* code = mapFile(filename, &length);
+    if (code == NULL)
+      {
+        context->errorMessage = L"*** Error reading object file ***";
+        return CVM_IO_ERROR;
+      }
+
+    CvmStatus status = cvm_load_from_buffer(context, code, length);
+    unmapFile(code, length);
+    return status;
+  }
+
+CvmStatus cvm_run(CvmContext* context)
+  {
+    if (!context->loaded)
+      {
+        context->errorMessage = L"*** No program loaded ***";
+        return CVM_ERROR;
+      }
+
+    CvmContext* previous = bindContext(context);
+    context->errorMessage = NULL;
+
+    // start with the initial state of the machine, or where a restored
+    // image left off
+    bool resume = context->resume;
+    if (!resume)
+      {
+        if (!context->cleared)
+            clearMemory(context, sb);
+        pc = 0;
+        bp = sb;
+        sp = sb - 1;
+      }
+    context->cleared = false;
+    context->resume  = false;
+
+    CvmStatus status = CVM_OK;
+    if (setjmp(context->errorExit) == 0)
+      {
+        // PROGRAM checks the frame of the main program, if there is one
+        if (context->verified && memory[0] != PROGRAM && !resume)
+            checkFrame(0);
+
+        if (context->snapshotFile != NULL)
+            insertTraps();
+
+        if (context->samples != NULL)
+            beginSampling();
+
+        if (context->counters != NULL)
+            beginCounters();
+
+        if (context->traceFile != NULL)
+            runTraced();
+        else if (context->options.profile || context->options.callGraph)
+            runProfiled();
+        else if (context->snapshotFile != NULL || context->samples != NULL)
+            run();
+        else if (context->jitted)
+            runJit();
+        else if (context->cached)
+            runCached();
+        else if (context->predecoded)
+            runDecoded();
+        else
+            run();
+      }
+    else
+        status = CVM_ERROR;
+
+    if (context->counters != NULL)
+        endCounters();
+
+    if (context->samples != NULL)
+        endSampling();
+
+    if (context->traceFile != NULL && !flushTrace() && status == CVM_OK)
+      {
+        context->errorMessage = L"*** Error writing trace ***";
+        status = CVM_ERROR;
+      }
+
+    // the output of the run, up to HALT or the error
+    flushOutput();
+
+    if (context->callGraph != NULL)
+        endCallGraph();
+
+    // a snapshot is only taken by one run
+    removeTraps();
+    free(context->snapshotFile);
+    context->snapshotFile = NULL;
+
+    running = false;
+    unbindContext(previous);
+    return status;
+  }
+
+CvmStatus cvm_snapshot_at(CvmContext* context, int address, const char* filename)
+  {
+    if (address < 0 && address != CVM_FIRST_INPUT)
+      {
+        context->errorMessage = L"*** Invalid snapshot address ***";
+        return CVM_ERROR;
+      }
+
+    free(context->snapshotFile);
+    context->snapshotFile = strdup(filename);
+    context->snapshotAddress = address;
+    if (context->snapshotFile == NULL)
+      {
+        context->errorMessage = L"*** Out of memory ***";
+        return CVM_ERROR;
+      }
+
+    return CVM_OK;
+  }
+
+CvmStatus cvm_restore(CvmContext* context, const char* filename)
+  {
+    size_t length;
+    const void* contents = mapFile(filename, &length);
+    if (contents == NULL)
+      {
+        context->errorMessage = L"*** Error reading snapshot image ***";
+        return CVM_IO_ERROR;
+      }
+
+    CvmContext* previous = bindContext(context);
+    context->errorMessage = NULL;
+
+    CvmStatus status = CVM_OK;
+    if (setjmp(context->errorExit) == 0)
+      {
+        freeProgram();
+        context->loaded = false;
+
+        restoreImage(contents, length);
+        context->resumeAddress = pc;
+        translateProgram();
+
+        context->resume  = true;
+        context->cleared = false;
+      }
+    else
+        status = CVM_ERROR;
+
+    unbindContext(previous);
+    unmapFile(contents, length);
+    return status;
+  }
+
+void cvm_write_profile(CvmContext* context, FILE* fp)
+  {
+    if (context->executionCounts == NULL)
+        return;
+
+    CvmContext* previous = bindContext(context);
+    writeProfile(fp);
+    unbindContext(previous);
+  }
+
+unsigned long long cvm_instruction_count(const CvmContext* context)
+  {
+    return context->instructionsExecuted;
+  }
+
+void cvm_write_call_graph(CvmContext* context, FILE* fp)
+  {
+    if (context->callGraph == NULL)
+        return;
+
+    CvmContext* previous = bindContext(context);
+    writeCallGraph(fp);
+    unbindContext(previous);
+  }
+
+CvmStatus cvm_trace(CvmContext* context, const char* filename)
+  {
+    if (filename != NULL && (context->options.profile || context->options.callGraph))
+      {
+        context->errorMessage = L"*** A profiled run cannot be traced ***";
+        return CVM_ERROR;
+      }
+
+    CvmContext* previous = bindContext(context);
+    context->errorMessage = NULL;
+
+    CvmStatus status = CVM_OK;
+    if (setjmp(context->errorExit) == 0)
+      {
+        if (!openTrace(filename))
+          {
+            context->errorMessage = L"*** Error opening trace file ***";
+            status = CVM_IO_ERROR;
+          }
+      }
+    else
+        status = CVM_ERROR;
+
+    unbindContext(previous);
+    return status;
+  }
+
+void cvm_write_samples(CvmContext* context, FILE* fp)
+  {
+    if (context->samples == NULL)
+        return;
+
+    CvmContext* previous = bindContext(context);
+    writeSamples(fp);
+    unbindContext(previous);
+  }
+
+void cvm_write_counters(CvmContext* context, FILE* fp, unsigned long long instructions)
+  {
+    if (context->counters == NULL)
+        return;
+
+    CvmContext* previous = bindContext(context);
+    writeCounters(fp, instructions);
+    unbindContext(previous);
+  }
+
+CvmStatus cvm_load_symbols(CvmContext* context, const char* filename)
+  {
+    if (!context->loaded)
+      {
+        context->errorMessage = L"*** No program loaded ***";
+        return CVM_ERROR;
+      }
+
+    size_t length;
+    const void* contents = mapFile(filename, &length);
+    if (contents == NULL)
+      {
+        context->errorMessage = L"*** Error reading symbol file ***";
+        return CVM_IO_ERROR;
+      }
+
+    CvmContext* previous = bindContext(context);
+    context->errorMessage = NULL;
+
+    CvmStatus status = CVM_OK;
+    if (setjmp(context->errorExit) == 0)
+      {
+        if (!loadSymbols((const char*) contents, length))
+          {
+            context->errorMessage = L"*** Symbol file does not match the program ***";
+            status = CVM_ERROR;
+          }
+      }
+    else
+        status = CVM_ERROR;
+
+    unbindContext(previous);
+    unmapFile(contents, length);
+    return status;
+  }
+
+const wchar_t* cvm_error_message(const CvmContext* context)
+  {
+    return context->errorMessage;
+  }
+
+// End: contexts and the libcvm interface
+// --------------------------------------
@@ -0,0 +1,260 @@
+#include <limits.h>
+#include "vm.h"
+
+
+/**
+ * Memory for the virtual machine.
+ *
+ * On Unix systems, memory is placed at the end of a mapped region and is
+ * followed by a guard page that cannot be read or written.  The engines
+ * push without checking for stack overflow: a push past the end of memory
+ * faults in the guard page, and guardPageHandler() turns the fault into
+ * the runtime error "*** Out of memory ***" of the program that caused it.
+ * Only instructions that move sp by an arbitrary amount (PROGRAM, PROC,
+ * ALLOC) still compare sp with the size of memory.
+ *
+ * Memory past the code segment is cleared lazily: clearMemory() maps
+ * fresh anonymous pages over it, which the system fills with zeros when
+ * they are first touched, so a run only pays for the memory it uses.
+ * Object files are mapped with mmap() and copied into memory in one step.
+ *
+ * On other platforms memory is allocated with calloc() and cleared with
+ * memset(), object files are read with fread(), and a push past the end
+ * of memory is not detected.
+ */
+
+#if defined(__unix__) || defined(__MACH__)
+#define GUARD_PAGES 1
+#include <signal.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#else
+#define GUARD_PAGES 0
+#endif
+
+#if GUARD_PAGES
+
+// the SIGSEGV action that was installed before guardPageHandler()
+struct sigaction previousAction;
+
+// installs guardPageHandler() once, however many threads create contexts
+pthread_once_t guardPageHandlerOnce = PTHREAD_ONCE_INIT;
+
+/**
+ * Handles a fault in the guard page after memory (a stack overflow) as a
+ * runtime error of the program that caused it.  Any other fault is passed
+ * on to the previous handler.
+ */
+void guardPageHandler(int signal, siginfo_t* info, void* ucontext)
+  {
+    CvmContext* context = currentContext;
+    byte* address = (byte*) info->si_addr;
+
+    if (context != NULL && context->mapping != NULL
+          && address >= context->memory + context->memorySize
+          && address <  (byte*) context->mapping + context->mappingLength)
+      {
+        // SA_NODEFER keeps SIGSEGV unblocked after the longjmp
+        error(L"*** Out of memory ***");
+      }
+
+    // not ours: restore the previous action and fault again when we return
+    sigaction(SIGSEGV, &previousAction, NULL);
+  }
+
+/**
+ * Installs guardPageHandler() for SIGSEGV, saving the action it replaces.
+ * Called only through pthread_once(), so that two threads creating their
+ * first contexts at the same time cannot save guardPageHandler() itself as
+ * the previous action, which would turn a foreign fault into an endless
+ * loop instead of a crash.
+ */
+void installGuardPageHandler()
+  {
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_sigaction = guardPageHandler;
+    action.sa_flags     = SA_SIGINFO | SA_NODEFER;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGSEGV, &action, &previousAction);
+  }
+
+#endif
+
+/**
+ * Allocates zeroed memory for the context.  The size of memory need not be
+ * a multiple of the page size; memory ends where the guard page starts.
+ */
+bool allocateMemory(CvmContext* context, size_t memorySize)
+  {
+    if (memorySize == 0 || memorySize > CVM_MAX_MEMORY_SIZE)
+        return false;
+
+    context->memorySize = (int) memorySize;
+
+#if GUARD_PAGES
+    size_t pageSize   = (size_t) sysconf(_SC_PAGESIZE);
+    size_t dataLength = (memorySize + pageSize - 1)/pageSize*pageSize;
+    size_t length     = dataLength + pageSize;
+
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+#if defined(MAP_NORESERVE)
+    flags = flags | MAP_NORESERVE;
+#endif
+
+    byte* region = (byte*) mmap(NULL, length, PROT_READ | PROT_WRITE, flags, -1, 0);
+    if (region == (byte*) MAP_FAILED)
+        return false;
+
+    if (mprotect(region + dataLength, pageSize, PROT_NONE) != 0)
+      {
+        munmap(region, length);
+        return false;
+      }
+
+    pthread_once(&guardPageHandlerOnce, installGuardPageHandler);
+
+    context->mapping       = region;
+    context->mappingLength = length;
+    context->memory        = region + dataLength - memorySize;
+    return true;
+#else
+    context->memory = (byte*) calloc(memorySize, sizeof(byte));
+    return context->memory != NULL;
+#endif
+  }
+
+/**
+ * Frees the memory allocated by allocateMemory().
+ */
+void freeMemory(CvmContext* context)
+  {
+#if GUARD_PAGES
+    if (context->mapping != NULL)
+        munmap(context->mapping, context->mappingLength);
+#else
+    free(context->memory);
+#endif
+  }
+
+/**
+ * Sets memory[from..memorySize-1] to zero.  Whole pages are replaced by
+ * fresh anonymous pages instead of being written.
+ */
+void clearMemory(CvmContext* context, int from)
+  {
+    byte* start = context->memory + from;
+    byte* end   = context->memory + context->memorySize;
+
+#if GUARD_PAGES
+    size_t pageSize  = (size_t) sysconf(_SC_PAGESIZE);
+    byte*  firstPage = (byte*) (((uintptr_t) start + pageSize - 1) & ~(uintptr_t) (pageSize - 1));
+
+    // below this size, writing zeros is faster than remapping
+    if (end - firstPage >= (ptrdiff_t) (16*pageSize))
+      {
+        int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED;
+#if defined(MAP_NORESERVE)
+        flags = flags | MAP_NORESERVE;
+#endif
+        if (mmap(firstPage, end - firstPage, PROT_READ | PROT_WRITE, flags, -1, 0) != MAP_FAILED)
+            end = firstPage;
+      }
+#endif
+
+    memset(start, 0, end - start);
+  }
+
+/**
+ * Maps or reads the file into memory.  Returns NULL if the file cannot be
+ * opened or read; otherwise the contents must be released with unmapFile().
+ */
+const void* mapFile(const char* filename, size_t* length)
+  {
+#if GUARD_PAGES
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+
+    struct stat info;
+    void* contents = NULL;
+    if (fstat(fd, &info) == 0 && S_ISREG(info.st_mode))
+      {
+        *length = (size_t) info.st_size;
+        if (*length == 0)
+            contents = malloc(1);
+        else
+          {
+            contents = mmap(NULL, *length, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (contents == MAP_FAILED)
+                contents = NULL;
+          }
+      }
+
+    close(fd);
+    return contents;
+#else
+    return readFile(filename, length);
+#endif
+  }
+
+/**
+ * Reads the whole file into memory allocated with malloc().  The file is
+ * read until the end rather than sized with ftell(), so that pipes and
+ * other files that cannot seek are read too.  Returns NULL if the file
+ * cannot be opened or read.
+ */
+char* readFile(const char* filename, size_t* length)
+  {
+    FILE* fp = fopen(filename, "rb");
+    if (!fp)
+        return NULL;
+
+    size_t capacity = 4096;
+    char*  buffer   = (char*) malloc(capacity);
+    *length = 0;
+
+    while (buffer != NULL)
+      {
+        size_t bytesRead = fread(buffer + *length, 1, capacity - *length, fp);
+        *length = *length + bytesRead;
+        if (bytesRead == 0)
+            break;
+
+        if (*length == capacity)
+          {
+            capacity = 2*capacity;
+            char* newBuffer = (char*) realloc(buffer, capacity);
+            if (newBuffer == NULL)
+                free(buffer);
+            buffer = newBuffer;
+          }
+      }
+
+    if (buffer != NULL && ferror(fp))
+      {
+        free(buffer);
+        buffer = NULL;
+      }
+
+    fclose(fp);
+    return buffer;
+  }
+
+/**
+ * Releases the contents returned by mapFile().
+ */
+void unmapFile(const void* contents, size_t length)
+  {
+#if GUARD_PAGES
+    if (length == 0)
+        free((void*) contents);
+    else
+        munmap((void*) contents, length);
+#else
+    free((void*) contents);
+#endif
+  }
@@ -0,0 +1,696 @@
+#include "opcode.h"
+#include "vm.h"
+
+
+/**
+ * Profiling of programs (cvm --profile).
+ *
+ * A context created with the profile option runs its programs with
+ * runProfiled(), a copy of the switch engine that counts the instructions
+ * executed at each code address, and the backward branches taken there.
+ * The counts add up over the runs of the loaded program.  The report
+ * derives the counts for each opcode from the counts for each address,
+ * and lists
+ *
+ *   - the opcodes, by number of instructions executed,
+ *   - the instructions, by number of times executed, with their
+ *     disassembly, and
+ *   - the backward branches (loops), by number of times taken.
+ *
+ * A context created with the callGraph option also follows the calls and
+ * returns on a shadow call stack, and records a calling context tree: a
+ * node for each chain of calls from the program to a procedure, with the
+ * instructions executed and the time spent in that procedure itself.
+ * The report then lists the procedures with their inclusive and exclusive
+ * counts and times, and the tree can be written as folded stacks, one
+ * line for each node, for flame graph tools.  Procedures are named by the
+ * labels of a symbol file, if one was loaded (see loadSymbols()).
+ *
+ * The reports are written with wide output, as cvm writes its messages to
+ * standard error.
+ */
+
+#include <time.h>
+
+// longest string operand shown in the disassembly
+#define MAX_SHOWN_CHARS 24
+
+// number of loops listed in the report
+#define MAX_LOOPS 20
+
+/**
+ * A count for an opcode, an instruction, or a loop.
+ */
+typedef struct
+  {
+    int      key;     // opcode or code address
+    uint64_t count;
+  } Count;
+
+/**
+ * Orders counts from largest to smallest, and equal counts by key.
+ */
+int compareCounts(const void* a, const void* b)
+  {
+    const Count* count1 = (const Count*) a;
+    const Count* count2 = (const Count*) b;
+
+    if (count1->count != count2->count)
+        return count1->count > count2->count ? -1 : 1;
+    else
+        return count1->key - count2->key;
+  }
+
+/**
+ * A node of the calling context tree.  Node 0 is the program itself; a
+ * node is always created after its parent.
+ */
+typedef struct
+  {
+    int      procedure;      // code address of the procedure, -1 for the program
+    int      parent;         // node of the caller, -1 for the program
+    int      firstChild;     // nodes of the procedures it called, or -1
+    int      nextSibling;
+    bool     recursive;      // the procedure was already active in a caller
+    uint64_t calls;
+    uint64_t instructions;   // executed in the procedure itself
+    uint64_t nanoseconds;    // spent in the procedure itself
+  } CallNode;
+
+struct CallGraph
+  {
+    CallNode* nodes;
+    int       numNodes;
+    int       nodeCapacity;
+
+    // the shadow call stack: the nodes of the active procedures, the
+    // innermost last, and the calls active for each code address
+    int* stack;
+    int  depth;
+    int  stackCapacity;
+    int* activeCalls;
+
+    // instructions executed and time when the innermost procedure was
+    // last charged
+    uint64_t lastInstructions;
+    uint64_t lastTime;
+  };
+
+/**
+ * A procedure in the report, with the totals over its nodes.
+ */
+typedef struct
+  {
+    int      procedure;
+    uint64_t calls;
+    uint64_t inclusiveInstructions;
+    uint64_t exclusiveInstructions;
+    uint64_t inclusiveNanoseconds;
+    uint64_t exclusiveNanoseconds;
+  } ProcedureTotals;
+
+/**
+ * Returns the wall clock time in nanoseconds.
+ */
+uint64_t nanoseconds()
+  {
+    struct timespec now;
+    timespec_get(&now, TIME_UTC);
+    return (uint64_t) now.tv_sec*1000000000 + now.tv_nsec;
+  }
+
+/**
+ * Calls realloc(), and reports a runtime error if out of memory.
+ */
+void* growArray(void* array, int* capacity, size_t elementSize)
+  {
+    int newCapacity = *capacity > 0 ? 2*(*capacity) : 64;
+    void* newArray = realloc(array, newCapacity*elementSize);
+    if (newArray == NULL)
+        error(L"*** Out of memory ***");
+
+    *capacity = newCapacity;
+    return newArray;
+  }
+
+/**
+ * Frees the labels loaded by loadSymbols().
+ */
+void freeSymbols()
+  {
+    CvmContext* context = currentContext;
+
+    if (context->labels != NULL)
+      {
+        for (int address = 0; address <= sb; ++address)
+            free(context->labels[address]);
+        free(context->labels);
+        context->labels = NULL;
+      }
+  }
+
+void allocateProfile()
+  {
+    CvmContext* context = currentContext;
+
+    context->executionCounts = (uint64_t*) calloc(sb + 1, sizeof(uint64_t));
+    context->branchCounts    = (uint64_t*) calloc(sb + 1, sizeof(uint64_t));
+    if (context->executionCounts == NULL || context->branchCounts == NULL)
+        error(L"*** Out of memory ***");
+
+    if (!context->options.callGraph)
+        return;
+
+    CallGraph* callGraph = (CallGraph*) calloc(1, sizeof(CallGraph));
+    context->callGraph = callGraph;
+    if (callGraph == NULL)
+        error(L"*** Out of memory ***");
+
+    callGraph->activeCalls = (int*) calloc(sb + 1, sizeof(int));
+    if (callGraph->activeCalls == NULL)
+        error(L"*** Out of memory ***");
+
+    callGraph->nodes = (CallNode*) growArray(NULL, &callGraph->nodeCapacity, sizeof(CallNode));
+    callGraph->stack = (int*) growArray(NULL, &callGraph->stackCapacity, sizeof(int));
+
+    CallNode* program = callGraph->nodes;
+    memset(program, 0, sizeof(CallNode));
+    program->procedure   = -1;
+    program->parent      = -1;
+    program->firstChild  = -1;
+    program->nextSibling = -1;
+    program->calls       = 1;
+    callGraph->numNodes  = 1;
+  }
+
+void freeProfile()
+  {
+    CvmContext* context = currentContext;
+
+    free(context->executionCounts);
+    free(context->branchCounts);
+    context->executionCounts = NULL;
+    context->branchCounts    = NULL;
+    context->instructionsExecuted = 0;
+
+    if (context->callGraph != NULL)
+      {
+        free(context->callGraph->nodes);
+        free(context->callGraph->stack);
+        free(context->callGraph->activeCalls);
+        free(context->callGraph);
+        context->callGraph = NULL;
+      }
+
+    freeSymbols();
+  }
+
+/**
+ * Charges the instructions and time since it was last charged to the
+ * innermost active procedure.
+ */
+void chargeProcedure(CallGraph* callGraph)
+  {
+    uint64_t instructions = currentContext->instructionsExecuted;
+    uint64_t time         = nanoseconds();
+
+    CallNode* node = callGraph->nodes + callGraph->stack[callGraph->depth - 1];
+    node->instructions = node->instructions + (instructions - callGraph->lastInstructions);
+    node->nanoseconds  = node->nanoseconds + (time - callGraph->lastTime);
+
+    callGraph->lastInstructions = instructions;
+    callGraph->lastTime         = time;
+  }
+
+void beginCallGraph()
+  {
+    CallGraph* callGraph = currentContext->callGraph;
+
+    callGraph->stack[0] = 0;
+    callGraph->depth    = 1;
+    callGraph->lastInstructions = currentContext->instructionsExecuted;
+    callGraph->lastTime         = nanoseconds();
+  }
+
+void enterProcedure(int address)
+  {
+    CallGraph* callGraph = currentContext->callGraph;
+
+    // a call out of the code segment is recorded as a call to sb
+    if (address < 0 || address > sb)
+        address = sb;
+
+    chargeProcedure(callGraph);
+
+    // find the caller's node for the procedure, or add it
+    int parent = callGraph->stack[callGraph->depth - 1];
+    int child  = callGraph->nodes[parent].firstChild;
+    while (child >= 0 && callGraph->nodes[child].procedure != address)
+        child = callGraph->nodes[child].nextSibling;
+
+    if (child < 0)
+      {
+        if (callGraph->numNodes == callGraph->nodeCapacity)
+            callGraph->nodes = (CallNode*) growArray(callGraph->nodes,
+                &callGraph->nodeCapacity, sizeof(CallNode));
+
+        child = callGraph->numNodes++;
+        CallNode* node = callGraph->nodes + child;
+        memset(node, 0, sizeof(CallNode));
+        node->procedure   = address;
+        node->parent      = parent;
+        node->firstChild  = -1;
+        node->nextSibling = callGraph->nodes[parent].firstChild;
+        node->recursive   = callGraph->activeCalls[address] > 0;
+        callGraph->nodes[parent].firstChild = child;
+      }
+
+    if (callGraph->depth == callGraph->stackCapacity)
+        callGraph->stack = (int*) growArray(callGraph->stack,
+            &callGraph->stackCapacity, sizeof(int));
+
+    ++callGraph->nodes[child].calls;
+    ++callGraph->activeCalls[address];
+    callGraph->stack[callGraph->depth++] = child;
+  }
+
+void exitProcedure()
+  {
+    CallGraph* callGraph = currentContext->callGraph;
+
+    // a run resumed from a snapshot returns from calls it never saw
+    if (callGraph->depth <= 1)
+        return;
+
+    chargeProcedure(callGraph);
+
+    int node = callGraph->stack[--callGraph->depth];
+    --callGraph->activeCalls[callGraph->nodes[node].procedure];
+  }
+
+void endCallGraph()
+  {
+    CallGraph* callGraph = currentContext->callGraph;
+    if (callGraph->depth == 0)
+        return;
+
+    chargeProcedure(callGraph);
+
+    // the procedures still active at HALT or an error end with the run
+    while (callGraph->depth > 1)
+      {
+        int node = callGraph->stack[--callGraph->depth];
+        --callGraph->activeCalls[callGraph->nodes[node].procedure];
+      }
+    callGraph->depth = 0;
+  }
+
+/**
+ * Returns the end of the token that starts at text.
+ */
+const char* endOfToken(const char* text, const char* end)
+  {
+    while (text < end && *text != ' ' && *text != '\t' && *text != '\r' && *text != '\n')
+        ++text;
+    return text;
+  }
+
+/**
+ * Returns the start of the next token at or after text on the same line.
+ */
+const char* startOfToken(const char* text, const char* end)
+  {
+    while (text < end && (*text == ' ' || *text == '\t'))
+        ++text;
+    return text;
+  }
+
+/**
+ * Labels the targets of the calls in the code segment with the operands
+ * of the calls in the assembly listing.  Returns false if they do not
+ * correspond.
+ */
+bool labelCalls(const char* contents, size_t length)
+  {
+    CvmContext* context = currentContext;
+    const char* end = contents + length;
+
+    // The assembler may shorten or drop other instructions, but it emits
+    // every CALL, so the calls in the assembly listing and in the code
+    // segment correspond in order.
+    int address = 0;
+    const char* line = contents;
+    while (line < end)
+      {
+        const char* next = memchr(line, '\n', end - line);
+        next = next != NULL ? next + 1 : end;
+
+        const char* opcode    = startOfToken(line, next);
+        const char* opcodeEnd = endOfToken(opcode, next);
+        if (opcodeEnd - opcode == 4 && memcmp(opcode, "CALL", 4) == 0)
+          {
+            const char* label    = startOfToken(opcodeEnd, next);
+            const char* labelEnd = endOfToken(label, next);
+
+            // find the next CALL in the code segment
+            while (address < sb && memory[address] != CALL)
+              {
+                int length = instructionLength(address);
+                if (length == 0)
+                    return false;
+                address = address + length;
+              }
+
+            if (address >= sb || label == labelEnd)
+                return false;
+
+            int target = address + 1 + 4 + getIntOperandAtAddr(address + 1);
+            if (target >= 0 && target < sb && context->labels[target] == NULL)
+              {
+                char* name = (char*) malloc(labelEnd - label + 1);
+                if (name == NULL)
+                    error(L"*** Out of memory ***");
+
+                memcpy(name, label, labelEnd - label);
+                name[labelEnd - label] = '\0';
+                context->labels[target] = name;
+              }
+
+            address = address + 1 + 4;
+          }
+
+        line = next;
+      }
+
+    // the code segment must not have more calls than the listing
+    while (address < sb && memory[address] != CALL)
+      {
+        int length = instructionLength(address);
+        if (length == 0)
+            return false;
+        address = address + length;
+      }
+
+    return address >= sb;
+  }
+
+bool loadSymbols(const char* contents, size_t length)
+  {
+    CvmContext* context = currentContext;
+
+    freeSymbols();
+    context->labels = (char**) calloc(sb + 1, sizeof(char*));
+    if (context->labels == NULL)
+        error(L"*** Out of memory ***");
+
+    if (!labelCalls(contents, length))
+      {
+        freeSymbols();
+        return false;
+      }
+
+    return true;
+  }
+
+/**
+ * Returns the label of the procedure at the code address, or a name made
+ * up from the address, in buffer, if it has no label.
+ */
+const char* procedureName(int procedure, char* buffer)
+  {
+    CvmContext* context = currentContext;
+
+    if (procedure < 0)
+        return "(program)";
+    else if (context->labels != NULL && context->labels[procedure] != NULL)
+        return context->labels[procedure];
+
+    snprintf(buffer, MAX_NAME_LENGTH, "proc@%d", procedure);
+    return buffer;
+  }
+
+/**
+ * Writes a char of a string operand, escaping anything but printable ASCII.
+ */
+void writeChar(FILE* fp, wchar_t c)
+  {
+    unsigned u = (unsigned) c & 0xFFFF;
+
+    if (u == '"' || u == '\'' || u == '\\')
+        fwprintf(fp, L"\\%lc", (wchar_t) u);
+    else if (u >= 0x20 && u < 0x7F)
+        fwprintf(fp, L"%lc", (wchar_t) u);
+    else if (u == '\n')
+        fwprintf(fp, L"\\n");
+    else
+        fwprintf(fp, L"\\u%04X", u);
+  }
+
+/**
+ * Writes the disassembly of the instruction at the code address, with the
+ * target address of a branch or call.
+ */
+void writeInstruction(FILE* fp, int address)
+  {
+    int opcode = (uint8_t) memory[address];
+    fwprintf(fp, L"%s", toString(opcode));
+
+    if (isByteOperandOpcode(opcode))
+        fwprintf(fp, L" %d", memory[address + 1]);
+    else if (isRelativeJumpOpcode(opcode))
+      {
+        int displacement = getIntOperandAtAddr(address + 1);
+        fwprintf(fp, L" %d (-> %d)", displacement, address + 1 + 4 + displacement);
+      }
+    else if (isIntOperandOpcode(opcode))
+        fwprintf(fp, L" %d", getIntOperandAtAddr(address + 1));
+    else if (opcode == LDCCH)
+      {
+        fwprintf(fp, L" '");
+        writeChar(fp, getCharOperandAtAddr(address + 1));
+        fwprintf(fp, L"'");
+      }
+    else if (opcode == LDCSTR)
+      {
+        int length = getIntOperandAtAddr(address + 1);
+        fwprintf(fp, L" \"");
+        for (int i = 0; i < length && i < MAX_SHOWN_CHARS; ++i)
+            writeChar(fp, getCharAtAddr(address + 1 + 4 + 2*i));
+        fwprintf(fp, length > MAX_SHOWN_CHARS ? L"\"..." : L"\"");
+      }
+  }
+
+/**
+ * Orders procedures by inclusive instructions, from largest to smallest.
+ */
+int compareProcedures(const void* a, const void* b)
+  {
+    const ProcedureTotals* procedure1 = (const ProcedureTotals*) a;
+    const ProcedureTotals* procedure2 = (const ProcedureTotals*) b;
+
+    if (procedure1->inclusiveInstructions != procedure2->inclusiveInstructions)
+        return procedure1->inclusiveInstructions > procedure2->inclusiveInstructions ? -1 : 1;
+    else
+        return procedure1->procedure - procedure2->procedure;
+  }
+
+/**
+ * Writes the calls, and the inclusive and exclusive instructions and time,
+ * of each procedure in the call graph.
+ */
+void writeProcedures(FILE* fp)
+  {
+    CallGraph* callGraph = currentContext->callGraph;
+    int numNodes = callGraph->numNodes;
+
+    // the inclusive totals of each node, summed from the leaves up
+    uint64_t*        inclusiveInstructions = (uint64_t*) malloc(sizeof(uint64_t)*numNodes);
+    uint64_t*        inclusiveNanoseconds  = (uint64_t*) malloc(sizeof(uint64_t)*numNodes);
+    ProcedureTotals* procedures = (ProcedureTotals*) malloc(sizeof(ProcedureTotals)*numNodes);
+    int*             procedureIndex = (int*) malloc(sizeof(int)*(sb + 2));
+    if (inclusiveInstructions == NULL || inclusiveNanoseconds == NULL
+          || procedures == NULL || procedureIndex == NULL)
+      {
+        free(inclusiveInstructions);
+        free(inclusiveNanoseconds);
+        free(procedures);
+        free(procedureIndex);
+        return;
+      }
+
+    for (int i = 0; i < numNodes; ++i)
+      {
+        inclusiveInstructions[i] = callGraph->nodes[i].instructions;
+        inclusiveNanoseconds[i]  = callGraph->nodes[i].nanoseconds;
+      }
+    for (int i = numNodes - 1; i > 0; --i)
+      {
+        int parent = callGraph->nodes[i].parent;
+        inclusiveInstructions[parent] = inclusiveInstructions[parent] + inclusiveInstructions[i];
+        inclusiveNanoseconds[parent]  = inclusiveNanoseconds[parent] + inclusiveNanoseconds[i];
+      }
+
+    // the totals of each procedure; a recursive call is already included
+    // in the inclusive totals of the outermost call
+    int numProcedures = 0;
+    for (int i = 0; i <= sb + 1; ++i)
+        procedureIndex[i] = -1;
+    for (int i = 0; i < numNodes; ++i)
+      {
+        const CallNode* node = callGraph->nodes + i;
+        int* index = procedureIndex + (node->procedure + 1);
+        if (*index < 0)
+          {
+            *index = numProcedures++;
+            memset(procedures + *index, 0, sizeof(ProcedureTotals));
+            procedures[*index].procedure = node->procedure;
+          }
+
+        ProcedureTotals* procedure = procedures + *index;
+        procedure->calls                 = procedure->calls + node->calls;
+        procedure->exclusiveInstructions = procedure->exclusiveInstructions + node->instructions;
+        procedure->exclusiveNanoseconds  = procedure->exclusiveNanoseconds + node->nanoseconds;
+        if (!node->recursive)
+          {
+            procedure->inclusiveInstructions = procedure->inclusiveInstructions + inclusiveInstructions[i];
+            procedure->inclusiveNanoseconds  = procedure->inclusiveNanoseconds + inclusiveNanoseconds[i];
+          }
+      }
+
+    qsort(procedures, numProcedures, sizeof(ProcedureTotals), compareProcedures);
+
+    fwprintf(fp, L"\n%-24s %12s %16s %16s %12s %12s\n", "Procedure", "Calls",
+             "Inclusive", "Exclusive", "Incl. ms", "Excl. ms");
+    for (int i = 0; i < numProcedures; ++i)
+      {
+        char buffer[MAX_NAME_LENGTH];
+        const ProcedureTotals* procedure = procedures + i;
+        fwprintf(fp, L"%-24s %12llu %16llu %16llu %12.3f %12.3f\n",
+                 procedureName(procedure->procedure, buffer),
+                 (unsigned long long) procedure->calls,
+                 (unsigned long long) procedure->inclusiveInstructions,
+                 (unsigned long long) procedure->exclusiveInstructions,
+                 procedure->inclusiveNanoseconds/1000000.0,
+                 procedure->exclusiveNanoseconds/1000000.0);
+      }
+
+    free(inclusiveInstructions);
+    free(inclusiveNanoseconds);
+    free(procedures);
+    free(procedureIndex);
+  }
+
+void writeProfile(FILE* fp)
+  {
+    CvmContext* context = currentContext;
+
+    Count* instructions = (Count*) malloc(sizeof(Count)*(sb + 1));
+    Count* loops        = (Count*) malloc(sizeof(Count)*(sb + 1));
+    Count  opcodes[256];
+    if (instructions == NULL || loops == NULL)
+      {
+        free(instructions);
+        free(loops);
+        return;
+      }
+
+    for (int i = 0; i < 256; ++i)
+      {
+        opcodes[i].key   = i;
+        opcodes[i].count = 0;
+      }
+
+    uint64_t total = 0;
+    int numInstructions = 0;
+    int numLoops = 0;
+    for (int address = 0; address < sb; ++address)
+      {
+        uint64_t count = context->executionCounts[address];
+        if (count > 0)
+          {
+            Count* instruction = instructions + numInstructions++;
+            instruction->key   = address;
+            instruction->count = count;
+
+            opcodes[(uint8_t) memory[address]].count += count;
+            total = total + count;
+          }
+
+        if (context->branchCounts[address] > 0)
+          {
+            Count* loop = loops + numLoops++;
+            loop->key   = address;
+            loop->count = context->branchCounts[address];
+          }
+      }
+
+    qsort(opcodes, 256, sizeof(Count), compareCounts);
+    qsort(instructions, numInstructions, sizeof(Count), compareCounts);
+    qsort(loops, numLoops, sizeof(Count), compareCounts);
+
+    double percent = total > 0 ? 100.0/total : 0.0;
+
+    fwprintf(fp, L"\nProfile: %llu instructions executed\n", (unsigned long long) total);
+
+    fwprintf(fp, L"\n%-10s %16s %8s\n", "Opcode", "Count", "%");
+    for (int i = 0; i < 256 && opcodes[i].count > 0; ++i)
+      {
+        fwprintf(fp, L"%-10s %16llu %8.2f\n", toString(opcodes[i].key),
+                 (unsigned long long) opcodes[i].count, opcodes[i].count*percent);
+      }
+
+    fwprintf(fp, L"\n%7s %16s %8s  %s\n", "Address", "Count", "%", "Instruction");
+    for (int i = 0; i < numInstructions; ++i)
+      {
+        fwprintf(fp, L"%7d %16llu %8.2f  ", instructions[i].key,
+                 (unsigned long long) instructions[i].count, instructions[i].count*percent);
+        writeInstruction(fp, instructions[i].key);
+        fwprintf(fp, L"\n");
+      }
+
+    fwprintf(fp, L"\n%7s %16s  %s\n", "Loop at", "Taken", "Backward branch");
+    for (int i = 0; i < numLoops && i < MAX_LOOPS; ++i)
+      {
+        fwprintf(fp, L"%7d %16llu  ", loops[i].key, (unsigned long long) loops[i].count);
+        writeInstruction(fp, loops[i].key);
+        fwprintf(fp, L"\n");
+      }
+    if (numLoops == 0)
+        fwprintf(fp, L"(none)\n");
+
+    free(instructions);
+    free(loops);
+
+    if (context->callGraph != NULL)
+        writeProcedures(fp);
+  }
+
+void writeCallGraph(FILE* fp)
+  {
+    CallGraph* callGraph = currentContext->callGraph;
+
+    // the nodes on the path from the program to a node, innermost first
+    int* path = (int*) malloc(sizeof(int)*callGraph->numNodes);
+    if (path == NULL)
+        return;
+
+    for (int i = 0; i < callGraph->numNodes; ++i)
+      {
+        if (callGraph->nodes[i].instructions == 0)
+            continue;
+
+        int length = 0;
+        for (int node = i; node >= 0; node = callGraph->nodes[node].parent)
+            path[length++] = node;
+
+        for (int j = length - 1; j >= 0; --j)
+          {
+            char buffer[MAX_NAME_LENGTH];
+            fwprintf(fp, L"%s%s", procedureName(callGraph->nodes[path[j]].procedure, buffer),
+                     j > 0 ? ";" : "");
+          }
+        fwprintf(fp, L" %llu\n", (unsigned long long) callGraph->nodes[i].instructions);
+      }
+
+    free(path);
+  }
@@ -0,0 +1,317 @@
+#include "opcode.h"
+#include "vm.h"
+
+
+/**
+ * Sampling profiler (cvm --sample=HZ).
+ *
+ * A context created with a sample rate runs its programs with an interval
+ * timer that raises SIGPROF at that rate of CPU time.  sampleHandler()
+ * reads the code address in pc and the return addresses of the first few
+ * frames on the dynamic link chain from bp, and adds one to the counts of
+ * that address and of the procedures on the chain.  The counts are
+ * allocated with the program, so the handler only does arithmetic on
+ * memory it owns, which is safe in a signal handler, and a long run is
+ * sampled for as long as it runs.  Sampled runs use the byte code
+ * interpreter, which is the only engine that keeps pc and bp in memory;
+ * by default that is the threaded engine.
+ *
+ * The procedure of a code address is the last call target (or the
+ * program) at or before it.
+ *
+ * The timer is shared by the whole process, so only one context should be
+ * sampled at a time.  On other platforms no samples are taken.
+ */
+
+#if defined(__unix__) || defined(__MACH__)
+#define SAMPLING 1
+#include <signal.h>
+#include <sys/time.h>
+#else
+#define SAMPLING 0
+#endif
+
+// number of return addresses followed for each sample
+#define MAX_SAMPLE_FRAMES 8
+
+struct Samples
+  {
+    // the handler counts samples only while this is true
+    volatile sig_atomic_t active;
+
+    // the instruction and the procedure that contain each code address
+    int* instructionStart;
+    int* procedureStart;
+
+    // the samples counted so far: in all, at each code address, in each
+    // procedure itself, and in each procedure or the ones it called
+    uint64_t  numSamples;
+    uint64_t* pcSamples;
+    uint64_t* selfSamples;
+    uint64_t* totalSamples;
+  };
+
+/**
+ * A procedure or code address in the report.
+ */
+typedef struct
+  {
+    int      key;            // code address of the procedure or instruction
+    uint64_t samples;        // at the address, or in the procedure itself
+    uint64_t totalSamples;   // in the procedure or the ones it called
+  } SampleCount;
+
+#if SAMPLING
+
+// the SIGPROF action that was installed before sampleHandler()
+struct sigaction previousProfAction;
+
+/**
+ * Counts a sample of the context run by the interrupted thread.  Only
+ * reads memory that is within bounds, since the registers may be caught
+ * in the middle of an instruction.
+ */
+void sampleHandler(int signal)
+  {
+    CvmContext* context = currentContext;
+    if (context == NULL || context->samples == NULL || !context->samples->active)
+        return;
+
+    Samples* samples = context->samples;
+    int address = pc;
+    if (address < 0 || address >= sb)
+        return;
+
+    ++samples->numSamples;
+    ++samples->pcSamples[samples->instructionStart[address]];
+
+    int procedure = samples->procedureStart[address];
+    ++samples->selfSamples[procedure];
+
+    // the procedures of the return addresses, down to the frame of the program
+    int procedures[MAX_SAMPLE_FRAMES + 2];
+    int numProcedures = 0;
+    procedures[numProcedures++] = procedure;
+    procedures[numProcedures++] = 0;
+
+    int frame = bp;
+    for (int i = 0; i < MAX_SAMPLE_FRAMES && frame > sb && frame <= numBytesMemory - 8; ++i)
+      {
+        int returnAddress = getIntAtAddr(frame + 4);
+        if (returnAddress >= 0 && returnAddress < sb)
+            procedures[numProcedures++] = samples->procedureStart[returnAddress];
+
+        int dynamicLink = getIntAtAddr(frame);
+        if (dynamicLink >= frame)
+            break;
+        frame = dynamicLink;
+      }
+
+    // each procedure on the stack counts once, however deep it recurs
+    for (int i = 0; i < numProcedures; ++i)
+      {
+        bool counted = false;
+        for (int j = 0; j < i && !counted; ++j)
+            counted = procedures[j] == procedures[i];
+
+        if (!counted)
+            ++samples->totalSamples[procedures[i]];
+      }
+  }
+
+#endif
+
+void allocateSamples()
+  {
+    CvmContext* context = currentContext;
+
+    Samples* samples = (Samples*) calloc(1, sizeof(Samples));
+    context->samples = samples;
+    if (samples == NULL)
+        error(L"*** Out of memory ***");
+
+    samples->instructionStart = (int*) malloc(sizeof(int)*(sb + 1));
+    samples->procedureStart   = (int*) malloc(sizeof(int)*(sb + 1));
+    samples->pcSamples        = (uint64_t*) calloc(sb + 1, sizeof(uint64_t));
+    samples->selfSamples      = (uint64_t*) calloc(sb + 1, sizeof(uint64_t));
+    samples->totalSamples     = (uint64_t*) calloc(sb + 1, sizeof(uint64_t));
+    if (samples->instructionStart == NULL || samples->procedureStart == NULL
+          || samples->pcSamples == NULL || samples->selfSamples == NULL
+          || samples->totalSamples == NULL)
+        error(L"*** Out of memory ***");
+
+    // pc may be past the opcode of the instruction being executed; mark the
+    // call targets, then give each address the last one before it
+    for (int address = 0; address <= sb; ++address)
+      {
+        samples->instructionStart[address] = address;
+        samples->procedureStart[address]   = -1;
+      }
+    samples->procedureStart[0] = 0;
+
+    int address = 0;
+    while (address < sb)
+      {
+        int length = instructionLength(address);
+        if (length == 0)
+            break;
+
+        for (int i = 1; i < length && address + i <= sb; ++i)
+            samples->instructionStart[address + i] = address;
+
+        if (memory[address] == CALL)
+          {
+            int target = address + 1 + 4 + getIntOperandAtAddr(address + 1);
+            if (target > 0 && target < sb)
+                samples->procedureStart[target] = target;
+          }
+        address = address + length;
+      }
+
+    for (int address = 1; address <= sb; ++address)
+      {
+        if (samples->procedureStart[address] < 0)
+            samples->procedureStart[address] = samples->procedureStart[address - 1];
+      }
+  }
+
+void freeSamples()
+  {
+    CvmContext* context = currentContext;
+
+    if (context->samples != NULL)
+      {
+        free(context->samples->instructionStart);
+        free(context->samples->procedureStart);
+        free(context->samples->pcSamples);
+        free(context->samples->selfSamples);
+        free(context->samples->totalSamples);
+        free(context->samples);
+        context->samples = NULL;
+      }
+  }
+
+void beginSampling()
+  {
+#if SAMPLING
+    CvmContext* context = currentContext;
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = sampleHandler;
+    action.sa_flags   = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGPROF, &action, &previousProfAction);
+
+    long interval = 1000000L/context->options.sampleRate;
+    struct itimerval timer;
+    timer.it_interval.tv_sec  = interval/1000000;
+    timer.it_interval.tv_usec = interval > 0 ? interval%1000000 : 1;
+    timer.it_value            = timer.it_interval;
+
+    context->samples->active = true;
+    setitimer(ITIMER_PROF, &timer, NULL);
+#endif
+  }
+
+void endSampling()
+  {
+    Samples* samples = currentContext->samples;
+
+#if SAMPLING
+    if (samples->active)
+      {
+        struct itimerval timer;
+        memset(&timer, 0, sizeof(timer));
+        setitimer(ITIMER_PROF, &timer, NULL);
+        sigaction(SIGPROF, &previousProfAction, NULL);
+      }
+#endif
+
+    samples->active = false;
+  }
+
+/**
+ * Orders sample counts from most to fewest, then by total, then by key.
+ */
+int compareSampleCounts(const void* a, const void* b)
+  {
+    const SampleCount* count1 = (const SampleCount*) a;
+    const SampleCount* count2 = (const SampleCount*) b;
+
+    if (count1->samples != count2->samples)
+        return count1->samples > count2->samples ? -1 : 1;
+    else if (count1->totalSamples != count2->totalSamples)
+        return count1->totalSamples > count2->totalSamples ? -1 : 1;
+    else
+        return count1->key - count2->key;
+  }
+
+void writeSamples(FILE* fp)
+  {
+    CvmContext* context = currentContext;
+    Samples* samples = context->samples;
+
+    SampleCount* procedures = (SampleCount*) malloc(sizeof(SampleCount)*(sb + 1));
+    SampleCount* addresses  = (SampleCount*) malloc(sizeof(SampleCount)*(sb + 1));
+    if (procedures == NULL || addresses == NULL)
+      {
+        free(procedures);
+        free(addresses);
+        return;
+      }
+
+    int numProcedures = 0;
+    int numAddresses  = 0;
+    for (int address = 0; address < sb; ++address)
+      {
+        if (samples->totalSamples[address] > 0)
+          {
+            SampleCount* procedure = procedures + numProcedures++;
+            procedure->key          = address;
+            procedure->samples      = samples->selfSamples[address];
+            procedure->totalSamples = samples->totalSamples[address];
+          }
+
+        if (samples->pcSamples[address] > 0)
+          {
+            SampleCount* instruction = addresses + numAddresses++;
+            instruction->key          = address;
+            instruction->samples      = samples->pcSamples[address];
+            instruction->totalSamples = 0;
+          }
+      }
+
+    qsort(procedures, numProcedures, sizeof(SampleCount), compareSampleCounts);
+    qsort(addresses, numAddresses, sizeof(SampleCount), compareSampleCounts);
+
+    double percent = samples->numSamples > 0 ? 100.0/samples->numSamples : 0.0;
+
+    fwprintf(fp, L"\nSamples: %llu at %d Hz of CPU time",
+             (unsigned long long) samples->numSamples, context->options.sampleRate);
+    fwprintf(fp, L"\n");
+
+    fwprintf(fp, L"\n%-24s %12s %8s %12s %8s\n", "Procedure", "Self", "%", "Total", "%");
+    for (int i = 0; i < numProcedures; ++i)
+      {
+        // the code at address 0 belongs to the program
+        char name[MAX_NAME_LENGTH];
+        const SampleCount* procedure = procedures + i;
+        fwprintf(fp, L"%-24s %12llu %8.2f %12llu %8.2f\n",
+                 procedureName(procedure->key > 0 ? procedure->key : -1, name),
+                 (unsigned long long) procedure->samples, procedure->samples*percent,
+                 (unsigned long long) procedure->totalSamples, procedure->totalSamples*percent);
+      }
+
+    fwprintf(fp, L"\n%7s %12s %8s  %s\n", "Address", "Samples", "%", "Instruction");
+    for (int i = 0; i < numAddresses; ++i)
+      {
+        fwprintf(fp, L"%7d %12llu %8.2f  ", addresses[i].key,
+                 (unsigned long long) addresses[i].samples, addresses[i].samples*percent);
+        writeInstruction(fp, addresses[i].key);
+        fwprintf(fp, L"\n");
+      }
+
+    free(procedures);
+    free(addresses);
+  }
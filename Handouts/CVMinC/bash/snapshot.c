@@ -0,0 +1,161 @@
+#include "opcode.h"
+#include "vm.h"
+
+
+/**
+ * Snapshots of a running program (cvm --snapshot-at) and restoring them
+ * (cvm --restore).
+ *
+ * A snapshot is taken when the program is about to execute the
+ * instruction at a given code address, or its first input instruction.
+ * Before the run, insertTraps() saves the code segment and replaces the
+ * opcode of each such instruction with TRAP; run() executes TRAP by
+ * calling takeSnapshot(), which puts the code back, writes the image, and
+ * lets the run continue at the same instruction.  A run that takes a
+ * snapshot therefore costs nothing extra per instruction, but it always
+ * uses run(), since the other engines translated the code before the
+ * traps were inserted.
+ *
+ * An image holds an ImageHeader followed by memory[0..sp]: the code
+ * segment (with operands already in host byte order, see convertOperands())
+ * and the stack.  Memory above sp is zero when the image is restored.
+ * Images can only be restored on a host with the same byte order and by
+ * a libcvm built with the same data byte order (see NATIVE_DATA).
+ */
+
+// identifies an image file and its version
+const char IMAGE_MAGIC[8] = { 'C', 'V', 'M', 'I', 'M', 'G', '0', '1' };
+
+// written in host byte order, so that a different byte order is detected
+#define IMAGE_BYTE_ORDER 0x01020304
+
+typedef struct
+  {
+    char    magic[8];
+    int32_t byteOrder;
+    int32_t nativeData;
+    int32_t pc;
+    int32_t bp;
+    int32_t sp;
+    int32_t sb;
+  } ImageHeader;
+
+/**
+ * Saves the code segment and replaces the opcode at the snapshot address
+ * (or of every input instruction) with TRAP.  Reports an error if the
+ * snapshot address is not the start of an instruction.
+ */
+void insertTraps()
+  {
+    CvmContext* context = currentContext;
+
+    context->savedCode = (byte*) malloc(sb > 0 ? sb : 1);
+    if (context->savedCode == NULL)
+        error(L"*** Out of memory ***");
+    memcpy(context->savedCode, memory, sb);
+
+    bool found = false;
+    int address = 0;
+    while (address < sb)
+      {
+        int opcode = memory[address];
+        int length = instructionLength(address);
+        if (length == 0)
+            break;
+
+        if (context->snapshotAddress == CVM_FIRST_INPUT
+              ? (opcode == GETCH || opcode == GETINT || opcode == GETSTR)
+              : address == context->snapshotAddress)
+          {
+            memory[address] = TRAP;
+            found = true;
+          }
+
+        address = address + length;
+      }
+
+    if (!found && context->snapshotAddress != CVM_FIRST_INPUT)
+        error(L"*** Invalid snapshot address ***");
+  }
+
+/**
+ * Puts the saved code segment back, if traps were inserted.
+ */
+void removeTraps()
+  {
+    CvmContext* context = currentContext;
+
+    if (context->savedCode != NULL)
+      {
+        memcpy(memory, context->savedCode, sb);
+        free(context->savedCode);
+        context->savedCode = NULL;
+      }
+  }
+
+/**
+ * Executes TRAP: writes the image for the instruction whose opcode was
+ * just fetched and sets pc back to it.
+ */
+void takeSnapshot()
+  {
+    CvmContext* context = currentContext;
+
+    if (context->savedCode == NULL)
+        error(L"invalid machine instruction");
+
+    pc = pc - 1;
+    removeTraps();
+
+    FILE* fp = fopen(context->snapshotFile, "wb");
+    if (!fp)
+        error(L"*** Error writing snapshot ***");
+
+    ImageHeader header;
+    memcpy(header.magic, IMAGE_MAGIC, sizeof(header.magic));
+    header.byteOrder  = IMAGE_BYTE_ORDER;
+    header.nativeData = NATIVE_DATA;
+    header.pc = pc;
+    header.bp = bp;
+    header.sp = sp;
+    header.sb = sb;
+
+    size_t length = (size_t) (sp + 1);
+    bool written = fwrite(&header, sizeof(header), 1, fp) == 1
+                && fwrite(memory, 1, length, fp) == length;
+    if (fclose(fp) != 0 || !written)
+        error(L"*** Error writing snapshot ***");
+  }
+
+/**
+ * Loads the image in contents into memory and the registers.  Reports an
+ * error if it is not a valid image for this machine.
+ */
+void restoreImage(const void* contents, size_t length)
+  {
+    ImageHeader header;
+    if (length < sizeof(header))
+        error(L"*** Invalid snapshot image ***");
+    memcpy(&header, contents, sizeof(header));
+
+    size_t memoryLength = length - sizeof(header);
+    if (memcmp(header.magic, IMAGE_MAGIC, sizeof(header.magic)) != 0
+          || header.byteOrder != IMAGE_BYTE_ORDER
+          || header.nativeData != NATIVE_DATA
+          || header.sp < 0 || memoryLength != (size_t) header.sp + 1
+          || header.sb < 0 || header.sb > header.sp + 1
+          || header.pc < 0 || header.pc >= header.sb
+          || header.bp < 0 || header.bp > header.sp + 1)
+        error(L"*** Invalid snapshot image ***");
+
+    if (memoryLength > (size_t) numBytesMemory)
+        error(L"*** Out of memory ***");
+
+    memcpy(memory, (const byte*) contents + sizeof(header), memoryLength);
+    clearMemory(currentContext, (int) memoryLength);
+
+    pc = header.pc;
+    bp = header.bp;
+    sp = header.sp;
+    sb = header.sb;
+  }
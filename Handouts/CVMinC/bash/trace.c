@@ -0,0 +1,100 @@
+#include "opcode.h"
+#include "vm.h"
+
+
+/**
+ * Execution traces (cvm --trace=FILE).
+ *
+ * A context with a trace file runs its programs with runTraced(), a copy
+ * of the switch engine that records each instruction before executing it,
+ * so the other engines have no tracing code at all.  The records are
+ * collected in a large buffer and written to the file when it is full and
+ * at the end of each run.
+ *
+ * A trace file starts with the 8 bytes TRACE_MAGIC, followed by one record
+ * of TRACE_RECORD_SIZE bytes for each instruction executed: its code
+ * address (pc), the stack pointer (sp), and the int on top of the stack
+ * (0 if the stack holds less than an int), each as 4 bytes in
+ * little-endian order, and then the opcode as 1 byte.  cvmtrace prints
+ * a trace as text.
+ */
+
+/**
+ * Stores the int at record in little-endian byte order.
+ */
+void traceInt(byte* record, int n)
+  {
+    unsigned u = (unsigned) n;
+    record[0] = (byte) (u & 0xFF);
+    record[1] = (byte) ((u >> 8) & 0xFF);
+    record[2] = (byte) ((u >> 16) & 0xFF);
+    record[3] = (byte) ((u >> 24) & 0xFF);
+  }
+
+bool openTrace(const char* filename)
+  {
+    CvmContext* context = currentContext;
+
+    closeTrace();
+    if (filename == NULL)
+        return true;
+
+    context->traceBuffer = (byte*) malloc(TRACE_BUFFER_SIZE);
+    if (context->traceBuffer == NULL)
+        error(L"*** Out of memory ***");
+
+    context->traceFile = fopen(filename, "wb");
+    if (context->traceFile == NULL)
+      {
+        closeTrace();
+        return false;
+      }
+
+    memcpy(context->traceBuffer, TRACE_MAGIC, 8);
+    context->traceLength = 8;
+    return true;
+  }
+
+bool flushTrace()
+  {
+    CvmContext* context = currentContext;
+
+    size_t length = context->traceLength;
+    context->traceLength = 0;
+    return fwrite(context->traceBuffer, 1, length, context->traceFile) == length
+        && fflush(context->traceFile) == 0;
+  }
+
+void closeTrace()
+  {
+    CvmContext* context = currentContext;
+
+    if (context->traceFile != NULL)
+      {
+        flushTrace();
+        fclose(context->traceFile);
+      }
+    free(context->traceBuffer);
+
+    context->traceFile   = NULL;
+    context->traceBuffer = NULL;
+    context->traceLength = 0;
+  }
+
+void traceInstruction(int address, int opcode)
+  {
+    CvmContext* context = currentContext;
+
+    if (context->traceLength + TRACE_RECORD_SIZE > TRACE_BUFFER_SIZE && !flushTrace())
+        error(L"*** Error writing trace ***");
+
+    // the top of the stack is only an int once the stack holds one
+    int top = (sp >= sb + 3 && sp < numBytesMemory) ? getIntAtAddr(sp - 3) : 0;
+
+    byte* record = context->traceBuffer + context->traceLength;
+    traceInt(record, address);
+    traceInt(record + 4, sp);
+    traceInt(record + 8, top);
+    record[12] = (byte) opcode;
+    context->traceLength = context->traceLength + TRACE_RECORD_SIZE;
+  }
@@ -0,0 +1,443 @@
+#include <limits.h>
+#include "opcode.h"
+#include "vm.h"
+
+
+/**
+ * A verifier for object code, run by loadProgram() before the program is
+ * translated for the selected engine.
+ *
+ * Starting from address 0 and from the PROC instruction at the target of
+ * each CALL, the verifier follows every path through the code and checks
+ * that
+ *
+ *   - each instruction reached has a valid opcode (see opcode.c) and lies
+ *     entirely within the code segment,
+ *   - each branch and call target is the start of an instruction,
+ *   - no procedure is entered by falling or branching into it from
+ *     another procedure, and PROC only appears at the start of one,
+ *   - all returns from a procedure remove the same number of bytes of
+ *     parameters, and
+ *   - the depth of the stack is the same on every path to an instruction,
+ *     and never drops below the depth at entry to the procedure.
+ *
+ * For a verified program, context->stackGrowth records at the address of
+ * each PROC the largest number of bytes that the procedure can push after
+ * that instruction, and the same for the code at address 0 (after PROGRAM,
+ * if it starts with one).  This counts the 8 bytes pushed by each CALL,
+ * and everything pushed by called procedures that have no PROC (the
+ * compiler omits PROC for procedures without local variables), since they
+ * cannot check for themselves.  PROC and PROGRAM, or cvm_run() for code
+ * without PROGRAM, check that all of it fits in memory.  The stack
+ * effects are those of the engines, including PUTSTR n popping only n
+ * bytes, so a procedure that writes strings in a loop has a different
+ * depth on each path to the loop and is not verified.  On platforms with
+ * a guard page after memory (see memory.c), a push past the end is also
+ * reported; elsewhere only these frame checks catch an overflow.
+ *
+ * Recursion among procedures without PROC cannot be bounded, so such
+ * programs are not verified.
+ *
+ * A program that fails verification is still run; its stack is checked
+ * as it grows, as before.
+ */
+
+// marks an address that has not been reached
+#define UNREACHED (-1)
+
+// stack depths beyond this are rejected so that sums cannot overflow
+#define MAX_DEPTH (INT_MAX/4)
+
+// states of a procedure in the second pass
+enum { NOT_VISITED, IN_PROGRESS, VISITED };
+
+/**
+ * The state of the verifier.  The arrays are indexed by code address.
+ */
+typedef struct
+  {
+    bool* isStart;       // true at the start of each instruction
+    int*  owner;         // entry address of the procedure of each instruction
+    int*  depth;         // depth of the stack before each instruction
+    int*  paramLength;   // bytes removed by the returns of each procedure
+    int*  maxDepth;      // largest depth reached by each procedure
+    byte* state;         // NOT_VISITED, IN_PROGRESS, or VISITED for each procedure
+    int*  worklist;
+    int   numWork;
+  } Verifier;
+
+/**
+ * Returns the target address of the branch or call at the address.
+ */
+int jumpTarget(int address)
+  {
+    return address + 1 + 4 + getIntOperandAtAddr(address + 1);
+  }
+
+/**
+ * Returns the number of bytes of parameters removed by the return
+ * instruction at the address.
+ */
+int returnLength(int address)
+  {
+    switch (memory[address])
+      {
+        case RET0: return 0;
+        case RET4: return 4;
+        default:   return getIntOperandAtAddr(address + 1);
+      }
+  }
+
+/**
+ * Returns the change in the depth of the stack made by the instruction at
+ * the address.  Instructions that set the depth (PROGRAM), end a path
+ * (HALT and returns), or depend on another procedure (CALL) are handled
+ * by the caller.  Sets *valid to false for an invalid operand.
+ */
+long long stackEffect(int address, bool* valid)
+  {
+    int opcode = memory[address];
+    long long n = isIntOperandOpcode(opcode) || opcode == LDCSTR
+                ? getIntOperandAtAddr(address + 1) : 0;
+
+    switch (opcode)
+      {
+        case LOAD:
+        case STORE:
+        case PUTSTR:
+            if (n < 0)
+                *valid = false;
+            break;
+      }
+
+    switch (opcode)
+      {
+        case LOAD:     return n - 4;
+        case LOADB:    return 1 - 4;
+        case LOAD2B:   return 2 - 4;
+        case LOADW:    return 0;
+        case LDCB:     return 1;
+        case LDCCH:    return 2;
+        case LDCINT:   return 4;
+        case LDCSTR:   return 4 + 2*n;
+        case LDLADDR:  return 4;
+        case LDGADDR:  return 4;
+        case LDCB0:    return 1;
+        case LDCB1:    return 1;
+        case LDCINT0:  return 4;
+        case LDCINT1:  return 4;
+        case STORE:    return -(n + 4);
+        case STOREB:   return -(1 + 4);
+        case STORE2B:  return -(2 + 4);
+        case STOREW:   return -(4 + 4);
+        case BR:       return 0;
+        case BE:
+        case BNE:
+        case BG:
+        case BGE:
+        case BL:
+        case BLE:      return -8;
+        case BZ:
+        case BNZ:      return -1;
+        case INT2BYTE: return 1 - 4;
+        case BYTE2INT: return 4 - 1;
+        case NOT:      return 0;
+        case BITAND:
+        case BITOR:
+        case BITXOR:
+        case SHL:
+        case SHR:      return -4;
+        case BITNOT:   return 0;
+        case ADD:
+        case SUB:
+        case MUL:
+        case DIV:
+        case MOD:      return -4;
+        case NEG:
+        case INC:
+        case DEC:      return 0;
+        case GETCH:
+        case GETINT:
+        case GETSTR:   return -4;
+        case PUTBYTE:  return -1;
+        case PUTCH:    return -2;
+        case PUTINT:   return -4;
+        case PUTEOL:   return 0;
+        // PUTSTR n pops only n bytes of the 4 + 2n it writes, as
+        // writeString() does in every engine
+        case PUTSTR:   return -n;
+        case PROC:
+        case ALLOC:    return n;
+        default:       return 0;
+      }
+  }
+
+/**
+ * Adds a successor of the instruction at address to the worklist, or
+ * checks that it belongs to the same procedure if it was reached before.
+ * Returns false if the program is not valid.
+ */
+bool reach(Verifier* v, int address, int successor)
+  {
+    if (successor < 0 || successor >= sb || !v->isStart[successor])
+        return false;
+
+    if (v->owner[successor] == UNREACHED)
+      {
+        v->owner[successor] = v->owner[address];
+        v->worklist[v->numWork++] = successor;
+        return true;
+      }
+
+    return v->owner[successor] == v->owner[address];
+  }
+
+/**
+ * Finds the procedures of the program and the instructions of each one,
+ * starting from address 0.  Returns false if the program is not valid.
+ */
+bool findProcedures(Verifier* v)
+  {
+    v->owner[0] = 0;
+    v->worklist[v->numWork++] = 0;
+
+    while (v->numWork > 0)
+      {
+        int address = v->worklist[--v->numWork];
+        int opcode  = memory[address];
+        int next    = address + instructionLength(address);
+        int entry   = v->owner[address];
+
+        if ((opcode == PROGRAM || opcode == PROC) && address != entry)
+            return false;
+
+        switch (opcode)
+          {
+            case HALT:
+                break;
+
+            case RET:
+            case RET0:
+            case RET4:
+                if (v->paramLength[entry] == UNREACHED)
+                    v->paramLength[entry] = returnLength(address);
+                else if (v->paramLength[entry] != returnLength(address))
+                    return false;
+                break;
+
+            case BR:
+                if (!reach(v, address, jumpTarget(address)))
+                    return false;
+                break;
+
+            case CALL:
+              {
+                int target = jumpTarget(address);
+                if (target < 0 || target >= sb || !v->isStart[target])
+                    return false;
+
+                if (v->owner[target] == UNREACHED)
+                  {
+                    v->owner[target] = target;
+                    v->worklist[v->numWork++] = target;
+                  }
+                else if (v->owner[target] != target)
+                    return false;
+
+                if (!reach(v, address, next))
+                    return false;
+                break;
+              }
+
+            default:
+                if (isRelativeJumpOpcode(opcode) && !reach(v, address, jumpTarget(address)))
+                    return false;
+                if (!reach(v, address, next))
+                    return false;
+                break;
+          }
+      }
+
+    return true;
+  }
+
+/**
+ * Follows the depth of the stack through the procedure that starts at
+ * entry and records the largest depth it reaches in v->maxDepth[entry].
+ * Called procedures without PROC are followed first.  Returns false if
+ * the program is not valid or the depth cannot be bounded.
+ */
+bool followStack(Verifier* v, int entry)
+  {
+    if (v->state[entry] == VISITED)
+        return true;
+    else if (v->state[entry] == IN_PROGRESS)
+        return false;   // recursion without PROC
+
+    v->state[entry] = IN_PROGRESS;
+
+    // procedures called from here use the worklist above this point
+    int base = v->numWork;
+    long long maxDepth = 0;
+
+    v->depth[entry] = 0;
+    v->worklist[v->numWork++] = entry;
+
+    while (v->numWork > base)
+      {
+        int address = v->worklist[--v->numWork];
+        int opcode  = memory[address];
+        int next    = address + instructionLength(address);
+        long long before = v->depth[address];
+        long long after;
+        long long peak;
+        bool valid = true;
+
+        if (opcode == HALT || opcode == RET || opcode == RET0 || opcode == RET4)
+            continue;
+        else if (opcode == PROGRAM)
+          {
+            after = getIntOperandAtAddr(address + 1);
+            peak  = after;
+          }
+        else if (opcode == CALL)
+          {
+            int target = jumpTarget(address);
+            peak = before + 8;
+
+            if (memory[target] != PROC)
+              {
+                if (!followStack(v, target))
+                    return false;
+                peak = peak + v->maxDepth[target];
+              }
+
+            if (v->paramLength[target] == UNREACHED)
+                after = -1;   // the procedure never returns
+            else
+                after = before - v->paramLength[target];
+          }
+        else
+          {
+            after = before + stackEffect(address, &valid);
+            peak  = after > before ? after : before;
+          }
+
+        if (!valid || peak > MAX_DEPTH)
+            return false;
+
+        if (peak > maxDepth)
+            maxDepth = peak;
+
+        if (opcode == CALL && after == -1)
+            continue;
+        else if (after < 0)
+            return false;
+
+        // successors in the same procedure
+        int successors[2];
+        int numSuccessors = 0;
+
+        if (opcode == BR)
+            successors[numSuccessors++] = jumpTarget(address);
+        else
+          {
+            if (isRelativeJumpOpcode(opcode) && opcode != CALL)
+                successors[numSuccessors++] = jumpTarget(address);
+            successors[numSuccessors++] = next;
+          }
+
+        for (int i = 0; i < numSuccessors; ++i)
+          {
+            int successor = successors[i];
+            if (v->depth[successor] == UNREACHED)
+              {
+                v->depth[successor] = (int) after;
+                v->worklist[v->numWork++] = successor;
+              }
+            else if (v->depth[successor] != after)
+                return false;
+          }
+      }
+
+    v->maxDepth[entry] = (int) maxDepth;
+    v->state[entry] = VISITED;
+    return true;
+  }
+
+/**
+ * Verifies the program in memory[0..sb-1] (after convertOperands()) and
+ * records the stack growth of each procedure in the current context.
+ * Returns false if the program could not be verified.
+ */
+bool verifyProgram()
+  {
+    Verifier v;
+    v.isStart     = (bool*) calloc(sb + 1, sizeof(bool));
+    v.owner       = (int*) malloc(sizeof(int)*(sb + 1));
+    v.depth       = (int*) malloc(sizeof(int)*(sb + 1));
+    v.paramLength = (int*) malloc(sizeof(int)*(sb + 1));
+    v.maxDepth    = (int*) calloc(sb + 1, sizeof(int));
+    v.state       = (byte*) calloc(sb + 1, sizeof(byte));
+    v.worklist    = (int*) malloc(sizeof(int)*(sb + 1));
+    v.numWork     = 0;
+
+    bool verified = v.isStart != NULL && v.owner != NULL && v.depth != NULL
+                 && v.paramLength != NULL && v.maxDepth != NULL && v.state != NULL
+                 && v.worklist != NULL && sb > 0;
+
+    if (verified)
+      {
+        // find the start of each instruction
+        int address = 0;
+        while (address < sb)
+          {
+            int length = instructionLength(address);
+            if (length == 0 || address + length > sb)
+                break;
+
+            v.isStart[address] = true;
+            address = address + length;
+          }
+
+        for (int i = 0; i <= sb; ++i)
+          {
+            v.owner[i]       = UNREACHED;
+            v.depth[i]       = UNREACHED;
+            v.paramLength[i] = UNREACHED;
+          }
+
+        verified = v.isStart[0] && findProcedures(&v);
+      }
+
+    // follow the stack through every procedure (the entry of each
+    // procedure is its own owner)
+    for (int address = 0; verified && address < sb; ++address)
+      {
+        if (v.owner[address] == address)
+            verified = followStack(&v, address);
+      }
+
+    if (verified)
+      {
+        // the growth after the PROGRAM or PROC instruction itself
+        for (int address = 0; address < sb; ++address)
+          {
+            int opcode = memory[address];
+            if (v.owner[address] == address && (opcode == PROC || opcode == PROGRAM))
+                v.maxDepth[address] = v.maxDepth[address] - getIntOperandAtAddr(address + 1);
+          }
+
+        currentContext->stackGrowth = v.maxDepth;
+      }
+    else
+        free(v.maxDepth);
+
+    free(v.isStart);
+    free(v.owner);
+    free(v.depth);
+    free(v.paramLength);
+    free(v.state);
+    free(v.worklist);
+    return verified;
+  }
@@ -0,0 +1,529 @@
+#ifndef VM_H
+#define VM_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <wchar.h>
+#include <stdbool.h>
+#include <setjmp.h>
+#include "cvm.h"
+
+// Declarations shared by the source files that make up libcvm (libcvm.c
+// and the just-in-time compiler in jit.c).
+
+typedef int8_t byte;    // analogous to type byte in Java
+
+// Ints and chars in data memory (the stack and variables) are stored in
+// big-endian byte order, the same as in the object file.  Compile with
+// -DCVM_NATIVE_DATA to store them in host byte order instead, so that each
+// access is a single load or store.  CPRL code never reads the individual
+// bytes of an int or char, so programs behave the same in either mode.
+#if defined(CVM_NATIVE_DATA)
+#define NATIVE_DATA 1
+#else
+#define NATIVE_DATA 0
+#endif
+
+// storage class for the state of the context run by the current thread
+#if defined(_MSC_VER)
+#define THREAD_LOCAL __declspec(thread)
+#else
+#define THREAD_LOCAL _Thread_local
+#endif
+
+// opcode that run() executes to take a snapshot (see snapshot.c); it is
+// not part of the instruction set and is never in a loaded program
+#define TRAP 127
+
+// default memory size (in bytes) for the virtual machine
+#define NUM_BYTES_MEMORY 8192    // 8*K
+
+// size of the buffer for the name of a procedure without a label (see procedureName())
+#define MAX_NAME_LENGTH 24
+
+// size (in bytes) of the trace buffer of a context, the size of a trace
+// record, and the bytes at the start of a trace file (see trace.c)
+#define TRACE_BUFFER_SIZE 4194304    // 4*M
+#define TRACE_RECORD_SIZE 13
+#define TRACE_MAGIC       "CVMTRACE"
+
+// sizes (in bytes) of the input and output buffers of a context (see io.c)
+#define INPUT_BUFFER_SIZE  65536    // 64*K
+#define OUTPUT_BUFFER_SIZE 65536    // 64*K
+
+typedef struct Instruction Instruction;
+typedef struct CachedInstruction CachedInstruction;
+typedef struct CallGraph CallGraph;
+typedef struct Samples Samples;
+typedef struct Counters Counters;
+
+/**
+ * Executes a decoded instruction and returns the next instruction to be
+ * executed, or NULL if the program has halted.
+ */
+typedef const Instruction* (*Handler)(const Instruction* inst);
+
+/**
+ * An instruction translated by the predecoder (see predecodeProgram()).
+ */
+struct Instruction
+  {
+    Handler handler;
+    const void* label;           // address of the code that runs it (threaded dispatch)
+    int     address;             // code address of the instruction
+    int     operand;             // byte, char, or int operand in native form
+    int     operand2;            // second operand of a superinstruction
+    int     length;              // number of instructions covered (1 unless fused)
+    const Instruction* target;   // decoded target of a branch or call
+  };
+
+/**
+ * A virtual machine with a loaded program.  While a context is being
+ * loaded or run, its registers and tables are bound to the thread-local
+ * variables below, which the execution engines use directly.
+ */
+struct CvmContext
+  {
+    CvmOptions options;
+    CvmIO      io;
+
+    // input read ahead, from inputPosition to inputLength, and whether
+    // read() has reported the end of the input (see io.c)
+    char*  input;
+    size_t inputPosition;
+    size_t inputLength;
+    bool   inputEnd;
+
+    // output encoded as UTF-8 and not yet written, and the high surrogate
+    // of a pair whose low surrogate is still to come (see io.c)
+    char*    output;
+    size_t   outputLength;
+    unsigned highSurrogate;
+
+    byte*  memory;
+    int    memorySize;      // bytes of memory, not counting the guard page
+    void*  mapping;         // the region that holds memory and the guard page
+    size_t mappingLength;
+    int    pc;
+    int    bp;
+    int    sp;
+    int    sb;
+    bool   running;
+
+    // the program translated for the selected engine
+    bool loaded;
+    bool cleared;   // memory past sb is all zeros
+    bool verified;
+    bool predecoded;
+    bool cached;
+    bool jitted;
+
+    Instruction* decodedCode;
+    int          numDecodedInstructions;
+    int*         instructionIndex;
+
+    CachedInstruction* cachedCode;
+    int                numCachedInstructions;
+    int*               cachedIndex;
+
+    // a snapshot to be taken by the next run, and the code segment that
+    // the traps for it replaced (see snapshot.c)
+    char* snapshotFile;
+    int   snapshotAddress;
+    byte* savedCode;
+
+    // the next run continues from a restored image at resumeAddress
+    bool resume;
+    int  resumeAddress;
+
+    // stack growth of each procedure, by address of PROGRAM or PROC (see verify.c)
+    int* stackGrowth;
+
+    // instructions executed and backward branches taken at each code
+    // address, while profiling (see profile.c)
+    uint64_t* executionCounts;
+    uint64_t* branchCounts;
+    uint64_t  instructionsExecuted;
+
+    // the calls between procedures, while recording the call graph, and
+    // the name of the procedure at each code address, from a symbol file
+    // (see profile.c)
+    CallGraph* callGraph;
+    char**     labels;
+
+    // the samples taken while running with a sample rate (see sample.c)
+    Samples*   samples;
+
+    // the performance counters of the runs, while counting (see counters.c)
+    Counters* counters;
+
+    // the file that runs write their trace to, and the records not yet
+    // written (see trace.c)
+    FILE*  traceFile;
+    byte*  traceBuffer;
+    size_t traceLength;
+
+    // UTF-8 text of the string literals written by LDCSTR n; PUTSTR n
+    // (see encodeLiterals())
+    char* literals;
+
+    void*  jitCode;
+    size_t jitCapacity;
+    void** nativeAddress;
+
+    // where error() continues, and what it reported
+    jmp_buf        errorExit;
+    const wchar_t* errorMessage;
+  };
+
+// the context being loaded or run by this thread
+extern THREAD_LOCAL CvmContext* currentContext;
+
+// computer memory (for the virtual CPRL machine)
+extern THREAD_LOCAL byte* memory;
+
+// number of bytes of memory in the current context
+extern THREAD_LOCAL int numBytesMemory;
+
+// registers: program counter, base pointer, stack pointer, bottom of the stack
+extern THREAD_LOCAL int pc;
+extern THREAD_LOCAL int bp;
+extern THREAD_LOCAL int sp;
+extern THREAD_LOCAL int sb;
+
+// true if the virtual computer is currently running
+extern THREAD_LOCAL bool running;
+
+// the decoded program, followed by an entry that marks the end of the code
+extern THREAD_LOCAL Instruction* decodedCode;
+
+// number of decoded instructions, not counting the end marker
+extern THREAD_LOCAL int numDecodedInstructions;
+
+/**
+ * Reports a runtime error: records the message in the current context and
+ * returns from cvm_run() (or cvm_load_from_buffer()) with CVM_ERROR.
+ */
+void error(wchar_t* message);
+
+/**
+ * Returns the length in bytes of the instruction at the specified code
+ * address, or 0 if its opcode is not valid.
+ */
+int instructionLength(int address);
+
+/**
+ * Returns the int operand at the specified code address.
+ */
+int getIntOperandAtAddr(int address);
+
+/**
+ * Returns the int at the specified memory address.
+ */
+int getIntAtAddr(int address);
+
+/**
+ * Returns the char operand at the specified code address.
+ */
+wchar_t getCharOperandAtAddr(int address);
+
+/**
+ * Returns the char at the specified memory address.
+ */
+wchar_t getCharAtAddr(int address);
+
+/**
+ * Writes the char to the specified memory address.
+ */
+void putCharToAddr(wchar_t value, int address);
+
+/**
+ * Returns true if the opcode is a branch or call with a relative target.
+ */
+bool isRelativeJumpOpcode(int opcode);
+
+/**
+ * Verifies the loaded program and records the stack growth of each
+ * procedure in the current context.  Returns false if the program could
+ * not be verified (see verify.c).
+ */
+bool verifyProgram();
+
+/**
+ * Saves the code segment and inserts the traps for a snapshot.
+ */
+void insertTraps();
+
+/**
+ * Removes the traps inserted by insertTraps(), if any.
+ */
+void removeTraps();
+
+/**
+ * Executes TRAP: writes a snapshot of the machine (see snapshot.c).
+ */
+void takeSnapshot();
+
+/**
+ * Loads a snapshot image into memory and the registers.
+ */
+void restoreImage(const void* contents, size_t length);
+
+/**
+ * Reads the next character from the program's input; WEOF at end of input.
+ */
+wint_t inputChar();
+
+/**
+ * Reads an int from the program's input; returns the same values as wscanf().
+ */
+int inputInt(int* n);
+
+/**
+ * Reads a line of input into the chars at the memory address, storing at
+ * most capacity - 1 of them.  Returns the number of chars stored.
+ */
+int inputLine(int address, int capacity);
+
+/**
+ * Writes a character to the program's output buffer.
+ */
+void outputChar(wchar_t c);
+
+/**
+ * Writes the string of length chars at the memory address to the
+ * program's output buffer.
+ */
+void outputString(int address, int length);
+
+/**
+ * Encodes the string of length chars at the memory address as UTF-8, for
+ * outputBytes().  Returns the number of bytes, or -1 if it cannot be
+ * encoded in advance.
+ */
+int encodeString(int address, int length, char* out);
+
+/**
+ * Writes text encoded by encodeString() to the program's output buffer.
+ */
+void outputBytes(const char* bytes, size_t length);
+
+/**
+ * Writes an int in decimal to the program's output buffer.
+ */
+void outputInt(int n);
+
+/**
+ * Writes the program's buffered output (see io.c).
+ */
+void flushOutput();
+
+/**
+ * Sets the I/O callbacks for standard input and standard output.
+ */
+void setStdio(CvmIO* io);
+
+/**
+ * Sets the I/O callbacks for input from a buffer and output into memory.
+ */
+void setMemoryIO(CvmIO* io, CvmMemoryIO* memory, const char* input, size_t inputLength,
+                 bool keepOutput);
+
+/**
+ * Allocates the execution counts for profiling the loaded program.
+ */
+void allocateProfile();
+
+/**
+ * Frees the execution counts, the call graph, and the symbols.
+ */
+void freeProfile();
+
+/**
+ * Starts a run on the shadow call stack, with only the program active.
+ */
+void beginCallGraph();
+
+/**
+ * Records a call to the procedure at the code address.
+ */
+void enterProcedure(int address);
+
+/**
+ * Records a return from the innermost active procedure.
+ */
+void exitProcedure();
+
+/**
+ * Ends a run on the shadow call stack, and the procedures still active.
+ */
+void endCallGraph();
+
+/**
+ * Names the procedures called by the loaded program with the labels in
+ * its assembly listing.  Returns false if the listing does not match the
+ * program.
+ */
+bool loadSymbols(const char* contents, size_t length);
+
+/**
+ * Writes the profile report for the current context (see profile.c).
+ */
+void writeProfile(FILE* fp);
+
+/**
+ * Writes the call graph of the current context as folded stacks.
+ */
+void writeCallGraph(FILE* fp);
+
+/**
+ * Returns the label of the procedure at the code address (-1 for the
+ * program), or a name made up from the address in buffer, which must
+ * hold MAX_NAME_LENGTH chars.
+ */
+const char* procedureName(int procedure, char* buffer);
+
+/**
+ * Writes the disassembly of the instruction at the code address.
+ */
+void writeInstruction(FILE* fp, int address);
+
+/**
+ * Allocates the counts for sampling the loaded program.
+ */
+void allocateSamples();
+
+/**
+ * Frees the samples allocated by allocateSamples().
+ */
+void freeSamples();
+
+/**
+ * Starts the timer that samples the run (see sample.c).
+ */
+void beginSampling();
+
+/**
+ * Stops the timer that samples the run.
+ */
+void endSampling();
+
+/**
+ * Writes the sampling report for the current context.
+ */
+void writeSamples(FILE* fp);
+
+/**
+ * Opens the performance counters for the loaded program, where the
+ * platform allows it.
+ */
+void allocateCounters();
+
+/**
+ * Closes and frees the counters opened by allocateCounters().
+ */
+void freeCounters();
+
+/**
+ * Starts the counters and the timers for a run (see counters.c).
+ */
+void beginCounters();
+
+/**
+ * Stops the counters and adds the time of the run to the totals.
+ */
+void endCounters();
+
+/**
+ * Writes the counters of the current context, and each divided by the
+ * instructions executed if that is not 0.
+ */
+void writeCounters(FILE* fp, uint64_t instructions);
+
+/**
+ * Makes the runs of the current context write a trace to the file, in
+ * place of any trace file before, or stops tracing if filename is NULL.
+ * Returns false if the file cannot be opened.
+ */
+bool openTrace(const char* filename);
+
+/**
+ * Writes the records in the trace buffer.  Returns false if they could
+ * not be written.
+ */
+bool flushTrace();
+
+/**
+ * Writes the records in the trace buffer and closes the trace file, if any.
+ */
+void closeTrace();
+
+/**
+ * Adds a record for the instruction at the code address to the trace.
+ */
+void traceInstruction(int address, int opcode);
+
+/**
+ * Allocates zeroed memory of the specified size for the context, followed
+ * by a guard page where supported (see memory.c).  Returns false if out of
+ * memory.
+ */
+bool allocateMemory(CvmContext* context, size_t memorySize);
+
+/**
+ * Frees the memory allocated by allocateMemory().
+ */
+void freeMemory(CvmContext* context);
+
+/**
+ * Sets memory[from..] to zero, lazily where supported.
+ */
+void clearMemory(CvmContext* context, int from);
+
+/**
+ * Maps (or reads) a whole file.  Returns NULL if it cannot be read.
+ */
+const void* mapFile(const char* filename, size_t* length);
+
+/**
+ * Releases a file returned by mapFile().
+ */
+void unmapFile(const void* contents, size_t length);
+
+/**
+ * Reads a whole file into memory allocated with malloc().  Returns NULL
+ * if it cannot be read.
+ */
+char* readFile(const char* filename, size_t* length);
+
+/**
+ * Executes LDCSTR n; PUTSTR n, starting from the decoded LDCSTR.
+ */
+const Instruction* fusedPutLiteral(const Instruction* inst);
+
+/**
+ * Returns true if the decoded instruction is LDCSTR n and the next one is
+ * PUTSTR n.
+ */
+bool isPutLiteral(const Instruction* inst);
+
+/**
+ * Compiles the decoded program to native code and records it in the
+ * current context.  Returns false if the program cannot be compiled on
+ * this platform, in which case it must be run by one of the interpreters.
+ */
+bool jitCompile();
+
+/**
+ * Runs the program compiled by jitCompile().
+ */
+void runJit();
+
+/**
+ * Frees the native code of the current context.
+ */
+void jitFree();
+
+#endif